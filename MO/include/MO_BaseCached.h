@@ -11,12 +11,15 @@
  * measurements, log files) and/or heavily need to trigger immediate local action 
  * based on commands (get/set) from the backend.
  *
- * The provided plumbing currently can be grouped into four areas:
+ * The provided plumbing currently can be grouped into five areas:
  *
  *  (1) A data structure to represent the data of the MO's node tree
  *  (2) Methods to generate the (empty) node tree from a ddf (xml) file
  *  (3) Methods to generate JSON objects from the node tree for use in serialization in the protocol
  *  (4) very simple local getter/setter methods
+ *  (6) change tracking as defined in the MO Interface. Every change made through the
+ *      local setter methods (4) is recorded, so the protocol client library can send 
+ *      only the changed nodes to the server
  * 
  * Not currently provided but planned for future versions are:
  *
@@ -42,7 +45,10 @@
 #define GRANDMA_MO_BASECACHED_H
 
 #include "MO_Interface.h"
+#include "TreeVisitor.h"
 
+#include <cstdint>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -60,15 +66,56 @@ protected:
 /**
  *  @{
  *  (1) A data structure to represent the data of the MO's node tree
+ *
+ *  The nodes are kept in one flat table and refer to each other by their index in it,
+ *  so adding nodes never invalidates other nodes, and a big tree is a few large blocks
+ *  instead of several small allocations per node. Node names and leaf data are stored
+ *  in two string pools. Names never change and are shared by all nodes with the same 
+ *  name in the ddf file. Names of nodes added later are appended; when that has doubled
+ *  the pool, it is rebuilt from the names still in use, shared again, so the names of
+ *  removed nodes don't pile up. Data is overwritten in place if it fits, otherwise 
+ *  appended; the pool is compacted when more than half of it is no longer used. Slots 
+ *  of removed nodes are reused for new nodes.
  */
+  typedef uint32_t Index;
+  static const Index none = 0xffffffff;
+
   struct Node {
-    bool is_leaf;
-    std::string uri;
-    std::string data;
-    std::vector<Node> children;
+    Index parent = none;
+    Index first_child = none;
+    Index last_child = none;
+    Index next_sibling = none;
+    Index name = 0;             // offset of the name in names
+    Index name_length = 0;
+    Index data = 0;             // offset of the data in values
+    Index data_length = 0;
+    Index data_capacity = 0;    // bytes reserved for the data at offset data
+    bool is_leaf = true;
+    unsigned long version = 0;  // change_version() of the last change of this node, 0 if unchanged since creation from ddf
   };
 
-  Node root;
+  static const Index root = 0;
+  std::vector<Node> nodes;    // nodes[root] is the MO's root node
+  std::string names;          // name pool
+  size_t names_limit;         // size at which names is rebuilt, 0 while the tree is built from the ddf file
+  std::string values;         // data pool
+  size_t garbage;             // bytes in values not used by any node
+  Index free_nodes;           // removed nodes, linked by next_sibling
+
+  Index find_child(Index parent, const char *name, size_t length) const;
+  Index add_child(Index parent, const char *name, size_t length);
+  void release_subtree(Index node);
+  std::string node_name(Index node) const;
+  std::string node_data(Index node) const;
+  void set_node_data(Index node, const std::string &data);
+  void compact_values();
+  void compact_names();
+  void set_root_name(const std::string &name);
+
+public:
+  bool walk(TreeVisitor &visitor) const;
+protected:
+  bool walk(Index node, std::string &path, std::string &name, std::string &data, TreeVisitor &visitor) const;
 
 /** 
  *  @}
@@ -78,7 +125,7 @@ protected:
 public:
   BaseCached(std::string ddf_filename);
 protected:
-  Node generate_node_from_ddf(const tinyxml2::XMLElement * const xml_node);
+  void generate_node_from_ddf(const tinyxml2::XMLElement * const xml_node, Index parent, std::map<std::string, Index> &interned);
   void generate_tree_from_ddf(std::string filename);
   std::string xml_descend_safely(const tinyxml2::XMLElement*& node, const std::vector<std::string> &path) const;
 
@@ -91,7 +138,7 @@ public:
   // this method is defined in the MO Interface
   virtual nlohmann::json serialize_json() const;
 protected:
-  nlohmann::json serialize_children(std::vector<Node> children) const;
+  nlohmann::json serialize_children(Index node) const;
 
 /** 
  *  @}
@@ -101,6 +148,7 @@ protected:
 public:
   void local_set_node(const std::string node_path, const std::string data, const bool add_missing_node = false);
   std::string local_get_node(const std::string node_path) const;
+  void local_remove_node(const std::string node_path);
 
 /** 
  *  @}
@@ -109,6 +157,24 @@ public:
  */
 // TODO
 
+/** 
+ *  @}
+ *  @{
+ *  (6) change tracking
+ */
+private:
+  std::string epoch;
+  unsigned long version;
+  std::map<std::string, unsigned long> removed_nodes;  // path -> version of removal
+
+public:
+  // these methods are defined in the MO Interface
+  virtual std::string change_epoch() const;
+  virtual unsigned long change_version() const;
+  virtual bool changed_nodes(unsigned long since, std::vector<std::string> &changed, std::vector<std::string> &removed);
+protected:
+  void collect_changed(Index node, std::string &path, unsigned long since, std::vector<std::string> &changed) const;
+
 };
 
 /**
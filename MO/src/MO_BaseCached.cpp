@@ -9,10 +9,12 @@
 
 #include "MO_BaseCached.h"
 
-#include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <iomanip>
+#include <random>
 
-#include "Helper.h"
+#include "Log.h"
 
 namespace Grandma {
 namespace MO {
@@ -20,10 +22,36 @@ namespace MO {
 using namespace tinyxml2;
 using namespace nlohmann;
 
-BaseCached::BaseCached(std::string ddf_filename) {
-  root.is_leaf = true;
+const BaseCached::Index BaseCached::none;
+const BaseCached::Index BaseCached::root;
+
+namespace {
+
+  // find the next segment of a path, split like Helper::vectorize_path() does, without
+  // copying it. The first segment starts at 0, or 1 if the path starts with '/'.
+  bool next_segment(const std::string &path, size_t start, size_t &end) {
+    if(start >= path.size()) return false;
+    end = path.find('/', start);
+    if(end == std::string::npos) end = path.size();
+    return true;
+  }
+
+  size_t first_segment(const std::string &path) {
+    return !path.empty() && path[0] == '/' ? 1 : 0;
+  }
+
+}
+
+BaseCached::BaseCached(std::string ddf_filename) : nodes(1), names_limit(0), garbage(0), free_nodes(none), version(0) {
+  // a new epoch for every instance: the change history is not persisted, so versions
+  // of a previous run of the application must not be compared with ours
+  std::random_device random;
+  epoch = std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + "-" + std::to_string(random());
+
+  nodes[root].is_leaf = true;
   generate_tree_from_ddf(ddf_filename);
-  std::cout << "CachedBase MO created tree from ddf: " << std::endl << std::setw(2) << serialize_json() << std::endl;
+  names_limit = std::max<size_t>(2 * names.size(), 4096);
+  LOG_TRACE("CachedBase MO created tree from ddf: " << '\n' << std::setw(2) << serialize_json());
 }
 
 /**
@@ -39,31 +67,83 @@ BaseCached::BaseCached(std::string ddf_filename) {
  * @param[in] node_path - path (relative to this MO's root) of the node to set
  * @param[in] data - raw data (in a std::string) to write into the cached node
  * @param[in] add_missing_node - set to true to create non-existing nodes. If false, setting of non-existing nodes will silently fail (with a logged warning).
+ *
+ * Setting a node to a different value, or adding it, counts as a change (see change_version()).
  */
 void BaseCached::local_set_node(const std::string node_path, const std::string data, const bool add_missing_node) 
 {
-  // convert path into a vector of segments ("A/B/C" -> {"A", "B", "C"})
-  const std::vector<std::string> path = Helper::vectorize_path(node_path); 
+  Index node = root; // "iterator" used to point to the current node while descending into the tree
+  bool added = false;
 
-  Node *node = &root; // "iterator" used to point to the current node while descending into the tree
-
-  for(auto segment : path) {
-    auto node_it = find_if(node->children.begin(), node->children.end(), 
-			    [&segment](const Node &child){return child.uri == segment;});
-    if(node_it == node->children.end()) {
+  size_t end;
+  for(size_t start = first_segment(node_path); next_segment(node_path, start, end); start = end + 1) {
+    Index child = find_child(node, node_path.data() + start, end - start);
+    if(child == none) {
       if(add_missing_node) {
-	Node temp_node;
-	temp_node.uri = segment;
-	node->children.push_back(temp_node);
-	node_it = node->children.end()-1;
+	child = add_child(node, node_path.data() + start, end - start);
+	added = true;
       } else {
-	std::cout << "Warning: trying to set non-existing node " << node_path << std::endl;
+	LOG_WARNING("Warning: trying to set non-existing node " << node_path);
 	return;
       }
     }
-    node = &*node_it;
+    node = child;
+  }
+  if(added || nodes[node].data_length != data.size() || values.compare(nodes[node].data, data.size(), data) != 0) {
+    nodes[node].version = ++version;
+    // "/A/B/C", the form used for change tracking
+    std::string normalized_path;
+    for(size_t start = first_segment(node_path); next_segment(node_path, start, end); start = end + 1) {
+      normalized_path += "/";
+      normalized_path.append(node_path, start, end - start);
+    }
+    removed_nodes.erase(normalized_path);
+    set_node_data(node, data);
   }
-  node->data = data;
+}
+
+/**
+ * @brief Remove cached node (and all its children) from local application
+ *
+ * Removing a node that doesn't exist does nothing. The removal is recorded for
+ * change tracking, see changed_nodes().
+ *
+ * @param[in] node_path - path (relative to this MO's root) of the node to remove
+ */
+void BaseCached::local_remove_node(const std::string node_path)
+{
+  size_t end;
+  size_t start = first_segment(node_path);
+  if(!next_segment(node_path, start, end)) {
+    LOG_WARNING("Warning: trying to remove root node of MO");
+    return;
+  }
+
+  Index node = root;
+  std::string normalized_path;
+
+  for(; next_segment(node_path, start, end); start = end + 1) {
+    normalized_path += "/";
+    normalized_path.append(node_path, start, end - start);
+    node = find_child(node, node_path.data() + start, end - start);
+    if(node == none) {
+      return;
+    }
+  }
+
+  // unlink the node from its siblings
+  Node &parent = nodes[nodes[node].parent];
+  if(parent.first_child == node) {
+    parent.first_child = nodes[node].next_sibling;
+    if(parent.last_child == node) parent.last_child = none;
+  } else {
+    Index previous = parent.first_child;
+    while(nodes[previous].next_sibling != node) previous = nodes[previous].next_sibling;
+    nodes[previous].next_sibling = nodes[node].next_sibling;
+    if(parent.last_child == node) parent.last_child = previous;
+  }
+  release_subtree(node);
+  removed_nodes[normalized_path] = ++version;
 }
 
 /**
@@ -88,24 +168,218 @@ void BaseCached::local_set_node(const std::string node_path, const std::string d
  */
 std::string BaseCached::local_get_node(const std::string node_path) 
 const {
+  Index node = root; // "iterator" used to point to the current node while descending into the tree
 
-  // convert path into a vector of segments ("A/B/C" -> {"A", "B", "C"})
-  const std::vector<std::string> path = Helper::vectorize_path(node_path); 
+  size_t end;
+  for(size_t start = first_segment(node_path); next_segment(node_path, start, end); start = end + 1) {
+    node = find_child(node, node_path.data() + start, end - start);
+    if(node == none) {
+      LOG_WARNING("Warning: trying to get non-existing node " << node_path);
+      return "";
+    }
+  }
+  return node_data(node);
+}
 
-  const Node *node = &root; // "iterator" used to point to the current node while descending into the tree
+/**
+ * @{
+ * (1) node table - helper methods
+ */
 
-  for(auto segment : path) {
-    auto node_it = find_if(node->children.begin(), node->children.end(), 
-			    [&segment](const Node &child){return child.uri == segment;});
-    if(node_it == node->children.end()) {
-      std::cout << "Warning: trying to get non-existing node " << node_path << std::endl;
-      return "";
+/**
+ * @return index of the first child of parent with the given name, none if there is none
+ */
+BaseCached::Index BaseCached::find_child(Index parent, const char *name, size_t length)
+const {
+  for(Index child = nodes[parent].first_child; child != none; child = nodes[child].next_sibling) {
+    const Node &node = nodes[child];
+    if(node.name_length == length && names.compare(node.name, length, name, length) == 0) return child;
+  }
+  return none;
+}
+
+/**
+ * @brief Append a new, empty leaf node to the children of parent
+ *
+ * @return index of the new node
+ */
+BaseCached::Index BaseCached::add_child(Index parent, const char *name, size_t length) {
+  Index child;
+  if(free_nodes != none) {
+    child = free_nodes;
+    free_nodes = nodes[child].next_sibling;
+    nodes[child] = Node();
+  } else {
+    child = nodes.size();
+    nodes.emplace_back();
+  }
+
+  if(names_limit && names.size() + length > names_limit) compact_names();
+  Node &node = nodes[child];
+  node.parent = parent;
+  node.name = names.size();
+  node.name_length = length;
+  names.append(name, length);
+
+  Node &parent_node = nodes[parent];
+  parent_node.is_leaf = false;
+  if(parent_node.last_child == none) {
+    parent_node.first_child = child;
+  } else {
+    nodes[parent_node.last_child].next_sibling = child;
+  }
+  parent_node.last_child = child;
+  return child;
+}
+
+/**
+ * @brief Put an (already unlinked) node and its children on the list of free nodes
+ *
+ * Their data becomes garbage. Their names stay in the pool, they may be shared.
+ */
+void BaseCached::release_subtree(Index node) {
+  std::vector<Index> pending{node};
+  while(!pending.empty()) {
+    Index current = pending.back();
+    pending.pop_back();
+    for(Index child = nodes[current].first_child; child != none; child = nodes[child].next_sibling) {
+      pending.push_back(child);
     }
-    node = &*node_it;
+    garbage += nodes[current].data_capacity;
+    nodes[current] = Node();
+    nodes[current].next_sibling = free_nodes;
+    free_nodes = current;
+  }
+}
+
+std::string BaseCached::node_name(Index node)
+const {
+  return names.substr(nodes[node].name, nodes[node].name_length);
+}
+
+std::string BaseCached::node_data(Index node)
+const {
+  return values.substr(nodes[node].data, nodes[node].data_length);
+}
+
+/**
+ * @brief Store the data of a node, in place if it fits into the space it has
+ */
+void BaseCached::set_node_data(Index node, const std::string &data) {
+  Node &current = nodes[node];
+  if(data.size() <= current.data_capacity) {
+    values.replace(current.data, data.size(), data);
+    current.data_length = data.size();
+    return;
   }
-  return node->data;
+  garbage += current.data_capacity;
+  current.data_capacity = 0;
+  current.data_length = 0;
+  if(garbage > 4096 && garbage > values.size() / 2) compact_values();
+
+  current.data = values.size();
+  current.data_length = current.data_capacity = data.size();
+  values += data;
 }
 
+/**
+ * @brief Rewrite the data pool with only the data of existing nodes
+ */
+void BaseCached::compact_values() {
+  std::string compacted;
+  compacted.reserve(values.size() - garbage);
+  for(Node &node : nodes) {
+    if(!node.data_capacity) continue;
+    size_t offset = compacted.size();
+    compacted.append(values, node.data, node.data_length);
+    node.data = offset;
+    node.data_capacity = node.data_length;
+  }
+  values.swap(compacted);
+  garbage = 0;
+}
+
+/**
+ * @brief Rewrite the name pool with only the names of existing nodes, each name once
+ *
+ * Names are never released individually, as nodes share them. Rebuilding the pool
+ * whenever it has doubled keeps it proportional to the names in use, at amortized 
+ * constant cost per added node.
+ */
+void BaseCached::compact_names() {
+  std::string compacted;
+  std::map<std::string, Index> interned;
+  for(Index index = 0; index < nodes.size(); ++index) {
+    Node &node = nodes[index];
+    if(index != root && node.parent == none) continue;  // on the free list
+    auto pooled = interned.emplace(names.substr(node.name, node.name_length), compacted.size());
+    if(pooled.second) compacted.append(names, node.name, node.name_length);
+    node.name = pooled.first->second;
+  }
+  names.swap(compacted);
+  names_limit = std::max<size_t>(2 * names.size(), 4096);
+}
+
+/**
+ * @brief Walk the whole node tree, see TreeVisitor
+ *
+ * The paths start with "/" and are relative to the MO's root, the root itself is
+ * not visited. Leaves are visited with their data.
+ *
+ * @return false if the visitor stopped the walk
+ */
+bool BaseCached::walk(TreeVisitor &visitor)
+const {
+  std::string path, name, data;
+  return walk(root, path, name, data, visitor);
+}
+
+/**
+ * @brief Walk the subtree below a node
+ *
+ * @param[in] node - the node whose children (and their children...) are visited
+ * @param[in,out] path - full path of node. Used as buffer for the paths of the
+ *    visited nodes, so it is unchanged when this returns.
+ * @param[in,out] name, data - buffers for the visited nodes' names and data
+ */
+bool BaseCached::walk(Index node, std::string &path, std::string &name, std::string &data, TreeVisitor &visitor)
+const {
+  const size_t length = path.size();
+  for(Index child = nodes[node].first_child; child != none; child = nodes[child].next_sibling) {
+    const Node &current = nodes[child];
+    name.assign(names, current.name, current.name_length);
+    path += "/";
+    path += name;
+    bool ok;
+    if(current.is_leaf) {
+      data.assign(values, current.data, current.data_length);
+      ok = visitor.leaf(path, name, &data);
+    } else {
+      ok = visitor.enter(path, name) && walk(child, path, name, data, visitor);
+      if(ok) {
+        name.assign(names, current.name, current.name_length);  // the children used the buffer
+        ok = visitor.leave(path, name);
+      }
+    }
+    path.resize(length);
+    if(!ok) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Set the name of the MO's root node, as used in serialize_json()
+ */
+void BaseCached::set_root_name(const std::string &name) {
+  nodes[root].name = names.size();
+  nodes[root].name_length = name.size();
+  names += name;
+}
+
+/**
+ * @}
+ */
+
 /**
  * @brief Parse the ddf file and generate empty node structure in MO
  * 
@@ -123,48 +397,63 @@ const {
 void BaseCached::generate_tree_from_ddf(const std::string filename) {
   XMLDocument ddf_file;
   if(ddf_file.LoadFile(filename.c_str()) != XML_SUCCESS) {
-    std::cout << "ERROR: BaseCached: Failed opening ddf file." << std::endl;
+    LOG_ERROR("ERROR: BaseCached: Failed opening ddf file.");
     return;
   }
 
   const XMLElement * xmlnode = ddf_file.FirstChildElement("MgmtTree");
   const std::string segment = xml_descend_safely(xmlnode, {"Node"});
   if(!xmlnode) {
-    std::cout << "ERROR: BaseCached: Error parsing ddf file <MgmtTree><Node>..." << std::endl;
+    LOG_ERROR("ERROR: BaseCached: Error parsing ddf file <MgmtTree><Node>...");
     return;
   }
 
+  std::map<std::string, Index> interned;  // offset of each name in the pool
   for(const XMLElement * child = xmlnode->FirstChildElement("Node"); child != NULL; child = child->NextSiblingElement("Node")) {
-    root.is_leaf = false;
-    root.children.push_back(generate_node_from_ddf(child));
+    nodes[root].is_leaf = false;
+    generate_node_from_ddf(child, root, interned);
   }
+  nodes.shrink_to_fit();
+  names.shrink_to_fit();
+  values.shrink_to_fit();
 }
 
 /**
  * @brief DDF File parsing: recursively descend into node structure
  *
  * This is the main method for parsing the ddf file into an empty MO node tree.
- * It descends recursively into the ddf file's xml structure, and generates
- * Node strucs into the MO's representation of the node tree (starting at this class' 
- * root attribute)
+ * It descends recursively into the ddf file's xml structure, and adds a node to
+ * the MO's node table for each <Node> element.
  *
  * @param[in] xmlnode - xml element on current level of recursion
- * @return Node struct repersenting input xmlnode and all its recursive child nodes
+ * @param[in] parent - index of the node to add the node for xmlnode (and its children) to
+ * @param[in,out] interned - names added to the name pool so far, so nodes with the same name share it
  */
-BaseCached::Node BaseCached::generate_node_from_ddf(const XMLElement * const xmlnode) 
+void BaseCached::generate_node_from_ddf(const XMLElement * const xmlnode, Index parent, std::map<std::string, Index> &interned) 
 {
-  Node node; // returned object of this method
-
   // according to DTD the <NodeName> child is mandatory (but may be empty). I have seen
   // at least one ddf file with this mandatory node missing in some Nodes, so we handle
   // this as if it was present but empty
+  std::string name;
   auto name_node = xmlnode->FirstChildElement("NodeName");
   if(name_node && name_node->GetText()) {
-    node.uri = name_node->GetText();
+    name = name_node->GetText();
   } else {
-    node.uri = "*";
+    name = "*";
   }
 
+  // nodes only get their own copy of the name if it wasn't in the pool already
+  auto pooled = interned.find(name);
+  Index index = add_child(parent, "", 0);
+  if(pooled == interned.end()) {
+    nodes[index].name = names.size();
+    names += name;
+    interned.emplace(name, nodes[index].name);
+  } else {
+    nodes[index].name = pooled->second;
+  }
+  nodes[index].name_length = name.size();
+
   // each <Node> Element can represent either a leaf node or an interior node.
   // 
   // If the <DFProperties><DFFormat> Element exists, it will containt a <node> child element
@@ -173,35 +462,33 @@ BaseCached::Node BaseCached::generate_node_from_ddf(const XMLElement * const xml
   // according to DTD the <DFProperties> tree is not "required". If it is missing, we fall back
   // on checking if the current <Node> has any child <Node>s or not in order to define it as 
   // a interior node or leaf not respectively.
+  bool is_leaf;
   auto format_node = xmlnode;
   std::string segment = xml_descend_safely(format_node, {"DFProperties","DFFormat"});
   if(format_node) {	// DFFormat is present -> use it to define if we are a leaf node
     if(format_node->FirstChildElement("node")) {
-      node.is_leaf = false;
+      is_leaf = false;
     } else {
-      node.is_leaf = true;
+      is_leaf = true;
     }
   } else { // DFFormat is not present -> fall back on checking if child nodes exist to define if we are a leaf node
     if(xmlnode->FirstChildElement("Node")) {
-      node.is_leaf = false;
+      is_leaf = false;
     } else {
-      node.is_leaf = true;
+      is_leaf = true;
     }
   }
+  nodes[index].is_leaf = is_leaf;
 
-  if(node.is_leaf) {
+  if(is_leaf) {
     if(xmlnode->FirstChildElement("Value") && xmlnode->FirstChildElement("Value")->GetText()) {
-      node.data = xmlnode->FirstChildElement("Value")->GetText();
-    } else {
-      node.data = "";
+      set_node_data(index, xmlnode->FirstChildElement("Value")->GetText());
     }
   } else { // recursively iterate over children of lower levels
     for(const XMLElement * child = xmlnode->FirstChildElement("Node"); child != NULL; child = child->NextSiblingElement("Node")) {
-      node.children.push_back(generate_node_from_ddf(child));
+      generate_node_from_ddf(child, index, interned);
     }
   }
-
-  return node;
 }
 
 /**
@@ -242,35 +529,112 @@ const {
  * This returns a JSON object suitable for serialization according to the format
  * described in OMA-DM Protocol Spec V2.0 section 7.2.1.4 - management object serialization.
  * The output of this method corresponds to the MOData object in this specification.
- * Most of the actual work is done in the recursive serialize_children() method called from here
+ * Most of the actual work is done in serialize_children() (a walk of the tree) called from here
  * 
  * This method is defined in the MO "Interface"
  */
 json BaseCached::serialize_json() 
 const {
   json json_mo;
-  json_mo[root.uri] = serialize_children(root.children);
+  json_mo[node_name(root)] = serialize_children(root);
   return json_mo;
 }
 
+namespace {
+
+  // builds the MOData of serialize_json()
+  class JsonSerializer : public TreeVisitor {
+    std::vector<json> objects;  // objects of the interior nodes entered, the node walked from first
+
+  public:
+    JsonSerializer() : objects(1) {}
+
+    json &result() { return objects.front(); }
+
+    bool enter(const std::string &, const std::string &) {
+      objects.emplace_back();
+      return true;
+    }
+
+    bool leave(const std::string &, const std::string &name) {
+      json node = std::move(objects.back());
+      objects.pop_back();
+      objects.back()[name] = std::move(node);
+      return true;
+    }
+
+    bool leaf(const std::string &, const std::string &name, const std::string *data) {
+      objects.back()[name] = *data;
+      return true;
+    }
+  };
+
+}
+
+/**
+ * @brief Generate JSON object from the subtree below a node
+ *
+ * Helper function for serialize_json()
+ */
+json BaseCached::serialize_children(Index node)
+const {
+  std::string path, name, data;
+  JsonSerializer serializer;
+  walk(node, path, name, data, serializer);
+  return std::move(serializer.result());
+}
+
+
+/**
+ * @{
+ * (6) change tracking - see documentation of MO::Interface for the following methods
+ */
+std::string BaseCached::change_epoch()
+const {
+  return epoch;
+}
+
+unsigned long BaseCached::change_version()
+const {
+  return version;
+}
+
+bool BaseCached::changed_nodes(unsigned long since, std::vector<std::string> &changed, std::vector<std::string> &removed) {
+  if(since > version) return false;  // not a version of ours
+
+  std::string path;
+  collect_changed(root, path, since, changed);
+  for(auto &removed_node : removed_nodes) {
+    if(removed_node.second > since) removed.push_back(removed_node.first);
+  }
+  return true;
+}
+
 /**
- * @brief Recursively generate JSON object from this MO's node tree
+ * @brief Recursively collect the paths of leaf nodes changed after the given version
  *
- * Recursive helper function for serialize_json()
+ * Recursive helper function for changed_nodes(). Unlike walk() this needs the nodes'
+ * versions, so it has its own walk. path is used as buffer like in walk().
  */
-json BaseCached::serialize_children(std::vector<Node> children)
+void BaseCached::collect_changed(Index node, std::string &path, unsigned long since, std::vector<std::string> &changed)
 const {
-  json json_object;
-  for(Node &child : children) {
-    if(child.is_leaf) {
-      json_object[child.uri] = child.data;
+  const size_t length = path.size();
+  for(Index child = nodes[node].first_child; child != none; child = nodes[child].next_sibling) {
+    const Node &current = nodes[child];
+    if(current.is_leaf && current.version <= since) continue;
+    path += "/";
+    path.append(names, current.name, current.name_length);
+    if(current.is_leaf) {
+      changed.push_back(path);
     } else {
-      json_object[child.uri] = serialize_children(child.children);
+      collect_changed(child, path, since, changed);
     }
-  } 
-  return json_object;
+    path.resize(length);
+  }
 }
-
+/**
+ * @}
+ */
 
 } // namespace
 } // namespace
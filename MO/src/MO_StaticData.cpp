@@ -13,7 +13,7 @@ namespace Grandma {
 namespace MO {
 
 StaticData::StaticData(std::string mo_name, std::string ddf_filename) : BaseCached(ddf_filename) {
-  root.uri = mo_name;
+  set_root_name(mo_name);
 }
 
 /**
@@ -41,8 +41,8 @@ bool StaticData::set_val(const std::string node_path, const std::string data) {
 }
 
 bool StaticData::remove_node(const std::string node_path) {
-  (void)node_path;
-  return false;
+  local_remove_node(node_path);
+  return true;
 }
 
 bool StaticData::execute(const std::string node_path) {
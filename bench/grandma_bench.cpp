@@ -0,0 +1,457 @@
+/**
+ * Microbenchmarks for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Measures the core data paths of the library: path and URL parsing, node lookup in
+ * MO types and cached MOs, serialization of the MO tree, parsing of P2 packages and
+ * base64. Each benchmark runs on synthetic MO trees of several sizes, generated as DDF
+ * files with a fanout of 8 (so paths get longer with the size of the tree).
+ *
+ * For each benchmark and size, the time and the number of heap allocations (and the
+ * bytes allocated) per operation are reported. The heap memory held by data structures
+ * (e.g. the node tree of a cached MO) is reported separately. The results are written 
+ * as JSON to stdout (or the file given with --out), a readable table goes to stderr.
+ *
+ * Usage: grandma_bench [--sizes 10,1000,100000] [--min-time 0.2] [--repetitions 3]
+ *                      [--filter <substring>] [--label <text>] [--out <file>]
+ *
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include "base64.h"
+#include "Helper.h"
+#include "Log.h"
+#include "MO_StaticData.h"
+#include "MOHandler.h"
+#include "P2Parser.h"
+
+#ifndef GRANDMA_BENCH_REVISION
+#define GRANDMA_BENCH_REVISION "unknown"
+#endif
+
+/**
+ * @{
+ * Allocation counting: every allocation of the process (including the library) goes
+ * through these replacements of the global operator new and delete. live_bytes counts
+ * the usable size of the blocks, so it includes the allocator's rounding.
+ */
+namespace {
+  std::atomic<unsigned long long> allocations(0);
+  std::atomic<unsigned long long> allocated_bytes(0);
+  std::atomic<long long> live_bytes(0);
+}
+
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if(void *memory = std::malloc(size ? size : 1)) {
+    live_bytes.fetch_add(malloc_usable_size(memory), std::memory_order_relaxed);
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+  if(memory) live_bytes.fetch_sub(malloc_usable_size(memory), std::memory_order_relaxed);
+  std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+  operator delete(memory);
+}
+/**
+ * @}
+ */
+
+using namespace Grandma;
+
+namespace {
+
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    std::vector<size_t> sizes {10, 1000, 100000};
+    double min_time = 0.2;    // seconds per measurement
+    unsigned repetitions = 3;
+    std::string filter;
+    std::string label;
+    std::string out;
+  };
+
+  struct Result {
+    std::string name;
+    size_t size;
+    unsigned long long iterations;
+    double ns_per_op;         // median of the repetitions
+    double min_ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+  };
+
+  struct Footprint {
+    std::string name;
+    size_t size;
+    long long bytes;          // heap memory held
+    size_t nodes;
+  };
+
+  // keeps the compiler from optimizing away the benchmarked work
+  template <class T>
+  void keep(const T &value) {
+    asm volatile("" : : "r"(&value) : "memory");
+  }
+
+  /**
+   * @brief Synthetic MO tree with the given number of leaves, as DDF file
+   *
+   * Interior nodes have 8 children each, nodes are named N0 ... N7 on each level.
+   * The paths of all leaves (relative to the MO root) are collected.
+   */
+  class SyntheticTree {
+    std::string filename;
+    std::vector<std::string> leaves;
+    size_t nodes = 1;
+
+  public:
+    SyntheticTree(size_t size) {
+      const char *dir = std::getenv("TMPDIR");
+      filename = std::string(dir ? dir : "/tmp") + "/grandma_bench_" + std::to_string(::getpid()) + "_" + std::to_string(size) + ".ddf";
+
+      unsigned depth = 1;
+      for(size_t capacity = 8; capacity < size; capacity *= 8) ++depth;
+
+      std::ofstream ddf(filename);
+      ddf << "<?xml version=\"1.0\"?>\n<MgmtTree>\n  <VerDTD>1.2</VerDTD>\n  <Node>\n    <NodeName>bench</NodeName>\n"
+          << "    <DFProperties><DFFormat><node/></DFFormat></DFProperties>\n";
+      size_t remaining = size;
+      write_children(ddf, "", depth, remaining);
+      ddf << "  </Node>\n</MgmtTree>\n";
+    }
+
+    ~SyntheticTree() {
+      std::remove(filename.c_str());
+    }
+
+    const std::string &ddf() const { return filename; }
+    const std::vector<std::string> &leaf_paths() const { return leaves; }
+    size_t node_count() const { return nodes; }
+
+    // leaves spread over the whole tree, so lookups don't all hit the same nodes
+    std::vector<std::string> sample(size_t count) const {
+      std::vector<std::string> result;
+      size_t step = std::max<size_t>(1, leaves.size() / count);
+      for(size_t i = 0; i < count && i * step < leaves.size(); ++i) {
+        result.push_back(leaves[leaves.size() - 1 - i * step]);
+      }
+      return result;
+    }
+
+  private:
+    void write_children(std::ofstream &ddf, const std::string &prefix, unsigned depth, size_t &remaining) {
+      for(unsigned i = 0; i < 8 && remaining > 0; ++i) {
+        std::string name = "N" + std::to_string(i);
+        std::string path = prefix.empty() ? name : prefix + "/" + name;
+        ddf << "<Node><NodeName>" << name << "</NodeName>";
+        ++nodes;
+        if(depth > 1) {
+          ddf << "<DFProperties><DFFormat><node/></DFFormat></DFProperties>\n";
+          write_children(ddf, path, depth - 1, remaining);
+        } else {
+          ddf << "<DFProperties><DFFormat><chr/></DFFormat></DFProperties><Value>value of " << path << "</Value>";
+          leaves.push_back(path);
+          --remaining;
+        }
+        ddf << "</Node>\n";
+      }
+    }
+  };
+
+  class Runner {
+    const Options &options;
+    std::vector<Result> results;
+    std::vector<Footprint> footprints;
+
+  public:
+    Runner(const Options &options) : options(options) {}
+
+    const std::vector<Result> &get_results() const { return results; }
+    const std::vector<Footprint> &get_footprints() const { return footprints; }
+
+    /**
+     * @brief Measure the heap memory held by what build() returns
+     *
+     * @param[in] nodes - number of nodes in the structure, to report the bytes per node
+     */
+    template <class Build>
+    void footprint(const std::string &name, size_t size, size_t nodes, Build build) {
+      if(!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+
+      long long before = live_bytes.load();
+      auto built = build();
+      long long bytes = live_bytes.load() - before;
+      keep(built);
+      footprints.push_back(Footprint{name, size, bytes, nodes});
+
+      char line[160];
+      std::snprintf(line, sizeof(line), "%-26s %8zu %14lld bytes held %10.1f bytes/node\n",
+                    name.c_str(), size, bytes, static_cast<double>(bytes) / nodes);
+      std::cerr << line;
+    }
+
+    /**
+     * @brief Measure one benchmark
+     *
+     * @param[in] operation - does the benchmarked work once per call
+     */
+    template <class Operation>
+    void run(const std::string &name, size_t size, Operation operation) {
+      if(!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+
+      // find the number of iterations that takes about min_time
+      unsigned long long iterations = 1;
+      for(;;) {
+        double seconds = measure(operation, iterations);
+        if(seconds >= options.min_time / 10) {
+          iterations = std::max(1ULL, static_cast<unsigned long long>(iterations * options.min_time / seconds));
+          break;
+        }
+        iterations *= 10;
+      }
+
+      std::vector<double> ns_per_op;
+      unsigned long long allocs = 0, bytes = 0;
+      for(unsigned repetition = 0; repetition < std::max(1U, options.repetitions); ++repetition) {
+        unsigned long long allocs_before = allocations.load(), bytes_before = allocated_bytes.load();
+        double seconds = measure(operation, iterations);
+        allocs = allocations.load() - allocs_before;
+        bytes = allocated_bytes.load() - bytes_before;
+        ns_per_op.push_back(seconds * 1e9 / iterations);
+      }
+      std::sort(ns_per_op.begin(), ns_per_op.end());
+
+      Result result {name, size, iterations, ns_per_op[ns_per_op.size() / 2], ns_per_op.front(),
+                     static_cast<double>(allocs) / iterations, static_cast<double>(bytes) / iterations};
+      results.push_back(result);
+
+      char line[160];
+      std::snprintf(line, sizeof(line), "%-26s %8zu %14.1f ns %12.1f allocs %14.1f bytes\n",
+                    name.c_str(), size, result.ns_per_op, result.allocs_per_op, result.bytes_per_op);
+      std::cerr << line;
+    }
+
+  private:
+    template <class Operation>
+    double measure(Operation &operation, unsigned long long iterations) {
+      auto started = Clock::now();
+      for(unsigned long long i = 0; i < iterations; ++i) operation(i);
+      return std::chrono::duration<double>(Clock::now() - started).count();
+    }
+  };
+
+  void run_benchmarks(Runner &runner, size_t size) {
+    SyntheticTree tree(size);
+    const std::vector<std::string> paths = tree.sample(64);
+    const std::string &deepest = tree.leaf_paths().back();
+
+    // memory only, building it is dominated by parsing the DDF
+    runner.footprint("cached_tree", size, tree.node_count(), [&]() {
+      return std::make_shared<MO::StaticData>("bench", tree.ddf());
+    });
+
+    runner.run("vectorize_path", size, [&](unsigned long long) {
+      auto segments = Helper::vectorize_path(deepest);
+      keep(segments);
+    });
+
+    const std::string url = "https://dm.example.com:8443/bench/" + deepest + "?session=1";
+    runner.run("url_parse", size, [&](unsigned long long) {
+      Helper::URL parsed;
+      bool ok = parsed.parse_from_string(url);
+      keep(ok);
+    });
+
+    MOHandler handler("urn:oma:mo:bench:1.0", "");
+    handler.generate_tree_from_ddf(tree.ddf());
+    auto mo = std::make_shared<MO::StaticData>("bench", tree.ddf());
+    handler.add_instance(mo, "mi");
+
+    // find_node() is private, node_exists() is find_node() plus the instance lookup
+    std::vector<std::string> uris;
+    for(auto &path : paths) uris.push_back("mi/" + path);
+    runner.run("find_node", size, [&](unsigned long long i) {
+      bool exists = handler.node_exists(uris[i % uris.size()]);
+      keep(exists);
+    });
+
+    runner.run("serialize_MIs", size, [&](unsigned long long) {
+      auto serialized = handler.serialize_MIs();
+      keep(serialized);
+    });
+
+    runner.run("local_get_node", size, [&](unsigned long long i) {
+      auto value = mo->local_get_node(paths[i % paths.size()]);
+      keep(value);
+    });
+
+    runner.run("serialize_json", size, [&](unsigned long long) {
+      auto serialized = mo->serialize_json();
+      keep(serialized);
+    });
+
+    // every pass over the leaves switches to the other value, so each call really changes the
+    // node. The values differ in length, so data is overwritten in place as well as appended
+    const std::string values[2] = {"a new value", "a somewhat longer replacement value"};
+    runner.run("local_set_node", size, [&](unsigned long long i) {
+      mo->local_set_node(paths[i % paths.size()], values[(i / paths.size()) & 1]);
+    });
+
+    // one HGET per leaf, at most 10000
+    std::string package = "{\"CMD\":[";
+    size_t commands = std::min<size_t>(tree.leaf_paths().size(), 10000);
+    for(size_t i = 0; i < commands; ++i) {
+      if(i) package += ",";
+      package += "[\"HGET\",\"https://dm.example.com/data/" + std::to_string(i) + "\",\"urn:oma:mo:bench:1.0/mi/" + tree.leaf_paths()[i] + "\"]";
+    }
+    package += "]}";
+    runner.run("parse_P2", size, [&](unsigned long long) {
+      size_t parsed = 0;
+      P2Parser parser(Codec::Format::JSON, [&parsed](CommandQueue::Command &command) {
+        keep(command);
+        ++parsed;
+      });
+      bool ok = parser.parse(package);
+      keep(ok);
+      keep(parsed);
+    });
+
+    // 32 bytes of data per leaf
+    std::string data;
+    for(size_t i = 0; i < size * 32; ++i) data += static_cast<char>(i * 7);
+    const std::string encoded = base64_encode(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    runner.run("base64_encode", size, [&](unsigned long long) {
+      auto result = base64_encode(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+      keep(result);
+    });
+    runner.run("base64_decode", size, [&](unsigned long long) {
+      auto result = base64_decode(encoded);
+      keep(result);
+    });
+  }
+
+  bool parse_options(int argc, char *argv[], Options &options) {
+    for(int i = 1; i < argc; ++i) {
+      std::string option = argv[i];
+      if(i + 1 >= argc) {
+        std::cerr << "ERROR: missing value for " << option << std::endl;
+        return false;
+      }
+      std::string value = argv[++i];
+      if(option == "--sizes") {
+        options.sizes.clear();
+        std::stringstream list(value);
+        std::string size;
+        while(std::getline(list, size, ',')) {
+          if(std::strtoul(size.c_str(), nullptr, 10) > 0) options.sizes.push_back(std::strtoul(size.c_str(), nullptr, 10));
+        }
+      } else if(option == "--min-time") {
+        options.min_time = std::max(0.001, std::atof(value.c_str()));
+      } else if(option == "--repetitions") {
+        options.repetitions = std::strtoul(value.c_str(), nullptr, 10);
+      } else if(option == "--filter") {
+        options.filter = value;
+      } else if(option == "--label") {
+        options.label = value;
+      } else if(option == "--out") {
+        options.out = value;
+      } else {
+        std::cerr << "ERROR: unknown option " << option << std::endl;
+        return false;
+      }
+    }
+    return !options.sizes.empty();
+  }
+
+  nlohmann::json report(const Options &options, const std::vector<Result> &results, const std::vector<Footprint> &footprints) {
+    char date[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    nlohmann::json json;
+    json["context"] = {
+      {"date", date},
+      {"revision", GRANDMA_BENCH_REVISION},
+      {"label", options.label},
+      {"compiler", __VERSION__},
+      {"min_time_s", options.min_time},
+      {"repetitions", options.repetitions}
+    };
+    json["benchmarks"] = nlohmann::json::array();
+    for(auto &result : results) {
+      json["benchmarks"].push_back({
+        {"name", result.name},
+        {"size", result.size},
+        {"iterations", result.iterations},
+        {"ns_per_op", result.ns_per_op},
+        {"min_ns_per_op", result.min_ns_per_op},
+        {"allocs_per_op", result.allocs_per_op},
+        {"bytes_per_op", result.bytes_per_op}
+      });
+    }
+    json["memory"] = nlohmann::json::array();
+    for(auto &footprint : footprints) {
+      json["memory"].push_back({
+        {"name", footprint.name},
+        {"size", footprint.size},
+        {"nodes", footprint.nodes},
+        {"bytes", footprint.bytes},
+        {"bytes_per_node", static_cast<double>(footprint.bytes) / footprint.nodes}
+      });
+    }
+    return json;
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if(!parse_options(argc, argv, options)) {
+    std::cerr << "Usage: " << argv[0] << " [--sizes 10,1000,100000] [--min-time 0.2] [--repetitions 3] "
+              << "[--filter <substring>] [--label <text>] [--out <file>]" << std::endl;
+    return 1;
+  }
+
+  Log::set_level(Log::Level::Error);
+
+  Runner runner(options);
+  for(size_t size : options.sizes) run_benchmarks(runner, size);
+
+  std::string json = report(options, runner.get_results(), runner.get_footprints()).dump(2);
+  if(options.out.empty()) {
+    std::cout << json << std::endl;
+  } else {
+    std::ofstream out(options.out);
+    out << json << std::endl;
+    if(!out) {
+      std::cerr << "ERROR: could not write " << options.out << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -10,8 +10,11 @@
  * It will contain methods for adding alerts and for serializing them for sending
  * them to the server in P1 and P3. 
  *
- * It should later contain some logic for keeping track which alerts were 
- * successfully sent to the server, and then remove them from the queue (TODO)
+ * Alerts serialized into a package are in transit until the package's exchange
+ * with the server is over: acknowledge() removes them once the server received the
+ * package, release() queues them for the next package if it didn't. A package that
+ * is serialized again (e.g. the transport retries on a new connection) contains the
+ * same alerts again.
  *
  */
 
@@ -47,8 +50,11 @@ class AlertQueue {
 public:
 
   nlohmann::json package_alert_json();
+  void acknowledge();
+  void release();
 
   void add_alert(Alert alert);
+  void remove_alerts(const std::string &AlertType);
 
 };
 
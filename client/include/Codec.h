@@ -0,0 +1,76 @@
+/**
+ * Package encoding for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Protocol packages and MO data can be exchanged either as JSON text or in the
+ * binary CBOR encoding (RFC 7049) of the same data model. The encoding is signalled
+ * by the suffix of the content type, e.g. "application/vnd.oma.dm.initiation+json" or
+ * "application/vnd.oma.dm.initiation+cbor".
+ *
+ * The Codec class provides the mapping between formats and content types, and
+ * encoding/decoding of complete documents. The PackageWriter class allows writing
+ * a document piece by piece into a streamed body, e.g. for sending a package while
+ * it is still being built. For CBOR, it uses indefinite length maps and arrays,
+ * so nothing needs to be known about the size of a container when it is opened.
+ *
+ */
+#ifndef GRANDMA_CODEC_H
+#define GRANDMA_CODEC_H
+
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "Transport.h"
+
+namespace Grandma {
+
+class Codec {
+
+public:
+  enum class Format {
+    JSON,
+    CBOR
+  };
+
+  static const char *suffix(Format format);
+  static std::string content_type(const std::string &base, Format format);
+  static Format format_of(const std::string &content_type);
+
+  static std::string encode(const nlohmann::json &document, Format format);
+  static bool decode(const std::string &data, Format format, nlohmann::json &document);
+};
+
+class PackageWriter {
+
+  Codec::Format format;
+  const Transport::BodySink &sink;
+  std::string buffer;
+  std::vector<bool> first_in_container;  // JSON only: no separator needed before the next element
+  bool failed;
+
+public:
+
+  PackageWriter(Codec::Format format, const Transport::BodySink &sink);
+
+  bool begin_object();
+  bool key(const std::string &name);
+  bool begin_array();
+  bool value(const nlohmann::json &value);
+  bool string_value(const std::string &value);
+  bool end_object();
+  bool end_array();
+  bool flush();
+
+private:
+  void separate();
+  void append_string(const std::string &s);
+  bool end_container(char json_delimiter);
+  bool written();
+};
+
+} // namespace
+
+#endif
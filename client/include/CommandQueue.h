@@ -1,13 +1,28 @@
 #ifndef GRANDMA_COMMANDQUEUE_H
 #define GRANDMA_COMMANDQUEUE_H
 
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 
+#include "Codec.h"
+#include "ConnectionPool.h"
+#include "DownloadCache.h"
+#include "DownloadProgress.h"
+#include "DownloadSink.h"
 #include "MOTree.h"
+#include "WorkerPool.h"
 
 namespace Grandma {
 
+class SessionMetrics;
+
 class CommandQueue {
 
 public:
@@ -31,6 +46,20 @@ public:
     std::vector<std::string> parameter;
   };
 
+  // see set_download_sinks()
+  using SinkFactory = std::function<std::unique_ptr<DownloadSink>(const std::string &client_uri, const std::string &content_type, long long length)>;
+
+  struct TransferStats {
+    size_t command;                   // index of the command in its package
+    std::string url;
+    bool upload;                      // HPUT or HPOST
+    unsigned long long bytes;         // stored after decompression (HGET), or sent
+    unsigned long long wire_bytes;    // received or sent, 0 if taken from an identical HGET in the same package
+    unsigned long long duration_ns;
+
+    double throughput() const;        // bytes per second
+  };
+
 private:
 
   struct Status {
@@ -43,6 +72,22 @@ private:
   std::deque<Command> commands;
   std::deque<Status> responses;
 
+  // responses are produced by do_commands() and may be consumed concurrently (see next_status_json)
+  std::mutex responses_mutex;
+  std::condition_variable response_ready;
+  bool executing;
+
+  // commands may finish out of order, their statuses are held back until all earlier ones are done
+  size_t next_slot;                       // slot (command index) of the next status to release
+  std::map<size_t, Status> held_back;     // finished early, key is the slot
+
+  struct Execution;   // state of one do_commands() run, see source file
+  struct Download;    // one HGET download, shared by all HGETs of the same URL
+
+  unsigned max_parallel;    // commands executing at the same time (per queue)
+  unsigned max_per_origin;  // ... of which downloading from the same origin
+  std::mutex mo_mutex;      // serializes calls into the MO tree, MO implementations need not be thread safe
+
   struct URL {
     enum class Protocol {
       HTTP,
@@ -57,19 +102,67 @@ private:
   };
 
   MOTree &motree; 
+  ConnectionPool &connection_pool;
+  WorkerPool &worker_pool;
+  SessionMetrics &metrics;   // execution time of each command is recorded here
+
+  Codec::Format mo_format;  // preferred format of MO data received with HGET
+  SinkFactory sink_factory;
+  DownloadProgress download_progress;
+  DownloadCache download_cache;
+
+  mutable std::mutex stats_mutex;
+  std::vector<TransferStats> transfers;   // of the current or last package with commands
 
 public:
-  CommandQueue(MOTree &motree);
+  CommandQueue(MOTree &motree, ConnectionPool &connection_pool, WorkerPool &worker_pool, SessionMetrics &metrics);
+
+  void set_mo_format(Codec::Format format);
+  void set_concurrency(unsigned max_parallel, unsigned max_per_origin);
+  void set_download_sinks(SinkFactory factory);
+  void set_download_state_dir(const std::string &dir);
+  void set_download_cache_size(unsigned long long max_bytes);
+  DownloadCache::Stats download_cache_stats() const;
+  std::vector<TransferStats> transfer_stats() const;
 
   void push_command(Command);
+  void clear_commands();
 
   void do_commands();
+  std::future<void> do_commands_async();
 
   nlohmann::json p3_SC_json();
+  bool next_status_json(nlohmann::json &status);
 
 private:
 
-  void do_hget(std::vector<std::string> params);
+  void add_response(size_t slot, Status status);
+  nlohmann::json status_json(const Status &status) const;
+
+  void prepare(Execution &run) const;
+  static void work(std::shared_ptr<Execution> run, bool coordinator);
+  static bool take_ready(Execution &run, size_t &index);
+  static void finish_command(Execution &run, size_t index);
+  static void wake_helpers(std::shared_ptr<Execution> run);
+
+  Status execute(Execution &run, size_t index);
+  Status do_hget(Execution &run, size_t index, const std::vector<std::string> &params);
+  enum class Attempt {
+    Complete,
+    Interrupted,  // can be resumed
+    Failed
+  };
+
+  bool download(const Helper::URL &serverURL, const std::string &url, const std::string &client_uri, Download &result);
+  Attempt fetch(const Helper::URL &serverURL, const std::string &url, const std::string &client_uri, Download &result);
+  bool apply_cached(const std::string &client_uri, DownloadCache::Entry &cached, Download &result);
+  std::unique_ptr<DownloadSink> open_sink(const std::string &client_uri, const std::string &content_type, long long length, Download &result);
+  Status do_upload(size_t index, const Command &command);
+  void record_transfer(size_t index, const std::string &url, bool upload, unsigned long long bytes, unsigned long long wire_bytes, std::chrono::steady_clock::duration duration);
+
+  static std::string target_of(const Command &command);
+  static std::string origin_of(const Command &command);
+  static bool overlaps(const std::string &a, const std::string &b);
 
 };
 
@@ -0,0 +1,99 @@
+/**
+ * Content-Encoding support for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Streaming gzip/deflate compressor and decompressor (zlib) for package and transfer
+ * bodies. Both work piece by piece: each piece of input is (de)compressed into a
+ * small fixed size buffer and handed on to a sink right away, so a body never needs
+ * to be held in memory both compressed and uncompressed.
+ *
+ * Both also measure the amount of data and the CPU time spent, so that the
+ * compression ratio and cost per package can be reported.
+ *
+ */
+#ifndef GRANDMA_COMPRESSION_H
+#define GRANDMA_COMPRESSION_H
+
+#include <functional>
+#include <string>
+
+#include <zlib.h>
+
+namespace Grandma {
+
+class Compression {
+
+public:
+  // receives the next piece of (de)compressed output. Returns false to abort. Same as Transport::BodySink
+  using Sink = std::function<bool(const char *data, size_t length)>;
+
+  enum class Mode {
+    Off,      // never compress request bodies
+    Auto,     // compress request bodies once the server has shown that it supports gzip
+    Always    // always compress request bodies
+  };
+
+  enum class Encoding {
+    Identity,
+    Gzip,
+    Deflate
+  };
+
+  struct Stats {
+    unsigned long packages;
+    unsigned long long raw_bytes;   // uncompressed size
+    unsigned long long wire_bytes;  // compressed size
+    unsigned long long cpu_ns;      // CPU time spent in (de)compression
+
+    Stats();
+    void add(const Stats &other);
+    double ratio() const;           // wire_bytes / raw_bytes, 1.0 if nothing was compressed
+  };
+
+  static Encoding parse_encoding(const std::string &content_encoding);
+  static const char *encoding_name(Encoding encoding);
+  static bool accepts(const std::string &accept_encoding, Encoding encoding);
+
+  class Deflater {
+    z_stream stream;
+    bool ok;
+    Stats counters;
+
+  public:
+    Deflater(Encoding encoding, int level = Z_DEFAULT_COMPRESSION);
+    ~Deflater();
+    Deflater(const Deflater &) = delete;
+    Deflater &operator=(const Deflater &) = delete;
+
+    bool write(const char *data, size_t length, const Sink &sink);
+    bool finish(const Sink &sink);
+
+    const Stats &stats() const;
+
+  private:
+    bool run(int flush, const Sink &sink);
+  };
+
+  class Inflater {
+    z_stream stream;
+    bool ok;
+    bool ended;
+    Stats counters;
+
+  public:
+    Inflater();
+    ~Inflater();
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    bool write(const char *data, size_t length, const Sink &sink);
+    bool finish() const;
+
+    const Stats &stats() const;
+  };
+};
+
+} // namespace
+
+#endif
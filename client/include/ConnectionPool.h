@@ -0,0 +1,144 @@
+/**
+ * HTTP(S) connection pool for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * This class keeps persistent (keep-alive) http(s) client connections, keyed by
+ * their origin (scheme, host and port), so that consecutive packages of a session
+ * and the HGET/HPUT/HPOST transfers triggered by server commands can reuse already
+ * established TCP and TLS connections instead of paying the handshakes again for
+ * every single request.
+ *
+ * Connections are handed out as Lease objects, which give exclusive use of one
+ * connection and return it to the pool when they go out of scope. The number of
+ * connections per origin is limited; if all connections to an origin are in use,
+ * acquire() will block until one is returned. Connections that have been idle for
+ * longer than the idle timeout are closed instead of being reused.
+ *
+ * Connections are kept in two separate lanes with their own limits: one for the
+ * protocol packages of sessions, and one for transfers (HGET, HPUT, HPOST). A session
+ * keeps its package connection busy while the commands of a round execute (the P3
+ * package is streamed while commands are still running), so if both shared a limit,
+ * sessions could end up waiting for their own transfers to get a connection.
+ *
+ * One pool is meant to be shared by all DMClient instances of a process (see shared()).
+ *
+ * New https connections get the pool's TlsSessionCache attached, so that even
+ * after a connection was closed, the next one to the same server can resume the
+ * TLS session.
+ *
+ */
+#ifndef GRANDMA_CONNECTIONPOOL_H
+#define GRANDMA_CONNECTIONPOOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Helper.h"
+#include "TlsSessionCache.h"
+
+namespace httplib {
+  class Client;
+}
+
+namespace Grandma {
+
+class ConnectionPool {
+
+public:
+  enum class Lane {
+    Session,  // protocol packages (P1, P3) to the DM server
+    Transfer  // HGET, HPUT, HPOST 
+  };
+
+  struct Stats {
+    unsigned long hits;     // acquire() served by an idle pooled connection
+    unsigned long misses;   // acquire() had to open a new connection
+    unsigned long waits;    // acquire() had to wait for the per-origin limit
+    unsigned long expired;  // idle connections closed because of the idle timeout
+    unsigned long discarded;// connections dropped by their user (e.g. after errors)
+    unsigned open;          // connections currently open (idle or leased)
+    unsigned idle;          // connections currently idle in the pool
+  };
+
+  /**
+   * Exclusive handle on one pooled connection. Returns the connection to the
+   * pool on destruction unless discard() was called.
+   */
+  class Lease {
+    ConnectionPool *pool;
+    std::string origin;
+    std::unique_ptr<httplib::Client> client;
+
+  public:
+    Lease();
+    Lease(ConnectionPool *pool, std::string origin, std::unique_ptr<httplib::Client> client);
+    Lease(Lease &&other);
+    Lease &operator=(Lease &&other);
+    ~Lease();
+
+    httplib::Client *operator->() const;
+    httplib::Client &operator*() const;
+    explicit operator bool() const;
+
+    void discard();
+  };
+
+private:
+  struct IdleConnection {
+    std::unique_ptr<httplib::Client> client;
+    std::chrono::steady_clock::time_point last_used;
+  };
+
+  struct Origin {
+    std::vector<IdleConnection> idle; // most recently used connection at the back
+    unsigned open;
+
+    Origin();
+  };
+
+  unsigned max_per_origin;
+  std::chrono::seconds idle_timeout;
+
+  mutable std::mutex mutex;
+  std::condition_variable released;
+  std::map<std::string, Origin> origins;  // key is "<scheme>://<host>:<port>", prefixed with the lane
+
+  std::shared_ptr<TlsSessionCache> tls_sessions;
+
+  Stats counters;
+
+public:
+
+  ConnectionPool(unsigned max_per_origin = 4, std::chrono::seconds idle_timeout = std::chrono::seconds(30));
+  ~ConnectionPool();
+
+  ConnectionPool(const ConnectionPool &) = delete;
+  ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+  Lease acquire(const Helper::URL &url, Lane lane = Lane::Transfer);
+
+  void set_max_per_origin(unsigned max);
+  void set_idle_timeout(std::chrono::seconds timeout);
+  void purge_idle();
+
+  Stats stats() const;
+  TlsSessionCache &tls_session_cache();
+  void attach_tls_sessions(SSL_CTX *ctx, const std::string &origin);
+
+  static std::string origin_of(const Helper::URL &url);
+  static std::shared_ptr<ConnectionPool> shared();
+
+private:
+  void release(const std::string &origin, std::unique_ptr<httplib::Client> client, bool reusable);
+  void purge_idle_locked(Origin &origin, std::chrono::steady_clock::time_point now);
+};
+
+} // namespace
+
+#endif
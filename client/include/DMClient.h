@@ -22,40 +22,104 @@
 #ifndef GRANDMA_DMCLIENT_H
 #define GRANDMA_DMCLIENT_H
 
+#include <functional>
+#include <future>
 #include <string>
 
 #include "MOTree.h"
 #include "AlertQueue.h"
+#include "Codec.h"
 #include "CommandQueue.h"
+#include "ConnectionPool.h"
+#include "EventLoop.h"
 #include "Session.h"
+#include "SessionMetrics.h"
+#include "Transport.h"
+#include "TreeSyncState.h"
+#include "WorkerPool.h"
 
 namespace Grandma {
 
 class DMClient {
   std::string DevId;    // TODO: duplicate data with DevInfo MO.... remove once proper handling of DevInfo mandatory MO is finished
 
-  MOTree        motree;
-  CommandQueue  command_queue;
-  Session       session;
-  AlertQueue    alert_queue;
+  MOTree          motree;
+  std::shared_ptr<ConnectionPool> connection_pool;  // shared between clients, must be constructed 
+  std::shared_ptr<WorkerPool>     worker_pool;      // before the users below
+  std::shared_ptr<EventLoop>      event_loop;
+  SessionMetrics  metrics;          // recorded to by command_queue and session
+  CommandQueue    command_queue;
+  Session         session;
+  AlertQueue      alert_queue;
 
   bool  P1_dump_tree; // See comment on set_P1_dump_tree (in source file)
+  bool  P1_incremental_tree;
+  TreeSyncState                 tree_sync;
+  TreeSyncState::Versions       P1_tree_versions;  // versions of the MO instances sent in the current session's P1
 
 public:
 
   DMClient();
+  DMClient(std::shared_ptr<ConnectionPool> connection_pool, std::shared_ptr<WorkerPool> worker_pool);
 
   void register_DDF(std::string urn, std::string filename, std::string ddf_url = "");
   void add_MO(std::string urn, std::shared_ptr<MO::Interface> mo, std::string miid = "");
 
   void start_session(bool server_initiated = false);
+  std::future<bool> start_session_async(bool server_initiated = false, std::function<void(bool)> on_complete = nullptr);
+  Session::SessionState session_state() const;
 
-  void set_P1_dump_tree(bool enable = true);
+  void set_event_loop(std::shared_ptr<EventLoop> loop);
+
+  void set_P1_dump_tree(bool enable = true, bool incremental = false);
+  void set_tree_sync_dir(std::string dir);
 
   void set_device_id(std::string id);
+  bool set_server_url(std::string url);
+
+  void set_transport(std::shared_ptr<Transport> transport);
+
+  void set_package_format(Codec::Format format);
+  void set_compression(Compression::Mode mode);
+  Compression::Stats compression_stats(bool received = false) const;
+
+  void set_connection_limits(unsigned max_per_origin, unsigned idle_timeout_s);
+  ConnectionPool::Stats connection_stats() const;
+  void set_command_concurrency(unsigned max_parallel, unsigned max_per_origin);
+  void set_download_sinks(CommandQueue::SinkFactory factory);
+  void set_download_state_dir(std::string dir);
+  void set_download_cache_size(unsigned long long max_bytes);
+  DownloadCache::Stats download_cache_stats() const;
+  std::vector<CommandQueue::TransferStats> transfer_stats() const;
+  const SessionMetrics &session_metrics() const;
+  void reset_session_metrics();
+
+  void set_tls_session_dir(std::string dir);
+  TlsSessionCache::Stats tls_stats() const;
 
   void finish_bootstrap();
 
+private:
+
+  struct AsyncSession {
+    std::promise<bool> done;
+    std::function<void(bool)> on_complete;
+    SessionMetrics::Clock::time_point started;
+  };
+
+  void prepare_P1(bool server_initiated);
+  void settle_alerts(bool delivered);
+  bool write_P1(const Transport::BodySink &sink);
+  bool write_P3(const Transport::BodySink &sink);
+  void acknowledge_tree();
+  std::string tree_sync_key() const;
+
+  void async_send_P1(std::shared_ptr<AsyncSession> async, bool server_initiated);
+  void async_received_P2(std::shared_ptr<AsyncSession> async, bool received);
+  void async_handle_P2(std::shared_ptr<AsyncSession> async, bool received);
+  void async_send_P3(std::shared_ptr<AsyncSession> async);
+  void async_finish(std::shared_ptr<AsyncSession> async, bool success);
+  void async_abort(std::shared_ptr<AsyncSession> async, std::exception_ptr error);
 
 };
 
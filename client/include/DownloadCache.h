@@ -0,0 +1,81 @@
+/**
+ * Download cache for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Servers tend to send HGET for the same (configuration) data in every session. This
+ * class keeps the data received with HGET, keyed by URL, together with its validators
+ * (ETag, Last-Modified). The next HGET of the same URL is sent as a conditional request
+ * (If-None-Match, If-Modified-Since), and if the server answers "304 Not Modified", the
+ * cached data is applied to the target node without transferring it again.
+ *
+ * Only data that is collected in memory anyway (see DownloadSink) is cached, and only
+ * if the server sent a validator. The total size of the cached data is limited; when
+ * it is exceeded, the least recently used entries are evicted.
+ *
+ */
+#ifndef GRANDMA_DOWNLOADCACHE_H
+#define GRANDMA_DOWNLOADCACHE_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace Grandma {
+
+class DownloadCache {
+
+public:
+  struct Entry {
+    std::string content_type;
+    std::string etag;
+    std::string last_modified;
+    std::string data;
+  };
+
+  struct Stats {
+    unsigned long lookups;          // HGETs that consulted the cache
+    unsigned long hits;             // ... answered with 304, the cached data was used
+    unsigned long stores;
+    unsigned long evictions;
+    unsigned long long bytes_saved; // data not transferred thanks to hits
+    unsigned long entries;
+    unsigned long long bytes;       // size of the cached data
+
+    double hit_ratio() const;
+  };
+
+private:
+  mutable std::mutex mutex;
+  std::list<std::string> lru;       // URLs, most recently used first
+  struct Slot {
+    Entry entry;
+    std::list<std::string>::iterator position;  // in lru
+  };
+  std::unordered_map<std::string, Slot> slots;   // key is the URL
+  unsigned long long max_bytes;
+  unsigned long long bytes;
+
+  Stats counters;
+
+public:
+
+  DownloadCache(unsigned long long max_bytes = 4 * 1024 * 1024);
+
+  void set_max_bytes(unsigned long long max_bytes);
+
+  bool lookup(const std::string &url, Entry &entry);
+  void hit(const std::string &url, unsigned long long size);
+  void store(const std::string &url, Entry entry);
+  void remove(const std::string &url);
+
+  Stats stats() const;
+
+private:
+  void evict_locked();
+};
+
+} // namespace
+
+#endif
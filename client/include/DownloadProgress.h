@@ -0,0 +1,61 @@
+/**
+ * Progress of interrupted HGET downloads for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * When an HGET download into a resumable sink (see DownloadSink) fails partway, the
+ * data received so far stays in the sink, and this class remembers how much of which
+ * version of the resource it is. The next attempt (a retry in the same session, or an 
+ * HGET of the same URL to the same node in a later session) then only requests the
+ * rest with an HTTP Range request, made conditional on the resource not having 
+ * changed (If-Range with the ETag or Last-Modified of the first response).
+ *
+ * The progress is kept in memory and can optionally be persisted to a directory, so
+ * downloads can also be resumed after a restart of the application. It is saved every
+ * few MB while the download runs (after flushing the sink), not only when the download
+ * is interrupted, so this also works if the application was killed or crashed.
+ *
+ */
+#ifndef GRANDMA_DOWNLOADPROGRESS_H
+#define GRANDMA_DOWNLOADPROGRESS_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace Grandma {
+
+class DownloadProgress {
+
+public:
+  struct Entry {
+    std::string content_type;
+    std::string etag;             // validator of the resource, see If-Range
+    std::string last_modified;    // ... used if there is no ETag
+    long long length;             // of the whole resource, -1 if unknown
+    unsigned long long offset;    // bytes stored in the sink
+
+    Entry();
+    std::string validator() const;
+  };
+
+private:
+  mutable std::mutex mutex;
+  std::map<std::string, Entry> entries;  // key is "<url> <client uri>"
+  std::string persist_dir;
+
+public:
+
+  void set_persist_dir(const std::string &dir);
+
+  bool find(const std::string &key, Entry &entry);
+  void save(const std::string &key, const Entry &entry);
+  void forget(const std::string &key);
+
+private:
+  std::string persist_filename(const std::string &key) const;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,204 @@
+/**
+ * Download sinks for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Data received with HGET is passed to a DownloadSink piece by piece while it is being
+ * received, so the size of a download (e.g. a firmware package of several hundred MB)
+ * doesn't affect memory use. The CommandQueue chooses the sink for each download: MO
+ * data is always collected in memory (it needs to be decoded as a whole), other data
+ * goes to the sink the application's SinkFactory (see CommandQueue::set_download_sinks())
+ * returns, or to the writer the target MO provides (see MO::Interface::open_node_writer()).
+ * If there is neither, the data is collected in memory and set as the node value.
+ *
+ * The sinks provided here:
+ *  - MemorySink:     appends to a string
+ *  - FileSink:       writes to a file
+ *  - MmapSink:       copies into a memory mapped file, the file is sized up front if the
+ *                    length of the download is known
+ *  - NodeWriterSink: adapter for MO::Interface::NodeWriter, hashes the data while it is
+ *                    passed through, as it can't be read back for verification
+ *
+ * FileSink and MmapSink write to "<path>.part" and rename it to <path> only when the
+ * download completed and was verified, so <path> never contains incomplete data. They
+ * are resumable: when a download is interrupted, they keep "<path>.part", and a later
+ * attempt continues where it stopped (see DownloadProgress).
+ *
+ */
+#ifndef GRANDMA_DOWNLOADSINK_H
+#define GRANDMA_DOWNLOADSINK_H
+
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include <openssl/evp.h>
+
+#include "MO_Interface.h"
+
+namespace Grandma {
+
+class DownloadSink {
+public:
+  virtual ~DownloadSink() {}
+
+  /**
+   * @brief called once before the first write
+   * @param[in] content_type - content type of the data, after decompression
+   * @param[in] length - number of bytes that will be written, -1 if unknown
+   * @return false to abort the download
+   */
+  virtual bool begin(const std::string &content_type, long long length) = 0;
+  virtual bool write(const char *data, size_t length) = 0;
+
+  /**
+   * @brief called once when all data was written
+   * @return false if the data could not be stored
+   */
+  virtual bool finish() = 0;
+
+  /**
+   * @brief called instead of finish() if the download failed, data written so far is to be discarded
+   */
+  virtual void abort() = 0;
+
+  /**
+   * @brief check the complete data, called before finish()
+   *
+   * The default accepts any data, sinks that can read back what they stored should
+   * override it.
+   *
+   * @param[in] length - expected number of bytes, -1 if unknown
+   * @param[in] sha256 - expected SHA-256 digest (32 bytes), empty if unknown
+   * @return false if the data doesn't match, the download fails then
+   */
+  virtual bool verify(long long length, const std::string &sha256) {
+    (void)length; (void)sha256;
+    return true;
+  }
+
+  /**
+   * @{
+   * Optional support for resuming interrupted downloads
+   */
+  virtual bool resumable() const { return false; }
+
+  /**
+   * @brief number of bytes kept from an interrupted earlier download
+   */
+  virtual unsigned long long partial_size() { return 0; }
+
+  /**
+   * @brief called instead of begin() to continue an interrupted download
+   * @param[in] offset - bytes of the earlier download to keep, the following writes append to them
+   * @return false to abort the download
+   */
+  virtual bool resume(const std::string &content_type, long long length, unsigned long long offset) {
+    (void)content_type; (void)length; (void)offset;
+    return false;
+  }
+
+  /**
+   * @brief called instead of abort() when a download was interrupted, keep the data written so far
+   */
+  virtual void suspend() { abort(); }
+
+  /**
+   * @brief called periodically during a resumable download, before its progress is saved
+   *
+   * The data written so far must then survive the application being killed, so that
+   * a restarted application can resume from there.
+   * @return false if the data could not be written out, the progress is not saved then
+   */
+  virtual bool flush() { return true; }
+  /**
+   * @}
+   */
+};
+
+class MemorySink : public DownloadSink {
+  std::string &buffer;
+
+public:
+  MemorySink(std::string &buffer);
+
+  bool begin(const std::string &content_type, long long length) override;
+  bool write(const char *data, size_t length) override;
+  bool finish() override;
+  void abort() override;
+  bool verify(long long length, const std::string &sha256) override;
+};
+
+class FileSink : public DownloadSink {
+  std::string path;
+  std::ofstream file;
+  unsigned long long size;  // bytes in the file
+
+public:
+  FileSink(std::string path);
+  ~FileSink();
+
+  bool begin(const std::string &content_type, long long length) override;
+  bool write(const char *data, size_t length) override;
+  bool finish() override;
+  void abort() override;
+  bool verify(long long length, const std::string &sha256) override;
+
+  bool resumable() const override;
+  unsigned long long partial_size() override;
+  bool resume(const std::string &content_type, long long length, unsigned long long offset) override;
+  void suspend() override;
+  bool flush() override;
+};
+
+class MmapSink : public DownloadSink {
+  std::string path;
+  int fd;
+  char *region;
+  size_t capacity;  // size of file and mapping
+  size_t size;      // bytes written
+
+public:
+  MmapSink(std::string path);
+  ~MmapSink();
+  MmapSink(const MmapSink &) = delete;
+  MmapSink &operator=(const MmapSink &) = delete;
+
+  bool begin(const std::string &content_type, long long length) override;
+  bool write(const char *data, size_t length) override;
+  bool finish() override;
+  void abort() override;
+  bool verify(long long length, const std::string &sha256) override;
+
+  bool resumable() const override;
+  unsigned long long partial_size() override;
+  bool resume(const std::string &content_type, long long length, unsigned long long offset) override;
+  void suspend() override;
+  bool flush() override;
+
+private:
+  bool resize(size_t new_capacity);
+  void unmap();
+};
+
+class NodeWriterSink : public DownloadSink {
+  std::unique_ptr<MO::Interface::NodeWriter> writer;
+  unsigned long long size;  // bytes written
+  EVP_MD_CTX *digest;       // SHA-256 of the bytes written, the writer can't read them back
+
+public:
+  NodeWriterSink(std::unique_ptr<MO::Interface::NodeWriter> writer);
+  ~NodeWriterSink();
+  NodeWriterSink(const NodeWriterSink &) = delete;
+  NodeWriterSink &operator=(const NodeWriterSink &) = delete;
+
+  bool begin(const std::string &content_type, long long length) override;
+  bool write(const char *data, size_t length) override;
+  bool finish() override;
+  void abort() override;
+  bool verify(long long length, const std::string &sha256) override;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,96 @@
+/**
+ * Event loop for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * A single thread waiting on an epoll instance and running the handlers posted to
+ * it, one after the other. This is what drives asynchronous sessions (see
+ * DMClient::start_session_async): every step of a session's state machine runs as a
+ * handler on the loop, while blocking work (command execution, building packages)
+ * is handed to the WorkerPool, which posts the next step back to the loop when done.
+ *
+ * Besides posted handlers, the loop runs handlers for file descriptors registered
+ * with watch() whenever they become ready, and timers (run_after()). Transports use
+ * this for non-blocking sockets (see Transport::post_async()): while a session waits
+ * for the server's answer to a package, its socket sits in the epoll set, not in a
+ * worker. So the number of sessions waiting for the server at the same time is not
+ * bounded by the size of the worker pool.
+ *
+ * Handlers run strictly sequentially, so state that is only touched from handlers
+ * doesn't need locking. Handlers must not block.
+ *
+ */
+#ifndef GRANDMA_EVENTLOOP_H
+#define GRANDMA_EVENTLOOP_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace Grandma {
+
+class EventLoop {
+
+public:
+  using Clock = std::chrono::steady_clock;
+  // called with the ready events (EPOLLIN, EPOLLOUT, EPOLLERR...) of a watched file descriptor
+  using IoHandler = std::function<void(uint32_t events)>;
+  using WatchId = uint64_t;
+  using TimerId = uint64_t;
+
+private:
+  struct Watch {
+    int fd;
+    IoHandler handler;
+  };
+
+  int epoll_fd;
+  int wake_fd;  // eventfd, written to by post() to wake up the loop thread
+
+  std::mutex mutex;
+  std::deque<std::function<void()>> handlers;
+  bool stopping;
+
+  uint64_t last_id;                   // for watches and timers, 0 is the wakeup eventfd
+  std::map<WatchId, Watch> watches;
+  std::map<std::pair<Clock::time_point, TimerId>, std::function<void()>> timers;  // earliest first
+  std::map<TimerId, Clock::time_point> timer_deadlines;
+
+  std::thread thread;
+
+public:
+
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  void post(std::function<void()> handler);
+  bool in_loop_thread() const;
+
+  WatchId watch(int fd, uint32_t events, IoHandler handler);
+  bool modify(WatchId id, uint32_t events);
+  void unwatch(WatchId id);
+
+  TimerId run_after(Clock::duration delay, std::function<void()> handler);
+  void cancel(TimerId id);
+
+  static std::shared_ptr<EventLoop> shared();
+
+private:
+  void run();
+  void wake();
+  int wait_timeout();
+  void run_timers();
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * Non-blocking HTTP(S) connection for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * One keep-alive HTTP/1.1 connection to one server, driven by an EventLoop instead
+ * of a thread: the socket is non-blocking and registered with the loop, and connecting,
+ * the TLS handshake, sending the request and receiving the response each advance by
+ * as much as the socket allows whenever the loop reports it ready. Waiting for the
+ * server costs a file descriptor in the loop's epoll set, not a thread.
+ *
+ * This is what HttpTransport::post_async() uses for the protocol packages of
+ * asynchronous sessions. It only implements what that needs: one request at a time,
+ * with a body of known length. The response body may come with a Content-Length,
+ * chunked, or delimited by the end of the connection, and is passed on piece by piece
+ * as it is received.
+ *
+ * Like httplib (used for everything else), https connections verify the server
+ * certificate against the system's default CA store and the host name of the URL.
+ *
+ * All methods except the destructor must be called on the loop thread. Callbacks are
+ * called on the loop thread too. Objects must be owned by a std::shared_ptr.
+ *
+ */
+#ifndef GRANDMA_HTTPCONNECTION_H
+#define GRANDMA_HTTPCONNECTION_H
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include "EventLoop.h"
+#include "Helper.h"
+
+namespace Grandma {
+
+class HttpConnection : public std::enable_shared_from_this<HttpConnection> {
+
+public:
+  struct Response {
+    int status;
+    std::map<std::string, std::string> headers;   // names in lower case, repeated headers joined with ", "
+
+    std::string header(const std::string &name) const;
+  };
+
+  // called when status and headers of the response are received. Returns false to abort
+  using ResponseHandler = std::function<bool(const Response &response)>;
+  // receives the next piece of the response body (without transfer encoding). Returns false to abort
+  using ContentReceiver = std::function<bool(const char *data, size_t length)>;
+  // called when the response is complete (true), or the request failed (false)
+  using Completion = std::function<void(bool ok)>;
+
+  struct Request {
+    std::string method;
+    std::string path;
+    std::vector<std::pair<std::string, std::string>> headers;   // without Host and Content-Length
+    std::shared_ptr<const std::string> body;                    // may be null for no body
+    ResponseHandler response_handler;
+    ContentReceiver content_receiver;
+  };
+
+  static const std::chrono::seconds io_timeout;   // without progress, the request fails
+  static const std::chrono::seconds idle_timeout; // unused connections are closed after this
+
+private:
+  enum class State {
+    Closed,       // not connected (yet, or any more)
+    Connecting,
+    Handshaking,  // TLS
+    Sending,
+    Receiving,
+    Idle          // connected, ready for the next request
+  };
+
+  enum class Body {
+    Head,         // status line and headers not complete yet
+    Length,       // Content-Length bytes
+    ChunkSize,    // chunked: before the size line of the next chunk
+    ChunkData,
+    ChunkEnd,     // chunked: CRLF after the chunk data
+    Trailer,      // chunked: trailer lines after the last chunk
+    UntilClose    // everything up to the end of the connection
+  };
+
+  enum class Io {
+    Done,
+    WantRead,
+    WantWrite,
+    Closed,
+    Failed
+  };
+
+  EventLoop &loop;
+  const Helper::URL url;
+  sockaddr_storage address;
+  socklen_t address_length;
+  SSL_CTX *ssl_ctx;   // null for plain http. We hold a reference
+
+  State state;
+  int fd;
+  SSL *ssl;
+  EventLoop::WatchId watch_id;
+  EventLoop::TimerId timer_id;
+
+  Request request;
+  Completion done;
+  std::string head;   // request head still being sent
+  size_t sent;        // of head + body
+  bool keep_alive;    // the server keeps the connection open after the response
+  bool response_started;
+  bool connect_error;   // the last request failed before the connection was established
+  std::string error;
+
+  Response response;
+  Body body_state;
+  std::string received; // not yet parsed
+  uint64_t remaining;   // of the body or the current chunk
+
+public:
+
+  HttpConnection(EventLoop &loop, const Helper::URL &url, const sockaddr_storage &address, socklen_t address_length, SSL_CTX *ssl_ctx);
+  ~HttpConnection();
+
+  HttpConnection(const HttpConnection &) = delete;
+  HttpConnection &operator=(const HttpConnection &) = delete;
+
+  void send(const Request &request, Completion done);
+
+  bool idle() const;
+  bool connect_failed() const;
+  bool received_response() const;
+  const std::string &last_error() const;
+  EventLoop &event_loop() const;
+
+private:
+  void connect();
+  void on_ready(uint32_t events);
+  void advance();
+  bool send_some();
+  void receive_some();
+  bool parse();
+  bool parse_head(size_t length);
+  bool deliver(size_t length);
+  void complete();
+  void fail(const std::string &reason);
+  void finish(bool ok);
+  void close_socket();
+  void wait_for(uint32_t events);
+  void arm_timer(std::chrono::seconds timeout);
+
+  Io write_some(const char *data, size_t length, size_t &written);
+  Io read_some(char *data, size_t length, size_t &read);
+  Io ssl_result(int ret);
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * HTTP(S) transport for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Default Transport implementation. Packages are POSTed to the DM server URL, using
+ * a connection from the ConnectionPool, so consecutive packages of a session (and of
+ * following sessions) reuse the same keep-alive connection.
+ *
+ * Responses are passed on (and decompressed) piece by piece while they are received,
+ * also for requests whose body is streamed (Request::body_writer, or compression).
+ *
+ * post_async() doesn't use the pool: it sends the package over an HttpConnection, a
+ * non-blocking socket driven by the event loop, so that asynchronous sessions don't
+ * hold a thread while they wait for the server. The transport keeps that connection
+ * open (keep-alive) for the session's next package. The TLS sessions are shared with
+ * the pool's connections though (ConnectionPool::attach_tls_sessions()).
+ *
+ */
+#ifndef GRANDMA_HTTPTRANSPORT_H
+#define GRANDMA_HTTPTRANSPORT_H
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include <openssl/ssl.h>
+
+#include "ConnectionPool.h"
+#include "Helper.h"
+#include "Transport.h"
+
+namespace Grandma {
+
+class HttpConnection;
+
+class HttpTransport : public Transport {
+
+  struct AsyncPost;
+
+  ConnectionPool &connection_pool;
+  Helper::URL server_url;
+
+  std::atomic<bool> server_accepts_gzip;
+
+  // for post_async()
+  std::mutex async_mutex;
+  bool address_resolved;
+  sockaddr_storage server_address;
+  socklen_t server_address_length;
+  SSL_CTX *ssl_ctx;
+  std::shared_ptr<HttpConnection> idle_connection;  // kept open after the last package
+
+public:
+
+  HttpTransport(ConnectionPool &connection_pool, const Helper::URL &server_url);
+  virtual ~HttpTransport();
+
+  HttpTransport(const HttpTransport &) = delete;
+  HttpTransport &operator=(const HttpTransport &) = delete;
+
+  virtual bool post(const Request &request, Response &response);
+  virtual bool post_async(const Request &request, Response &response, EventLoop &loop, std::function<void(bool delivered)> done);
+
+private:
+  void learn_encodings(const std::string &content_encoding, const std::string &accept_encoding);
+  bool resolve(sockaddr_storage &address, socklen_t &length);
+  SSL_CTX *tls_context();
+  void start_async(std::shared_ptr<AsyncPost> post, bool fresh);
+  void finish_async(std::shared_ptr<AsyncPost> post, bool ok);
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,85 @@
+/**
+ * Logging for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Log messages are written with the LOG_TRACE() ... LOG_ERROR() macros, which take
+ * anything that can be streamed to a std::ostream:
+ *
+ *   LOG_DEBUG("HGET " << url << " returned " << status);
+ *
+ * Messages are filtered twice:
+ *  - at compile time, levels below GRANDMA_LOG_LEVEL (0 = Trace ... 4 = Error) are
+ *    compiled out completely
+ *  - at run time, levels below Log::set_level() (default Info) cost a relaxed atomic
+ *    load and a branch. The message is only formatted if it passes the filter.
+ *
+ * Formatted messages are put into a lock-free ring buffer and written by a background
+ * thread, so the thread logging doesn't wait for the console or a file. By default
+ * warnings and errors go to std::cerr, everything else to std::cout; an application can
+ * send them elsewhere with Log::set_sink(). If the ring is full, messages below Warning
+ * are dropped (the number dropped is logged later), warnings and errors wait for space.
+ * Errors also wait until they were written, so they are not lost if the program dies
+ * right after them. All messages are written when the program exits normally.
+ *
+ */
+#ifndef GRANDMA_LOG_H
+#define GRANDMA_LOG_H
+
+#include <atomic>
+#include <functional>
+#include <sstream>
+#include <string>
+
+#ifndef GRANDMA_LOG_LEVEL
+#define GRANDMA_LOG_LEVEL 0
+#endif
+
+namespace Grandma {
+
+namespace Log {
+
+  enum class Level {
+    Trace,
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off
+  };
+
+  using Sink = std::function<void(Level level, const std::string &message)>;
+
+  void set_level(Level level);
+  Level get_level();
+  void set_sink(Sink sink);
+  void flush();
+
+  void write(Level level, std::string message);
+
+  extern std::atomic<int> threshold;  // lowest level written, see set_level()
+
+  inline bool enabled(Level level) {
+    return static_cast<int>(level) >= threshold.load(std::memory_order_relaxed);
+  }
+
+} // namespace Log
+
+} // namespace
+
+#define GRANDMA_LOG(level, message) \
+  do { \
+    if(static_cast<int>(level) >= GRANDMA_LOG_LEVEL && ::Grandma::Log::enabled(level)) { \
+      std::ostringstream grandma_log_message; \
+      grandma_log_message << message; \
+      ::Grandma::Log::write(level, grandma_log_message.str()); \
+    } \
+  } while(0)
+
+#define LOG_TRACE(message)    GRANDMA_LOG(::Grandma::Log::Level::Trace, message)
+#define LOG_DEBUG(message)    GRANDMA_LOG(::Grandma::Log::Level::Debug, message)
+#define LOG_INFO(message)     GRANDMA_LOG(::Grandma::Log::Level::Info, message)
+#define LOG_WARNING(message)  GRANDMA_LOG(::Grandma::Log::Level::Warning, message)
+#define LOG_ERROR(message)    GRANDMA_LOG(::Grandma::Log::Level::Error, message)
+
+#endif
@@ -0,0 +1,42 @@
+/**
+ * In-process loopback transport for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * This Transport implementation doesn't use the network at all. Each package is
+ * handed directly to a server callback in the same process, and whatever the callback
+ * puts into the response is returned as the server's answer.
+ *
+ * This is meant for benchmarking the protocol engine (package building, parsing,
+ * command execution) without any socket or kernel overhead, and for running test
+ * scenarios like the one in test/server.cpp within a single process.
+ *
+ */
+#ifndef GRANDMA_LOOPBACKTRANSPORT_H
+#define GRANDMA_LOOPBACKTRANSPORT_H
+
+#include <functional>
+
+#include "Transport.h"
+
+namespace Grandma {
+
+class LoopbackTransport : public Transport {
+
+public:
+  // must fill in the response and return true, or return false to simulate a failed connection
+  using Handler = std::function<bool(const Request &request, Response &response)>;
+
+private:
+  Handler handler;
+
+public:
+
+  LoopbackTransport(Handler handler);
+
+  virtual bool post(const Request &request, Response &response);
+};
+
+} // namespace
+
+#endif
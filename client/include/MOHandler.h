@@ -18,54 +18,103 @@
 #include <nlohmann/json.hpp>
 #include "tinyxml2.h"
 
+#include "Codec.h"
 #include "MO_Interface.h"
+#include "TreeSyncState.h"
+#include "TreeVisitor.h"
 
 namespace Grandma {
 
+// part of a string, to look up keys of maps with std::less<> without copying them
+struct Substring {
+  const char *data;
+  size_t length;
+};
+
+inline bool operator<(const std::string &a, const Substring &b) { return a.compare(0, std::string::npos, b.data, b.length) < 0; }
+inline bool operator<(const Substring &a, const std::string &b) { return b.compare(0, std::string::npos, a.data, a.length) > 0; }
+
 class MOHandler {
 
   struct Node {
     bool is_leaf;
     std::string uri;
     std::vector<Node> children;
+    unsigned id;        // position of uri in segments
+    std::vector<std::pair<unsigned, unsigned> > child_index;  // (id, position in children) of each child, sorted by id
     //TODO: add type, access permissions, etc, not yet implemented.
   };
 
+  // position in a walk of a subtree that collects the paths of its leaves, see next_leaf_paths()
+  struct LeafCursor {
+    struct Level {
+      const Node *node;   // interior node entered
+      size_t next;        // position of its next child to visit
+      size_t length;      // length of path before node was entered
+    };
+    std::vector<Level> stack;
+    std::string path;     // full path of the node on top of the stack
+
+    LeafCursor(const Node &node, const std::string &path);
+  };
+
   std::string urn;
   Node root;	    // root of DDF file derived node tree
+  std::vector<std::string> segments;  // sorted, unique names of all nodes in the tree
   std::string ddf_url;  // canonical download URL of ddf file
   unsigned next_miid;
 
   // The key of the intances (MI) map is the  miid
-  std::map<std::string, std::shared_ptr<MO::Interface> > instance;
+  std::map<std::string, std::shared_ptr<MO::Interface>, std::less<> > instance;
   
 public:
 
+  // a node of an MO instance, as resolved from its URI by resolve()
+  struct Target {
+    std::shared_ptr<MO::Interface> mo;  // the MO instance
+    const Node *node;   // nullptr if the DDF has no node at the path
+    size_t path;        // position of the node path ("/Foo/Bar" or "") in the URI
+  };
+
   MOHandler(std::string urn, std::string url);
   std::string url() const;
 
   bool generate_tree_from_ddf(std::string filename);
   nlohmann::json build_MOData(std::string uri, std::shared_ptr<MO::Interface>) const;
   nlohmann::json serialize_MIs() const;
+  bool write_MIs(PackageWriter &writer) const;
+  bool write_MI_changes(PackageWriter &writer, const TreeSyncState::Versions &acknowledged, TreeSyncState::Versions &current) const;
   nlohmann::json p1_MOS_json() const;
   
   // TODO: change type to enum
   int check_access(std::string uri) const; 
 
-  bool node_set(const std::string uri, const nlohmann::json modata);
+  bool resolve(const std::string &uri, size_t start, Target &target) const;
+  bool node_set(const Target &target, const std::string &uri, const nlohmann::json modata);
   bool node_get(const std::string uri, nlohmann::json &modata);
+  std::unique_ptr<MO::Interface::NodeWriter> node_writer(const Target &target, const std::string &uri, const std::string content_type);
+  bool node_exists(const std::string uri);
+  bool write_node(PackageWriter &writer, const Target &target, const std::string &uri);
 
   bool add_instance(std::shared_ptr<MO::Interface> mo, std::string miid);
 
 private:
 
-  Node *find_node(std::vector<std::string> path, Node *node = nullptr);
+  const Node *find_node(const std::string &path, size_t start = 0) const;
+  const Node *find_child(const Node &node, const char *name, size_t length) const;
+  bool segment_id(const char *segment, size_t length, unsigned &id) const;
+  void index_tree();
 
   // TODO: code replication in this methods from MO_BaseCached. Try to refactor without breaking the
   // logical source barrier between library (this) and local application (MO base classes)?
   Node generate_node_from_ddf(const tinyxml2::XMLElement * const xml_node);
   std::string xml_descend_safely(const tinyxml2::XMLElement*& node, const std::vector<std::string> &path) const;
-  nlohmann::json serialize_children(std::shared_ptr<MO::Interface> mo, std::vector<Node> children, std::string uri_prefix) const;
+  bool walk(const Node &node, std::string &path, TreeVisitor &visitor) const;
+  size_t next_leaf_paths(LeafCursor &cursor, size_t count, std::vector<std::string> &paths) const;
+  bool collect_values(const Node &node, const nlohmann::json &data, std::string &path, std::vector<std::string> &paths, std::vector<std::string> &values) const;
+  nlohmann::json serialize_children(MO::Interface &mo, const Node &node) const;
+  bool write_children(PackageWriter &writer, MO::Interface &mo, const Node &node, std::string &path) const;
+  bool serialize_changes(std::shared_ptr<MO::Interface> mo, unsigned long since, nlohmann::json &mo_json) const;
 };
 
 } //namespace
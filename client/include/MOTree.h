@@ -22,18 +22,31 @@
 #include <map>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 #include <nlohmann/json.hpp>
 
+#include "Codec.h"
 #include "MO_Interface.h"
 #include "MOHandler.h"
+#include "TreeSyncState.h"
 
 namespace Grandma {
 class MOTree {
 
   // the key of the MOs map is the urn as it is defined <DDFName> of the ddf files 
   // root Node. Example is "urn:oma:mo:oma-dm-devinfo:1.2"
-  std::map<std::string, MOHandler> MOs;
+  std::map<std::string, MOHandler, std::less<> > MOs;
+
+  // a node of an MO instance, as resolved from its URI
+  struct Route {
+    MOHandler *handler;
+    MOHandler::Target target;
+  };
+
+  // cache of resolved URIs, see resolve()
+  std::unordered_map<std::string, Route> routes;
+  static const size_t route_cache_size = 4096;
 
 public:
 
@@ -42,10 +55,18 @@ public:
 
   bool node_set(const std::string uri, const nlohmann::json modata);
   bool node_get(const std::string uri, nlohmann::json &modata); // not const on purpose to allow side effects
+  std::unique_ptr<MO::Interface::NodeWriter> node_writer(const std::string uri, const std::string content_type);
+  bool node_exists(const std::string uri);
+  bool write_node(PackageWriter &writer, const std::string uri);
 
   nlohmann::json p1_MOS_json() const;
   nlohmann::json dump_serialized_MOS() const;
+  bool write_serialized_MOS(PackageWriter &writer) const;
+  bool write_changed_MOS(PackageWriter &writer, const TreeSyncState::Versions &acknowledged, TreeSyncState::Versions &current) const;
+
+private:
 
+  bool resolve(const std::string &uri, Route &route);
 };
 
 } // namespace
@@ -0,0 +1,82 @@
+/**
+ * Incremental package P2 parser for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * This class parses a P2 package ({"CMD": [[<command>, <parameter>...], ...]}) piece
+ * by piece as it is received, and hands out each command as soon as it is complete,
+ * without ever building the package as a json object.
+ *
+ * A small scanner finds the boundaries of the command arrays in the received data,
+ * in JSON or CBOR (see Codec). Each complete command is then parsed with the
+ * nlohmann::json SAX interface directly into a CommandQueue::Command: the command name
+ * is looked up in a precomputed table, and the parameter strings are moved into the
+ * command. Data outside of the "CMD" array is skipped. Only the data of a command that
+ * is not yet complete is buffered.
+ *
+ */
+#ifndef GRANDMA_P2PARSER_H
+#define GRANDMA_P2PARSER_H
+
+#include <functional>
+#include <string>
+
+#include "Codec.h"
+#include "CommandQueue.h"
+
+namespace Grandma {
+
+class P2Parser {
+
+public:
+  // receives each command as soon as it is complete. May move from the command.
+  using CommandHandler = std::function<void(CommandQueue::Command &command)>;
+
+private:
+  enum class State {
+    Start,          // before the package object
+    Members,        // in the package object, before the next key or the end
+    SkipValue,      // before the value of a member that is not "CMD"
+    CommandsStart,  // before the "CMD" array
+    Commands,       // in the "CMD" array, before the next command or the end
+    Done,           // package object complete
+    Error
+  };
+
+  Codec::Format format;
+  CommandHandler on_command;
+
+  std::string buffer;   // received data not yet parsed
+  size_t pos;           // parsed up to here
+  State state;
+
+  bool first_in_container;  // JSON: no separator before the next member/command
+  long remaining_members;   // CBOR: members of the package object left, -1 if indefinite length
+  long remaining_commands;  // CBOR: commands left in the "CMD" array, -1 if indefinite length
+
+public:
+  P2Parser(Codec::Format format, CommandHandler on_command);
+
+  bool feed(const char *data, size_t length);
+  bool finish();
+
+  bool parse(const std::string &package);
+
+  static bool lookup(const std::string &name, CommandQueue::CommandType &type);
+
+private:
+  enum class Step {
+    Progress,  // one step parsed, continue
+    NeedMore,  // not enough data for the next step
+    Fail       // invalid package
+  };
+
+  Step step();
+  Step step_json();
+  Step step_cbor();
+  bool dispatch(const char *begin, const char *end);
+};
+
+} // namespace
+
+#endif
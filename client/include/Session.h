@@ -3,33 +3,104 @@
 
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
 #include <nlohmann/json.hpp>
 
+#include "Codec.h"
 #include "CommandQueue.h"
+#include "ConnectionPool.h"
+#include "EventLoop.h"
+#include "P2Parser.h"
 #include "MOTree.h"
+#include "SessionMetrics.h"
+#include "Transport.h"
 
 namespace Grandma {
 
 class Session {
+public:
   enum class SessionState {
     Unknown,
-    Idle,
-    P1,
-    P2,
-    P3cont,
-    P3end
+    Idle,     // no session running
+    P1,       // P1 is being sent, waiting for the first P2
+    P2,       // a P2 was received, its commands are being executed
+    P3cont,   // P3 is being sent, waiting for the next P2
+    P3end     // the server ended the session, cleaning up
   };
 
+private:
+  // one package sent and the P2 received in return, see exchange()
+  struct Exchange {
+    Transport::Request request;
+    Transport::Response response;
+    SessionMetrics::Package package;
+    std::shared_ptr<Transport> transport;   // the transport may be replaced while the package is underway
+    std::unique_ptr<P2Parser> parser;       // created with the response, which tells the encoding
+
+    SessionMetrics::Clock::time_point started;
+    SessionMetrics::Clock::duration build_time;
+    SessionMetrics::Clock::duration wait_time;
+    SessionMetrics::Clock::duration parse_time;
+    uint64_t sent_bytes;
+    uint64_t received_bytes;
+  };
+
+  std::atomic<SessionState> state;
+
   MOTree &motree; // TODO: moving out command handlers from session class should make this unnecessary and improve soc
   CommandQueue &command_queue;
+  ConnectionPool &connection_pool;
+  SessionMetrics &metrics;
+
+  std::shared_ptr<Transport> transport;
+  std::string server_url;
+  std::string device_id;
+  bool end_received;  // the server sent END in this session
+  bool continue_session;  // the last P2 was valid and did not end the session
+
+  Codec::Format package_format;   // format of the packages we send
+
+  Compression::Mode compression_mode;
+  mutable std::mutex stats_mutex;
+  Compression::Stats compression_sent;      // totals over all packages sent
+  Compression::Stats compression_received;  // totals over all packages received
 
 public:
 
-  Session(MOTree &motree, CommandQueue &command_queue);
+  Session(MOTree &motree, CommandQueue &command_queue, ConnectionPool &connection_pool, SessionMetrics &metrics);
+
+  void set_transport(std::shared_ptr<Transport> transport);
+  bool set_server_url(const std::string url);
+  std::string get_server_url() const;
+  void set_device_id(const std::string id);
+
+  void set_package_format(Codec::Format format);
+  Codec::Format get_package_format() const;
+
+  void set_compression(Compression::Mode mode);
+  Compression::Stats get_compression_stats(bool received = false) const;
+
+  bool begin();
+  void set_state(SessionState new_state);
+  SessionState get_state() const;
+  bool ended_by_server() const;
+
+  bool send_P1(Transport::BodyWriter p1_writer);
+  bool send_P3(Transport::BodyWriter p3_writer);
+  void send_P1_async(Transport::BodyWriter p1_writer, EventLoop &loop, std::function<void(bool)> done);
+  void send_P3_async(Transport::BodyWriter p3_writer, EventLoop &loop, std::function<void(bool)> done);
+  bool continues() const;
 
-  std::string send_P1(std::string p1_json);
-  bool parse_P2(std::string p2_json);
-  std::string send_P3(std::string p3_json);
+private:
+  std::shared_ptr<Exchange> begin_exchange(const std::string &content_type, Transport::BodyWriter writer, SessionMetrics::Package package);
+  bool exchange(Exchange &exchange);
+  void exchange_async(std::shared_ptr<Exchange> exchange, EventLoop &loop, std::function<void(bool)> done);
+  bool end_exchange(Exchange &exchange, bool delivered);
+  void queue_command(CommandQueue::Command &command);
 
 };
 
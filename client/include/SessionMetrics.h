@@ -0,0 +1,166 @@
+/**
+ * Session latency metrics for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Every session records how long its phases took and how large its packages were, so
+ * that slow sessions can be attributed to the client (building packages, parsing,
+ * executing commands), or to the network and the server:
+ *
+ *  - P1Build, P3Build:         producing the package, without the time spent sending
+ *                              it and (P3) waiting for commands to finish
+ *  - P1RoundTrip, P3RoundTrip: exchanging the package for the next P2, minus the time
+ *                              spent building the package and parsing the P2
+ *  - P2Parse:                  decoding the P2 and queueing its commands
+ *  - Total:                    the whole session, from begin to end
+ *
+ * Additionally the execution time of each command is recorded by command type, and the
+ * size of each package (serialized, before compression) by package.
+ *
+ * The values are collected in Histograms, which can be recorded to from any thread
+ * without locking. Their Snapshots give the distribution (count, mean, max and
+ * percentiles), and Snapshots of many clients can be merged to see the distribution
+ * over a whole fleet.
+ *
+ */
+#ifndef GRANDMA_SESSIONMETRICS_H
+#define GRANDMA_SESSIONMETRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "CommandQueue.h"
+
+namespace Grandma {
+
+/**
+ * Lock-free histogram of unsigned values (nanoseconds, bytes)
+ *
+ * Buckets are log-linear: each power of two is split into 8 buckets, so a percentile
+ * is off by at most 12.5%. Values from 2^44 on all go to the last bucket.
+ */
+class Histogram {
+public:
+  static const unsigned sub_bits = 3;
+  static const unsigned max_exponent = 43;
+  static const size_t bucket_count = (1 << sub_bits) * (max_exponent - sub_bits + 2);
+
+  struct Snapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    std::vector<uint64_t> buckets;
+
+    Snapshot();
+    double mean() const;
+    uint64_t percentile(double p) const;    // p from 0 to 100
+    void merge(const Snapshot &other);
+    nlohmann::json json() const;
+  };
+
+private:
+  std::array<std::atomic<uint64_t>, bucket_count> buckets;
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+
+public:
+  Histogram();
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+  void record(uint64_t value);
+  Snapshot snapshot() const;
+  void reset();
+
+  static size_t bucket_of(uint64_t value);
+  static uint64_t bucket_limit(size_t bucket);   // largest value in the bucket
+};
+
+class SessionMetrics {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  enum class Phase {
+    P1Build,
+    P1RoundTrip,
+    P2Parse,
+    P3Build,
+    P3RoundTrip,
+    Total
+  };
+
+  enum class Package {
+    P1,
+    P2,
+    P3
+  };
+
+  /**
+   * Measures the time until it is destroyed, without the time the current thread spends in a Pause
+   */
+  class Stopwatch {
+    Clock::time_point started;
+    Clock::duration paused;
+    Stopwatch *outer;   // stopwatch that was current for the thread before
+
+    static thread_local Stopwatch *current;
+
+  public:
+    Stopwatch();
+    ~Stopwatch();
+    Stopwatch(const Stopwatch &) = delete;
+    Stopwatch &operator=(const Stopwatch &) = delete;
+
+    Clock::duration elapsed() const;
+
+    /**
+     * Excludes its lifetime from the thread's current Stopwatch (if any), e.g. time spent
+     * sending or waiting while building a package
+     */
+    class Pause {
+      Clock::time_point started;
+      Stopwatch *stopwatch;
+
+    public:
+      Pause();
+      ~Pause();
+      Pause(const Pause &) = delete;
+      Pause &operator=(const Pause &) = delete;
+    };
+  };
+
+private:
+  static const size_t phase_count = static_cast<size_t>(Phase::Total) + 1;
+  static const size_t package_count = static_cast<size_t>(Package::P3) + 1;
+  static const size_t command_count = static_cast<size_t>(CommandQueue::CommandType::UNSUB) + 1;
+
+  std::array<Histogram, phase_count> phases;              // nanoseconds
+  std::array<Histogram, command_count> commands;          // nanoseconds
+  std::array<Histogram, package_count> packages;          // bytes
+
+public:
+  void record(Phase phase, Clock::duration duration);
+  void record(CommandQueue::CommandType type, Clock::duration duration);
+  void record(Package package, uint64_t bytes);
+
+  Histogram::Snapshot latency(Phase phase) const;
+  Histogram::Snapshot command_latency(CommandQueue::CommandType type) const;
+  Histogram::Snapshot package_size(Package package) const;
+
+  nlohmann::json report() const;
+  void reset();
+
+  static const char *name(Phase phase);
+  static const char *name(Package package);
+  static const char *name(CommandQueue::CommandType type);
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * TLS session cache for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * This class keeps the TLS sessions (tickets) received from servers, keyed by origin
+ * (scheme, host and port), so that later connections to the same server can resume
+ * the session with an abbreviated handshake instead of doing a full handshake. This
+ * matters most for periodic sessions, where the previous connection has long been
+ * closed when the next session starts.
+ *
+ * httplib creates a separate SSL_CTX for every client object and offers no way to
+ * hand in a shared one, so this cache is attached to each client's context with
+ * attach() instead. The attached context stores every new session in this cache and
+ * offers the cached session for the next handshake.
+ *
+ * Sessions are kept in memory and can optionally be persisted to a directory, so
+ * they survive a restart of the application.
+ *
+ */
+#ifndef GRANDMA_TLSSESSIONCACHE_H
+#define GRANDMA_TLSSESSIONCACHE_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <openssl/ssl.h>
+
+namespace Grandma {
+
+class TlsSessionCache {
+
+public:
+  struct Stats {
+    unsigned long handshakes;     // completed TLS handshakes
+    unsigned long resumed;        // ... of which were resumed from a cached session
+    unsigned long sessions_stored;// sessions (tickets) received from servers
+
+    double resumption_ratio() const;
+  };
+
+private:
+  mutable std::mutex mutex;
+  std::map<std::string, SSL_SESSION *> sessions;  // key is the origin, we own one reference each
+  std::string persist_dir;
+
+  Stats counters;
+
+public:
+
+  TlsSessionCache();
+  ~TlsSessionCache();
+
+  TlsSessionCache(const TlsSessionCache &) = delete;
+  TlsSessionCache &operator=(const TlsSessionCache &) = delete;
+
+  static void attach(std::shared_ptr<TlsSessionCache> cache, SSL_CTX *ctx, const std::string &origin);
+
+  void set_persist_dir(const std::string &dir);
+  void clear();
+
+  Stats stats() const;
+
+private:
+  void store(const std::string &origin, SSL_SESSION *session);
+  SSL_SESSION *lookup(const std::string &origin);
+  void count_handshake(bool resumed);
+
+  std::string persist_filename(const std::string &origin) const;
+
+  static int new_session_callback(SSL *ssl, SSL_SESSION *session);
+  static void info_callback(const SSL *ssl, int where, int ret);
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * Transport interface for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * A transport carries the protocol packages of a session (P1, P3) to the DM server
+ * and returns the server's answer (P2). The Session class only talks to this
+ * interface, so the way packages reach the server can be replaced, e.g. by the
+ * in-process LoopbackTransport for benchmarks and tests, instead of the default
+ * HttpTransport.
+ *
+ * Implementations of this interface must be safe to use from one session at a
+ * time. They don't need to be safe to be used by multiple sessions concurrently.
+ *
+ * Transports that can wait for the server without blocking a thread implement
+ * post_async() too, which asynchronous sessions use. Otherwise the session calls
+ * post() on a worker thread.
+ *
+ */
+#ifndef GRANDMA_TRANSPORT_H
+#define GRANDMA_TRANSPORT_H
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include "Compression.h"
+
+namespace Grandma {
+
+class EventLoop;
+
+class Transport {
+
+public:
+  // receives the next piece of a streamed request body. Returns false if the transfer failed
+  using BodySink = std::function<bool(const char *data, size_t length)>;
+  // produces a streamed request body by feeding it piece by piece into the sink. Returns false to abort
+  using BodyWriter = std::function<bool(const BodySink &sink)>;
+
+  struct Response;
+  // receives the next piece of a response body, when status and content type of the response are
+  // already known. Returns false if it doesn't want the rest of the body
+  using ResponseSink = std::function<bool(const Response &response, const char *data, size_t length)>;
+
+  struct Request {
+    std::string content_type;                   // e.g. "application/vnd.oma.dm.initiation+json"
+    std::string accept;                         // content type expected in the response
+    std::map<std::string, std::string> headers; // additional protocol headers, e.g. "OMADM-DevID"
+    std::string body;
+    BodyWriter body_writer;                     // if set, used instead of body. The body is then streamed (chunked)
+    Compression::Mode compression;              // if and when the body may be sent compressed
+    ResponseSink response_sink;                 // if set, the response body is passed here instead of Response::body
+
+    Request() : compression(Compression::Mode::Auto) {}
+  };
+
+  struct Response {
+    int status;
+    std::string content_type;
+    std::string body;                           // always decompressed. Empty if the request had a response_sink
+    Compression::Stats request_compression;     // how the request body was compressed (if at all)
+    Compression::Stats response_compression;    // how the response body was compressed (if at all)
+
+    Response() : status(0) {}
+  };
+
+  virtual ~Transport() {}
+
+  /**
+   * @brief send one package to the server and wait for its response
+   *
+   * @param[in] request - package to send
+   * @param[out] response - response of the server. Only valid if true was returned.
+   * @return false if the package could not be delivered (e.g. no connection to the server)
+   */
+  virtual bool post(const Request &request, Response &response) = 0;
+
+  /**
+   * @brief send one package to the server, and receive its response on an event loop
+   *
+   * The request body is produced on the calling thread. Waiting for and receiving the
+   * response then happens on the loop, without holding a thread. Request, response and
+   * the transport itself must stay valid until done was called.
+   *
+   * @param[in] request - package to send. Its response sink is called on the loop thread
+   * @param[out] response - response of the server. Only valid if done gets true.
+   * @param[in] loop - event loop the response is received on
+   * @param[in] done - called on the loop thread, with false if the package could not be delivered
+   * @return false if this transport can't send asynchronously, post() has to be used. done is not called then.
+   */
+  virtual bool post_async(const Request &, Response &, EventLoop &, std::function<void(bool delivered)>) {
+    return false;
+  }
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * MgmtTree synchronization state for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * When the MgmtTree is sent in package P1 (see DMClient::set_P1_dump_tree()), only
+ * the nodes that changed since the last session that the server acknowledged need
+ * to be sent. This class remembers, per server, the version (see MO::Interface 
+ * change tracking) of each MO instance that the server has last seen.
+ *
+ * The versions are kept in memory and can optionally be persisted to a directory,
+ * so that the server does not need a full dump after every restart of the application
+ * (as long as the MOs keep their change history over the restart, too).
+ *
+ */
+#ifndef GRANDMA_TREESYNCSTATE_H
+#define GRANDMA_TREESYNCSTATE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace Grandma {
+
+class TreeSyncState {
+
+public:
+  struct Version {
+    std::string epoch;      // see MO::Interface::change_epoch()
+    unsigned long version;  // see MO::Interface::change_version()
+  };
+
+  // key is "<urn>/<miid>" of the MO instance
+  typedef std::map<std::string, Version> Versions;
+
+private:
+  mutable std::mutex mutex;
+  std::map<std::string, Versions> acknowledged;  // key is the server
+  std::string persist_dir;
+
+public:
+
+  void set_persist_dir(const std::string &dir);
+
+  Versions acknowledged_versions(const std::string &server);
+  void acknowledge(const std::string &server, const Versions &versions);
+  void forget(const std::string &server);
+
+private:
+  std::string persist_filename(const std::string &server) const;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,57 @@
+/**
+ * Worker thread pool for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * A fixed number of worker threads executing tasks from a common queue. Used to run
+ * the commands of a session in the background (see CommandQueue::do_commands_async).
+ *
+ * A single pool is meant to be shared by any number of DMClient instances, so that
+ * processes hosting many clients (e.g. gateways for many downstream devices) don't
+ * need a thread per client or per session.
+ *
+ */
+#ifndef GRANDMA_WORKERPOOL_H
+#define GRANDMA_WORKERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Grandma {
+
+class WorkerPool {
+
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable task_ready;
+  std::deque<std::function<void()>> tasks;
+  bool stopping;
+
+public:
+
+  WorkerPool(unsigned n_threads = 0);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  std::future<void> submit(std::function<void()> task);
+
+  unsigned size() const;
+
+  static std::shared_ptr<WorkerPool> shared();
+
+private:
+  void work();
+};
+
+} // namespace
+
+#endif
@@ -6,27 +6,57 @@
 
 #include "AlertQueue.h"
 
+#include <algorithm>
+
 using namespace nlohmann;
 
 namespace Grandma {
  
 Alert::Alert(std::string AlertType) : AlertType(AlertType), in_transit(false) {}
 
+/**
+ * @brief Serialize the alerts for the package being sent, they are in transit then
+ *
+ * Alerts already in transit are included again, in case the same package is
+ * serialized again.
+ */
 json AlertQueue::package_alert_json() {
   json alerts;
   for(auto &alert : alert_queue) {
-    if(!alert.in_transit) {
-      json al;
-      al["AlertType"] = alert.AlertType;
-      alerts.push_back(al);
-      alert.in_transit = true;
-    }
+    json al;
+    al["AlertType"] = alert.AlertType;
+    alerts.push_back(al);
+    alert.in_transit = true;
   }
   return alerts;
 };
 
+/**
+ * @brief The package with the alerts in transit was received by the server, forget them
+ */
+void AlertQueue::acknowledge() {
+  alert_queue.erase(std::remove_if(alert_queue.begin(), alert_queue.end(), [](const Alert &alert) { 
+    return alert.in_transit; 
+  }), alert_queue.end());
+}
+
+/**
+ * @brief The package with the alerts in transit didn't reach the server, send them with the next one
+ */
+void AlertQueue::release() {
+  for(auto &alert : alert_queue) {
+    alert.in_transit = false;
+  }
+}
+
 void AlertQueue::add_alert(Alert alert) {
   alert_queue.push_back(alert);
 }
 
+void AlertQueue::remove_alerts(const std::string &AlertType) {
+  alert_queue.erase(std::remove_if(alert_queue.begin(), alert_queue.end(), [&AlertType](const Alert &alert) { 
+    return alert.AlertType == AlertType; 
+  }), alert_queue.end());
+}
+
 } // namespace
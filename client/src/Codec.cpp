@@ -0,0 +1,234 @@
+/**
+ * Package encoding for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "Codec.h"
+
+#include <iostream>
+
+namespace Grandma {
+
+using namespace nlohmann;
+
+namespace {
+
+  // the writer collects output up to this size before passing it on to the sink
+  const size_t flush_threshold = 16384;
+
+  // CBOR initial bytes of indefinite length containers and the "break" stop code
+  const char cbor_begin_array = '\x9f';
+  const char cbor_begin_map = '\xbf';
+  const char cbor_break = '\xff';
+
+  bool ends_with(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+} // namespace
+
+const char *Codec::suffix(Format format) {
+  return format == Format::CBOR ? "+cbor" : "+json";
+}
+
+/**
+ * @brief Build the content type for a base type and a format
+ *
+ * @param[in] base - e.g. "application/vnd.oma.dm.initiation"
+ * @return e.g. "application/vnd.oma.dm.initiation+cbor"
+ */
+std::string Codec::content_type(const std::string &base, Format format) {
+  return base + suffix(format);
+}
+
+/**
+ * @brief Find the format from a content type's suffix
+ *
+ * Parameters (";charset=...") are ignored. Everything that is not marked as CBOR
+ * is taken as JSON, which was the only format supported before.
+ */
+Codec::Format Codec::format_of(const std::string &content_type) {
+  std::string type = content_type.substr(0, content_type.find(';'));
+  type.erase(type.find_last_not_of(" \t") + 1);
+  return ends_with(type, "+cbor") || type == "application/cbor" ? Format::CBOR : Format::JSON;
+}
+
+std::string Codec::encode(const json &document, Format format) {
+  if(format == Format::CBOR) {
+    std::vector<uint8_t> cbor = json::to_cbor(document);
+    return std::string(cbor.begin(), cbor.end());
+  }
+  return document.dump();
+}
+
+/**
+ * @return false if the data can't be parsed in the given format
+ */
+bool Codec::decode(const std::string &data, Format format, json &document) {
+  if(format == Format::CBOR) {
+    document = json::from_cbor(data, true, false);
+  } else {
+    document = json::parse(data, nullptr, false);
+  }
+  return !document.is_discarded();
+}
+
+/**
+ * @{
+ * PackageWriter
+ */
+
+/**
+ * @param[in] format - encoding to write
+ * @param[in] sink - receives the encoded output. Must outlive the writer.
+ */
+PackageWriter::PackageWriter(Codec::Format format, const Transport::BodySink &sink)
+  : format(format), sink(sink), failed(false) {}
+
+// JSON: add a comma if this is not the first element in the current container
+void PackageWriter::separate() {
+  if(format == Codec::Format::JSON && !first_in_container.empty()) {
+    if(!first_in_container.back()) buffer += ',';
+    first_in_container.back() = false;
+  }
+}
+
+bool PackageWriter::begin_object() {
+  separate();
+  buffer += (format == Codec::Format::CBOR) ? cbor_begin_map : '{';
+  first_in_container.push_back(true);
+  return written();
+}
+
+bool PackageWriter::begin_array() {
+  separate();
+  buffer += (format == Codec::Format::CBOR) ? cbor_begin_array : '[';
+  first_in_container.push_back(true);
+  return written();
+}
+
+/**
+ * @brief Write the key of the next member of the current object
+ *
+ * Must be followed by exactly one value, or one begin_object()/begin_array().
+ */
+bool PackageWriter::key(const std::string &name) {
+  separate();
+  append_string(name);
+  if(format == Codec::Format::JSON) buffer += ':';
+  // the value that follows the key must not be separated from it
+  if(!first_in_container.empty()) first_in_container.back() = true;
+  return written();
+}
+
+bool PackageWriter::value(const json &value) {
+  separate();
+  if(format == Codec::Format::CBOR) {
+    std::vector<uint8_t> cbor = json::to_cbor(value);
+    buffer.append(cbor.begin(), cbor.end());
+  } else {
+    buffer += value.dump();
+  }
+  return written();
+}
+
+/**
+ * @brief Write a string value
+ *
+ * Same as value(json(value)), but without the intermediate json object. Meant for
+ * writing the many node values of a MgmtTree.
+ */
+bool PackageWriter::string_value(const std::string &value) {
+  separate();
+  append_string(value);
+  return written();
+}
+
+// encoded string, without separators
+void PackageWriter::append_string(const std::string &s) {
+  if(format == Codec::Format::CBOR) {
+    // major type 3 (text string), followed by the length in the shortest possible form
+    const uint64_t length = s.size();
+    if(length < 24) {
+      buffer += static_cast<char>(0x60 + length);
+    } else {
+      int length_bytes = length <= 0xff ? 1 : length <= 0xffff ? 2 : length <= 0xffffffff ? 4 : 8;
+      buffer += static_cast<char>(length_bytes == 1 ? 0x78 : length_bytes == 2 ? 0x79 : length_bytes == 4 ? 0x7a : 0x7b);
+      for(int i = length_bytes - 1; i >= 0; --i) {
+        buffer += static_cast<char>((length >> (8 * i)) & 0xff);
+      }
+    }
+    buffer += s;
+    return;
+  }
+
+  static const char hex[] = "0123456789abcdef";
+  buffer += '"';
+  for(char c : s) {
+    switch(c) {
+      case '"':  buffer += "\\\""; break;
+      case '\\': buffer += "\\\\"; break;
+      case '\b': buffer += "\\b"; break;
+      case '\f': buffer += "\\f"; break;
+      case '\n': buffer += "\\n"; break;
+      case '\r': buffer += "\\r"; break;
+      case '\t': buffer += "\\t"; break;
+      default:
+        if(static_cast<unsigned char>(c) < 0x20) {
+          buffer += "\\u00";
+          buffer += hex[(c >> 4) & 0xf];
+          buffer += hex[c & 0xf];
+        } else {
+          buffer += c;
+        }
+    }
+  }
+  buffer += '"';
+}
+
+bool PackageWriter::end_object() {
+  return end_container('}');
+}
+
+bool PackageWriter::end_array() {
+  return end_container(']');
+}
+
+bool PackageWriter::end_container(char json_delimiter) {
+  if(!first_in_container.empty()) first_in_container.pop_back();
+  buffer += (format == Codec::Format::CBOR) ? cbor_break : json_delimiter;
+  // the container itself was an element of its parent
+  if(format == Codec::Format::JSON && !first_in_container.empty()) first_in_container.back() = false;
+  return written();
+}
+
+// pass on the buffered output once enough has been collected
+bool PackageWriter::written() {
+  if(buffer.size() >= flush_threshold) return flush();
+  return !failed;
+}
+
+/**
+ * @brief Pass all buffered output to the sink
+ *
+ * Must be called after the document is complete. Can also be called in between to
+ * make sure everything written so far is sent, e.g. before waiting for more data.
+ *
+ * @return false if the sink failed now or before
+ */
+bool PackageWriter::flush() {
+  if(failed) return false;
+  if(!buffer.empty()) {
+    failed = !sink(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+  return !failed;
+}
+/**
+ * @}
+ */
+
+} // namespace
@@ -1,96 +1,960 @@
 #include "CommandQueue.h"
 
-#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <iterator>
+#include <set>
+#include <thread>
 
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 #include <httplib.h>
 
 #include <nlohmann/json.hpp>
 
+#include "base64.h"
+#include "Compression.h"
 #include "Helper.h"
+#include "Log.h"
+#include "SessionMetrics.h"
 
 namespace Grandma {
 
 using namespace nlohmann;
+
+namespace {
+
+  // attempts per HGET, an interrupted resumable download is continued by the next one
+  const unsigned hget_attempts = 3;
+
+  // the progress of a resumable download is saved whenever this many bytes more were received,
+  // so it can also be resumed after the application was killed
+  const unsigned long long progress_interval = 4 * 1024 * 1024;
+
+  // HPUT/HPOST data beyond this size is spooled to a temporary file instead of memory
+  const size_t spool_memory_limit = 1024 * 1024;
+
+  /**
+   * Holds the serialized MO data of an upload, so it can be produced while the MO tree
+   * is locked and sent after the lock was released. Small data is kept in memory, larger
+   * data in an anonymous temporary file.
+   */
+  class Spool {
+    std::string buffer;
+    std::FILE *file;
+
+  public:
+    Spool() : file(nullptr) {}
+    ~Spool() { if(file) std::fclose(file); }
+    Spool(const Spool &) = delete;
+    Spool &operator=(const Spool &) = delete;
+
+    bool write(const char *data, size_t length) {
+      if(!file && buffer.size() + length > spool_memory_limit) {
+        file = std::tmpfile();
+        if(!file || std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+          LOG_ERROR("ERROR: can't spool upload data to a temporary file");
+          return false;
+        }
+        buffer.clear();
+        buffer.shrink_to_fit();
+      }
+      if(file) return std::fwrite(data, 1, length, file) == length;
+      buffer.append(data, length);
+      return true;
+    }
+
+    // passes all data to the sink, may be called again if the transfer starts over
+    bool send(const std::function<bool(const char *, size_t)> &sink) {
+      if(!file) return buffer.empty() || sink(buffer.data(), buffer.size());
+      if(std::fflush(file) != 0 || std::fseek(file, 0, SEEK_SET) != 0) return false;
+      char chunk[65536];
+      size_t n;
+      while((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if(!sink(chunk, n)) return false;
+      }
+      return !std::ferror(file);
+    }
+  };
+
+  /**
+   * @return the SHA-256 digest (raw bytes) from a Digest header (RFC 3230), empty if there is none
+   */
+  std::string digest_sha256(const std::string &header) {
+    std::string lower = header;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c){ return std::tolower(c); });
+    auto begin = lower.find("sha-256=");
+    if(begin == std::string::npos) return "";
+    begin += 8;
+    auto end = header.find(',', begin);
+    std::string encoded = header.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+    encoded.erase(std::remove(encoded.begin(), encoded.end(), ' '), encoded.end());
+    return base64_decode(encoded);
+  }
+
+  /**
+   * @brief parse "bytes <first>-<last>/<length>"
+   * @param[out] length - -1 if the server doesn't know it ("*")
+   */
+  bool parse_content_range(const std::string &header, unsigned long long &first, long long &length) {
+    if(header.compare(0, 6, "bytes ") != 0) return false;
+    char *end;
+    first = std::strtoull(header.c_str() + 6, &end, 10);
+    auto slash = header.find('/');
+    if(*end != '-' || slash == std::string::npos) return false;
+    length = header.compare(slash + 1, std::string::npos, "*") == 0 ? -1 : std::strtoll(header.c_str() + slash + 1, nullptr, 10);
+    return true;
+  }
+
+}
   
-CommandQueue::CommandQueue(MOTree &motree) : motree(motree) {}
+/**
+ * State of one do_commands() run, shared by the threads executing its commands
+ *
+ * Commands can start as soon as all earlier commands working on overlapping parts of
+ * the MO tree have finished (see prepare()). Ready commands are taken by the thread
+ * running do_commands() itself and by helper tasks submitted to the worker pool. 
+ * Helpers only ever take commands that are ready, and the coordinating thread takes
+ * them as well, so the commands complete even if no worker gets to run a helper 
+ * (e.g. because all workers are busy coordinating other sessions).
+ */
+struct CommandQueue::Execution {
+  CommandQueue *queue;
+  unsigned max_parallel;
+  unsigned max_per_origin;
+
+  std::vector<Command> commands;
+  std::vector<std::string> origins;             // per command: origin it downloads from, "" if none
+  std::vector<unsigned> blocked_by;             // per command: earlier overlapping commands not finished yet
+  std::vector<std::vector<size_t>> unblocks;    // per command: later overlapping commands
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::set<size_t> ready;                       // commands that can start, lowest index first
+  unsigned running;
+  size_t finished;
+  unsigned helpers_queued;                      // helper tasks submitted but not started yet
+  std::map<std::string, unsigned> running_per_origin;
+  std::map<std::string, std::shared_ptr<Download>> downloads;  // key is the URL
+
+  Execution(CommandQueue *queue) 
+    : queue(queue), max_parallel(queue->max_parallel), max_per_origin(queue->max_per_origin),
+      running(0), finished(0), helpers_queued(0) {}
+};
+
+struct CommandQueue::Download {
+  std::mutex mutex;
+  std::condition_variable completed;
+  bool done;
+  bool ok;            // received with http status 2xx, decompressed and stored by the sink
+  bool buffered;      // the data went to a MemorySink, body holds it
+  std::string content_type;
+  std::string body;
+  unsigned long long bytes;       // delivered to the sink
+  unsigned long long wire_bytes;  // received from the server
+
+  Download() : done(false), ok(false), buffered(false), bytes(0), wire_bytes(0) {}
+};
+  
+CommandQueue::CommandQueue(MOTree &motree, ConnectionPool &connection_pool, WorkerPool &worker_pool, SessionMetrics &metrics) 
+  : executing(false), next_slot(0), max_parallel(4), max_per_origin(2), 
+    motree(motree), connection_pool(connection_pool), worker_pool(worker_pool), metrics(metrics), mo_format(Codec::Format::JSON) {}
+
+/**
+ * Ask servers to send MO data for HGET in the given format. Data is decoded according to
+ * the content type actually received, so servers that only know JSON still work.
+ */
+void CommandQueue::set_mo_format(Codec::Format format) {
+  mo_format = format;
+}
+
+/**
+ * @brief Limit how many commands of a package execute at the same time
+ *
+ * Takes effect with the next do_commands(). Note that the number of connections to the 
+ * same origin is also limited by the ConnectionPool, which is usually shared by many clients.
+ *
+ * @param[in] max_parallel - commands executing at the same time, 1 executes them one after the other
+ * @param[in] max_per_origin - commands downloading from the same scheme/host/port at the same time
+ */
+void CommandQueue::set_concurrency(unsigned max_parallel, unsigned max_per_origin) {
+  this->max_parallel = max_parallel ? max_parallel : 1;
+  this->max_per_origin = max_per_origin ? max_per_origin : 1;
+}
 
 void CommandQueue::push_command(Command command) {
-  commands.push_back(command);
+  commands.push_back(std::move(command));
+}
+
+/**
+ * @brief Drop the commands pushed since the last do_commands(), e.g. those of a P2 that turned out to be corrupt
+ */
+void CommandQueue::clear_commands() {
+  commands.clear();
+}
+
+/**
+ * @brief Choose where the data received with HGET is stored
+ *
+ * The factory is asked for a sink for every HGET that doesn't receive MO data. If
+ * it is not set or returns nullptr, the target MO is asked for a writer (see 
+ * MO::Interface::open_node_writer()). If there is none either, the data is collected
+ * in memory and set as the node value.
+ *
+ * The factory is called from the threads executing commands, possibly concurrently.
+ */
+void CommandQueue::set_download_sinks(SinkFactory factory) {
+  sink_factory = factory;
+}
+
+/**
+ * @brief Persist the progress of interrupted HGET downloads in the given directory
+ *
+ * Downloads into resumable sinks (see DownloadSink) can then also be resumed after a
+ * restart of the application. Pass an empty string to keep the progress in memory only
+ * (the default).
+ */
+void CommandQueue::set_download_state_dir(const std::string &dir) {
+  download_progress.set_persist_dir(dir);
+}
+
+/**
+ * @brief Limit the size of the download cache (see DownloadCache), 0 disables it
+ */
+void CommandQueue::set_download_cache_size(unsigned long long max_bytes) {
+  download_cache.set_max_bytes(max_bytes);
+}
+
+DownloadCache::Stats CommandQueue::download_cache_stats()
+const {
+  return download_cache.stats();
+}
+
+/**
+ * @brief Bytes and duration of the transfers of the last package that had commands
+ *
+ * @return one entry per HGET, HPUT and HPOST command, ordered by command
+ */
+std::vector<CommandQueue::TransferStats> CommandQueue::transfer_stats()
+const {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  std::vector<TransferStats> result = transfers;
+  std::sort(result.begin(), result.end(), [](const TransferStats &a, const TransferStats &b) { return a.command < b.command; });
+  return result;
 }
 
 CommandQueue::Status::Status(unsigned code) : code(code) {}
 
+double CommandQueue::TransferStats::throughput()
+const {
+  return duration_ns ? bytes * 1e9 / duration_ns : 0.0;
+}
+
+/**
+ * @brief Execute all queued commands
+ *
+ * Commands working on disjoint parts of the MO tree execute in parallel (see 
+ * set_concurrency()), commands on overlapping parts execute in the order they were 
+ * received. Identical HGET URLs are downloaded only once. The status of each command 
+ * is added to the responses, from where it is taken by p3_SC_json() or next_status_json() 
+ * in command order, no matter in which order the commands finish. Statuses of the
+ * previous package that were never taken (because its P3 could not be sent) are discarded.
+ */
 void CommandQueue::do_commands() {
-  while(!commands.empty()) {
-    auto command = commands.front();
-    switch(command.type) {
-      case CommandType::HGET:
-        do_hget(command.parameter);
-        break;
-      default:
-        responses.push_back(Status(501));
-        break;
+  {
+    // statuses left over from a P3 package that could not be sent belong to an earlier package
+    std::lock_guard<std::mutex> lock(responses_mutex);
+    responses.clear();
+    executing = true;
+    next_slot = 0;
+    held_back.clear();
+  }
+  // executing is reset however do_commands() is left, next_status_json() would wait forever otherwise
+  struct Done {
+    CommandQueue *queue;
+    ~Done() {
+      {
+        std::lock_guard<std::mutex> lock(queue->responses_mutex);
+        queue->executing = false;
+      }
+      queue->response_ready.notify_all();
+    }
+  } done{this};
+
+  auto run = std::make_shared<Execution>(this);
+  run->commands.assign(std::make_move_iterator(commands.begin()), std::make_move_iterator(commands.end()));
+  commands.clear();
+  prepare(*run);
+
+  if(!run->commands.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      transfers.clear();
+    }
+    {
+      std::lock_guard<std::mutex> lock(run->mutex);
+      wake_helpers(run);
+    }
+    work(run, true);
+  }
+}
+
+/**
+ * @brief Execute all queued commands in the background
+ *
+ * Same as do_commands(), but returns immediately, the commands are executed by
+ * the threads of the worker pool. While the commands execute, the statuses can 
+ * already be consumed with next_status_json(), e.g. to stream the P3 package to the
+ * server while the remaining commands are still running. 
+ *
+ * No commands must be pushed until the returned future is ready.
+ */
+std::future<void> CommandQueue::do_commands_async() {
+  // mark as executing right away, so that next_status_json() called before the
+  // background thread gets going doesn't take the queue for finished, nor sends the
+  // statuses left over from an earlier package
+  {
+    std::lock_guard<std::mutex> lock(responses_mutex);
+    responses.clear();
+    executing = true;
+  }
+  return worker_pool.submit([this]{ do_commands(); });
+}
+
+/**
+ * @brief Find which commands have to wait for which
+ *
+ * A command has to wait for all earlier commands whose target in the MO tree is 
+ * the same node, or an ancestor or descendant of its own target.
+ */
+void CommandQueue::prepare(Execution &run)
+const {
+  const size_t n = run.commands.size();
+  std::vector<std::string> targets(n);
+  run.origins.resize(n);
+  run.blocked_by.assign(n, 0);
+  run.unblocks.resize(n);
+
+  for(size_t i = 0; i < n; ++i) {
+    targets[i] = target_of(run.commands[i]);
+    run.origins[i] = origin_of(run.commands[i]);
+    for(size_t j = 0; j < i; ++j) {
+      if(overlaps(targets[j], targets[i])) {
+        run.unblocks[j].push_back(i);
+        ++run.blocked_by[i];
+      }
+    }
+    if(!run.blocked_by[i]) run.ready.insert(i);
+  }
+}
+
+/**
+ * @brief Execute ready commands of a run
+ *
+ * @param[in] coordinator - true for the thread running do_commands(), which returns only
+ *    after all commands finished. Helpers return as soon as nothing is ready for them.
+ */
+void CommandQueue::work(std::shared_ptr<Execution> run, bool coordinator) {
+  std::unique_lock<std::mutex> lock(run->mutex);
+  if(!coordinator) --run->helpers_queued;
+
+  // the queue is only used while commands are left, do_commands() is still running then
+  while(run->finished < run->commands.size()) {
+    size_t index;
+    if(take_ready(*run, index)) {
+      lock.unlock();
+      auto started = SessionMetrics::Clock::now();
+      // a command that throws fails on its own, the others and the P3 package still complete
+      Status status(500);
+      try {
+        status = run->queue->execute(*run, index);
+      } catch(const std::exception &e) {
+        LOG_ERROR("ERROR: command " << index << " of the package failed: " << e.what());
+      } catch(...) {
+        LOG_ERROR("ERROR: command " << index << " of the package failed");
+      }
+      run->queue->metrics.record(run->commands[index].type, SessionMetrics::Clock::now() - started);
+      run->queue->add_response(index, status);
+      lock.lock();
+      finish_command(*run, index);
+      wake_helpers(run);
+    } else if(coordinator) {
+      run->changed.wait(lock);
+    } else {
+      return;
+    }
+  }
+}
+
+// take the first ready command that is within the limits. Called with the run's mutex held
+bool CommandQueue::take_ready(Execution &run, size_t &index) {
+  if(run.running >= run.max_parallel) return false;
+  for(auto it = run.ready.begin(); it != run.ready.end(); ++it) {
+    const std::string &origin = run.origins[*it];
+    if(origin != "" && run.running_per_origin[origin] >= run.max_per_origin) continue;
+
+    index = *it;
+    run.ready.erase(it);
+    ++run.running;
+    if(origin != "") ++run.running_per_origin[origin];
+    return true;
+  }
+  return false;
+}
+
+// called with the run's mutex held
+void CommandQueue::finish_command(Execution &run, size_t index) {
+  const std::string &origin = run.origins[index];
+  --run.running;
+  if(origin != "") --run.running_per_origin[origin];
+  ++run.finished;
+  for(size_t waiting : run.unblocks[index]) {
+    if(--run.blocked_by[waiting] == 0) run.ready.insert(waiting);
+  }
+  run.changed.notify_all();
+}
+
+// submit helper tasks for the ready commands that could run now. Called with the run's mutex held
+void CommandQueue::wake_helpers(std::shared_ptr<Execution> run) {
+  size_t free_slots = run->max_parallel > run->running ? run->max_parallel - run->running : 0;
+  size_t wanted = std::min(run->ready.size(), free_slots);
+  while(run->helpers_queued < wanted) {
+    ++run->helpers_queued;
+    run->queue->worker_pool.submit([run]{ work(run, false); });
+  }
+}
+
+/**
+ * @brief Release the status of a finished command
+ *
+ * @param[in] slot - index of the command in the current run. Statuses are released in this order.
+ */
+void CommandQueue::add_response(size_t slot, Status status) {
+  {
+    std::lock_guard<std::mutex> lock(responses_mutex);
+    if(slot != next_slot) {
+      held_back.insert(std::make_pair(slot, status));
+      return;
+    }
+    responses.push_back(status);
+    ++next_slot;
+    for(auto it = held_back.find(next_slot); it != held_back.end(); it = held_back.find(next_slot)) {
+      responses.push_back(it->second);
+      held_back.erase(it);
+      ++next_slot;
+    }
+  }
+  response_ready.notify_all();
+}
+
+CommandQueue::Status CommandQueue::execute(Execution &run, size_t index) {
+  const Command &command = run.commands[index];
+  switch(command.type) {
+    case CommandType::HGET:
+      return do_hget(run, index, command.parameter);
+    case CommandType::HPUT:
+    case CommandType::HPOST:
+      return do_upload(index, command);
+    default:
+      return Status(501);
+  }
+}
+
+/**
+ * @brief The node in the MO tree a command works on
+ *
+ * This is the command's first parameter that is not an http(s) URL, so it works for
+ * all commands no matter where their ClientURI is in the parameter list. Commands
+ * without ClientURI get "", which overlaps everything.
+ */
+std::string CommandQueue::target_of(const Command &command) {
+  for(auto &parameter : command.parameter) {
+    if(parameter.compare(0, 7, "http://") != 0 && parameter.compare(0, 8, "https://") != 0) {
+      std::string target = parameter;
+      while(!target.empty() && target.back() == '/') target.pop_back();
+      return target;
     }
+  }
+  return "";
+}
 
-    commands.pop_front();
+/**
+ * @brief The origin a command transfers data from or to, "" if it doesn't use the network
+ */
+std::string CommandQueue::origin_of(const Command &command) {
+  Helper::URL url;
+  bool transfer = command.type == CommandType::HGET || command.type == CommandType::HPUT || command.type == CommandType::HPOST;
+  if(transfer && !command.parameter.empty() && url.parse_from_string(command.parameter[0])) {
+    return ConnectionPool::origin_of(url);
   }
+  return "";
+}
+
+/**
+ * @return true if a and b are the same node, or one is an ancestor of the other
+ */
+bool CommandQueue::overlaps(const std::string &a, const std::string &b) {
+  const std::string &shorter = a.size() <= b.size() ? a : b;
+  const std::string &longer = a.size() <= b.size() ? b : a;
+  if(shorter.empty()) return true;
+  if(longer.compare(0, shorter.size(), shorter) != 0) return false;
+  return longer.size() == shorter.size() || longer[shorter.size()] == '/';
 }
 
-  void CommandQueue::do_hget(std::vector<std::string> params) {
+  CommandQueue::Status CommandQueue::do_hget(Execution &run, size_t index, const std::vector<std::string> &params) {
+    if(params.size() < 2) {
+      LOG_ERROR("ERROR: HGET command without ServerURI and ClientURI");
+      return Status(400);
+    }
     Helper::URL serverURL;
     if(!serverURL.parse_from_string(params[0])) {
-      std::cerr << "ERROR: could not parse server URI in HGET command" << std::endl;
-      return;
+      LOG_ERROR("ERROR: could not parse server URI in HGET command");
+      return Status(400);
     };
     
     std::string clientURI = params[1];	// TODO: this is actually optional. We need to support client side decision on where to put the downloaded data
     
-    std::cout << "IN do_hget. ServerURI = " << params[0] << " - ClientURI = " << clientURI << std::endl;
+    LOG_DEBUG("IN do_hget. ServerURI = " << params[0] << " - ClientURI = " << clientURI);
 
-    std::string rbody;
-    httplib::Result res;
+    // the first HGET of an URL downloads it, the others wait for that download
+    std::shared_ptr<Download> data;
+    bool mine = false;
+    {
+      std::lock_guard<std::mutex> lock(run.mutex);
+      std::shared_ptr<Download> &entry = run.downloads[params[0]];
+      if(!entry) {
+        entry = std::make_shared<Download>();
+        mine = true;
+      }
+      data = entry;
+    }
+    auto start = std::chrono::steady_clock::now();
+    if(!mine) {
+      std::unique_lock<std::mutex> lock(data->mutex);
+      data->completed.wait(lock, [&data]{ return data->done; });
+      if(data->ok && !data->buffered) {
+        // the data went into the first HGET's own sink, this one needs its own download
+        data = std::make_shared<Download>();
+        mine = true;
+      }
+    }
+    if(mine) {
+      // the other HGETs of the URL wait for done, which has to be set even if the download throws
+      bool ok = false;
+      try {
+        ok = download(serverURL, params[0], clientURI, *data);
+      } catch(const std::exception &e) {
+        LOG_ERROR("ERROR: download of " << params[0] << " failed: " << e.what());
+      } catch(...) {
+        LOG_ERROR("ERROR: download of " << params[0] << " failed");
+      }
+      {
+        std::lock_guard<std::mutex> lock(data->mutex);
+        data->ok = ok;
+        data->done = true;
+      }
+      data->completed.notify_all();
+    }
+    record_transfer(index, params[0], false, data->bytes, mine ? data->wire_bytes : 0, std::chrono::steady_clock::now() - start);
+    if(!data->ok) return Status(500);
+    if(!data->buffered) return Status(200);  // the sink has stored the data
 
-    if(serverURL.protocol == Helper::URL::Protocol::HTTPS) {
-      httplib::SSLClient cli(serverURL.server, serverURL.port);
-      res = cli.Get(serverURL.path.c_str());
-    } else if(serverURL.protocol == Helper::URL::Protocol::HTTP) {
-      httplib::Client cli(serverURL.server, serverURL.port);
-      res = cli.Get(serverURL.path.c_str());
+    // MO data is decoded, anything else is stored as it is
+    json modata;
+    if(data->content_type.compare(0, 16, "application/dmmo") == 0) {
+      Codec::Format format = Codec::format_of(data->content_type);
+      if(!Codec::decode(data->body, format, modata)) {
+        LOG_ERROR("ERROR: could not decode MO data received for HGET command");
+        return Status(400);
+      }
+      LOG_TRACE("Server response is:" << '\n' << modata);
     } else {
-      std::cerr << "ERROR: unsupported protocol in HGET command" << std::endl;
-      return;
+      modata = json(data->body);
+    }
+      
+    std::lock_guard<std::mutex> lock(mo_mutex);
+    if(!motree.node_set(clientURI, modata)) {
+      LOG_ERROR("ERROR: could not store data received for HGET command in " << clientURI);
+      return Status(500);
+    }
+    return Status(200);
+  }
+
+  /**
+   * @brief Send the MO data of a subtree to the server, for HPUT and HPOST
+   *
+   * The subtree is serialized (see MOTree::write_node()) while the MO tree is locked,
+   * into memory or, if it is large, into a temporary file (see Spool). It is sent with
+   * chunked transfer encoding after the lock was released, so a slow upload doesn't
+   * hold up other commands that access the MO tree.
+   */
+  CommandQueue::Status CommandQueue::do_upload(size_t index, const Command &command) {
+    const std::vector<std::string> &params = command.parameter;
+    const char *name = command.type == CommandType::HPUT ? "HPUT" : "HPOST";
+    if(params.size() < 2) {
+      LOG_ERROR("ERROR: " << name << " command without ServerURI and ClientURI");
+      return Status(400);
+    }
+    Helper::URL serverURL;
+    if(!serverURL.parse_from_string(params[0])) {
+      LOG_ERROR("ERROR: could not parse server URI in " << name << " command");
+      return Status(400);
+    }
+    const std::string &clientURI = params[1];
+
+    LOG_DEBUG("IN do_upload. " << name << " ServerURI = " << params[0] << " - ClientURI = " << clientURI);
+
+    Spool spool;
+    {
+      std::lock_guard<std::mutex> lock(mo_mutex);
+      if(!motree.node_exists(clientURI)) {
+        LOG_ERROR("ERROR: " << name << " of non-existent node " << clientURI);
+        return Status(404);
+      }
+      Transport::BodySink to_spool = [&spool](const char *data, size_t length) {
+        return spool.write(data, length);
+      };
+      PackageWriter writer(mo_format, to_spool);
+      if(!motree.write_node(writer, clientURI) || !writer.flush()) {
+        LOG_ERROR("ERROR: could not serialize " << clientURI << " for " << name << " command");
+        return Status(500);
+      }
+    }
+
+    const std::string content_type = Codec::content_type("application/dmmo", mo_format);
+    unsigned long long sent = 0;
+    httplib::ContentProviderWithoutLength provider = [&spool, &sent](size_t offset, httplib::DataSink &sink) {
+      (void)offset;
+      sent = 0;   // the transfer may start over on a new connection
+      bool ok = spool.send([&sink, &sent](const char *data, size_t length) {
+        sent += length;
+        return sink.write(data, length);
+      });
+      if(ok) sink.done();
+      return ok;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto connection = connection_pool.acquire(serverURL);
+    auto res = command.type == CommandType::HPUT 
+               ? connection->Put(serverURL.path.c_str(), {}, provider, content_type.c_str())
+               : connection->Post(serverURL.path.c_str(), {}, provider, content_type.c_str());
+    record_transfer(index, params[0], true, sent, sent, std::chrono::steady_clock::now() - start);
+
+    if(!res) {
+      LOG_ERROR("ERROR: connection to server failed when trying to send " << name << " command");
+      connection.discard();
+      return Status(500);
+    }
+    LOG_DEBUG("http result is: " << res->status);
+    return Status(res->status >= 200 && res->status < 300 ? 200 : 500);
+  }
+
+  /**
+   * @brief Download the resource at serverURL for HGET
+   *
+   * Downloads into resumable sinks that are interrupted are continued where they stopped,
+   * up to hget_attempts times. If that doesn't complete them, the progress is kept (see
+   * set_download_state_dir()) for the next HGET of the same URL to the same node.
+   *
+   * @param[in] url - the URL as given in the command, identifies the download together with clientURI
+   * @param[in] clientURI - target node of the HGET
+   * @param[out] result - content type, size and, if buffered, the (decompressed) data
+   * @return false if the download failed or the sink could not store the data
+   */
+  bool CommandQueue::download(const Helper::URL &serverURL, const std::string &url, const std::string &clientURI, Download &result) {
+    for(unsigned attempt = 1; ; ++attempt) {
+      Attempt outcome = fetch(serverURL, url, clientURI, result);
+      if(outcome != Attempt::Interrupted || attempt == hget_attempts) {
+        return outcome == Attempt::Complete;
+      }
+      LOG_WARNING("Warning: HGET " << url << " interrupted after " << result.bytes << " bytes, resuming");
+      std::this_thread::sleep_for(std::chrono::milliseconds(500 * attempt));
+    }
+  }
+
+  /**
+   * @brief One attempt of an HGET download, see download()
+   *
+   * If there is progress of an earlier attempt, only the rest of the resource is requested
+   * with a Range request, on the condition that it is still the same version of the resource
+   * (If-Range). The server answers with the complete resource otherwise, which replaces
+   * the partial data. Error responses keep the partial data for a later attempt, except
+   * 416 (the range doesn't fit the resource anymore).
+   *
+   * Resuming relies on byte offsets of the stored data, so these requests don't accept
+   * compressed responses, and compressed responses are not resumable.
+   *
+   * Other requests are made conditional if the data of the URL is in the download cache.
+   */
+  CommandQueue::Attempt CommandQueue::fetch(const Helper::URL &serverURL, const std::string &url, const std::string &clientURI, Download &result) {
+    const std::string key = url + " " + clientURI;
+    std::unique_ptr<Compression::Inflater> inflater;
+    std::unique_ptr<DownloadSink> sink;
+    bool sink_failed = false;
+    DownloadProgress::Entry progress;
+    bool resumable = false;   // the progress of this download is recorded
+    bool accepting = false;   // the sink was prepared for the body of a 2xx response
+    Compression::Sink deliver = [&](const char *data, size_t length) {
+      result.bytes += length;
+      if(!sink->write(data, length)) {
+        sink_failed = true;
+        return false;
+      }
+      if(resumable && result.bytes - progress.offset >= progress_interval && sink->flush()) {
+        progress.offset = result.bytes;
+        download_progress.save(key, progress);
+      }
+      return true;
+    };
+
+    std::string accept = Codec::content_type("application/dmmo", mo_format);
+    if(mo_format != Codec::Format::JSON) accept += ", application/dmmo+json;q=0.5";
+    httplib::Headers headers = {{"Accept", accept}};
+
+    result.buffered = false;
+    result.body.clear();
+    unsigned long long offset = 0;
+    if(download_progress.find(key, progress)) {
+      sink = open_sink(clientURI, progress.content_type, progress.length, result);
+      offset = std::min(progress.offset, sink->partial_size());
+      if(sink->resumable() && offset > 0 && progress.validator() != "") {
+        headers.emplace("Range", "bytes=" + std::to_string(offset) + "-");
+        headers.emplace("If-Range", progress.validator());
+        resumable = true;
+      } else {
+        download_progress.forget(key);
+        offset = 0;
+        sink.reset();
+        result.buffered = false;
+      }
     }
+    result.bytes = offset;
+    if(!resumable) headers.emplace("Accept-Encoding", "gzip, deflate");
+
+    DownloadCache::Entry cached;
+    bool conditional = !resumable && download_cache.lookup(url, cached);
+    if(conditional) {
+      if(cached.etag != "") headers.emplace("If-None-Match", cached.etag);
+      if(cached.last_modified != "") headers.emplace("If-Modified-Since", cached.last_modified);
+    }
+
+    long long length = -1;  // of the complete resource
+    std::string sha256;
+
+    // the pool hands out http or https connections depending on serverURL.protocol
+    auto connection = connection_pool.acquire(serverURL);
+    auto res = connection->Get(serverURL.path.c_str(), headers,
+        [&](const httplib::Response &response) {
+          if(response.status < 200 || response.status >= 300) return true;  // error pages are discarded
+
+          result.content_type = response.get_header_value("Content-Type");
+          sha256 = digest_sha256(response.get_header_value("Digest"));
+          if(Compression::parse_encoding(response.get_header_value("Content-Encoding")) != Compression::Encoding::Identity) {
+            inflater.reset(new Compression::Inflater());
+          } else if(response.has_header("Content-Length")) {
+            length = std::strtoll(response.get_header_value("Content-Length").c_str(), nullptr, 10);
+          }
+
+          if(response.status == 206 && resumable) {
+            unsigned long long first;
+            if(!parse_content_range(response.get_header_value("Content-Range"), first, length) || first != offset) {
+              LOG_ERROR("ERROR: HGET - server sent an unexpected range");
+              return false;
+            }
+            result.bytes = offset;
+            progress.offset = offset;
+            sink_failed = !sink->resume(result.content_type, length, offset);
+            accepting = !sink_failed;
+            return accepting;
+          }
+
+          // the complete resource, also if it changed since the earlier attempt
+          if(!sink) sink = open_sink(clientURI, result.content_type, length, result);
+          result.bytes = 0;
+          resumable = !inflater && sink->resumable() 
+                      && (response.has_header("ETag") || response.has_header("Last-Modified"));
+          if(resumable) {
+            progress = DownloadProgress::Entry();
+            progress.content_type = result.content_type;
+            progress.etag = response.get_header_value("ETag");
+            progress.last_modified = response.get_header_value("Last-Modified");
+            progress.length = length;
+            download_progress.save(key, progress);
+          } else {
+            download_progress.forget(key);
+          }
+          sink_failed = !sink->begin(result.content_type, length);
+          accepting = !sink_failed;
+          return accepting;
+        },
+        [&](const char *data, size_t data_length) {
+          result.wire_bytes += data_length;
+          // also when resuming, where the sink exists before the response arrives
+          if(!accepting) return true;
+          return inflater ? inflater->write(data, data_length, deliver) : deliver(data, data_length);
+        });
 
     if(res) {
-      std::cerr << "http result is: " << res->status << std::endl;
-      rbody = res->body;
+      LOG_DEBUG("http result is: " << res->status);
     } else {
-      std::cerr << "ERROR: connection to server failed when trying to send HGET command" << std::endl;
-      return;
+      LOG_ERROR("ERROR: connection to server failed or download aborted when trying to send HGET command");
+      connection.discard();
     }
 
-    std::cout << "Server response is:" << std::endl << rbody << std::endl;
-      
-    motree.node_set(clientURI, json(rbody));
-    responses.push_back(Status(200));
+    if(conditional && res && res->status == 304) {
+      download_cache.hit(url, cached.data.size());
+      return apply_cached(clientURI, cached, result) ? Attempt::Complete : Attempt::Failed;
+    }
 
+    bool interrupted = !res && !sink_failed;
+    bool complete = res && res->status >= 200 && res->status < 300 && accepting;
+    if(complete && inflater && !inflater->finish()) {
+      LOG_ERROR("ERROR: could not decompress response to HGET command");
+      complete = false;
+    }
+    if(complete && length >= 0 && result.bytes < static_cast<unsigned long long>(length)) {
+      LOG_ERROR("ERROR: server closed the connection before all data of the HGET was received");
+      complete = false;
+      interrupted = true;
+    }
+
+    if(complete) {
+      download_progress.forget(key);
+      if(!sink->verify(length, sha256)) {
+        LOG_ERROR("ERROR: verification of data received for HGET command failed");
+        sink->abort();
+        return Attempt::Failed;
+      }
+      if(!sink->finish()) return Attempt::Failed;
+
+      // only data that is in memory anyway is cached
+      if(result.buffered) {
+        download_cache.store(url, DownloadCache::Entry{result.content_type, res->get_header_value("ETag"), 
+                                                       res->get_header_value("Last-Modified"), result.body});
+      } else {
+        download_cache.remove(url);
+      }
+      return Attempt::Complete;
+    }
+
+    if(resumable && interrupted) {
+      // keep what we have, also if this attempt didn't add anything
+      sink->suspend();
+      progress.offset = result.bytes;
+      download_progress.save(key, progress);
+      return result.bytes > offset ? Attempt::Interrupted : Attempt::Failed;
+    }
+    if(resumable && res && !accepting && res->status != 416) {
+      // an error response (e.g. a proxy failing for a moment) says nothing about the partial data
+      LOG_WARNING("Warning: HGET " << url << " - server answered " << res->status << ", keeping the partial data");
+      sink->suspend();
+      progress.offset = offset;
+      download_progress.save(key, progress);
+      return res->status >= 500 ? Attempt::Interrupted : Attempt::Failed;
+    }
+    download_progress.forget(key);
+    if(sink) sink->abort();
+    // 416: the partial data doesn't fit the resource anymore, start over
+    return res && res->status == 416 ? Attempt::Interrupted : Attempt::Failed;
+  }
+
+  /**
+   * @brief Store data from the download cache like received data, after a 304 response
+   */
+  bool CommandQueue::apply_cached(const std::string &clientURI, DownloadCache::Entry &cached, Download &result) {
+    const long long length = cached.data.size();
+    result.content_type = cached.content_type;
+    result.bytes = length;
+    std::unique_ptr<DownloadSink> sink = open_sink(clientURI, cached.content_type, length, result);
+    if(result.buffered) {
+      result.body = std::move(cached.data);
+      return true;
+    }
+    if(!sink->begin(cached.content_type, length) || !sink->write(cached.data.data(), length) || !sink->verify(length, "")) {
+      sink->abort();
+      return false;
+    }
+    return sink->finish();
+  }
+
+  /**
+   * @brief Choose the sink for the data received with HGET, see set_download_sinks()
+   *
+   * @param[in] length - Content-Length of the (uncompressed) data, -1 if unknown
+   * @param[out] result - buffered is set if the data is collected in result.body
+   */
+  std::unique_ptr<DownloadSink> CommandQueue::open_sink(const std::string &clientURI, const std::string &content_type, long long length, Download &result) {
+    // MO data needs to be decoded as a whole
+    if(content_type.compare(0, 16, "application/dmmo") != 0) {
+      std::unique_ptr<DownloadSink> sink;
+      if(sink_factory) sink = sink_factory(clientURI, content_type, length);
+      if(!sink) {
+        std::unique_ptr<MO::Interface::NodeWriter> writer;
+        {
+          std::lock_guard<std::mutex> lock(mo_mutex);
+          writer = motree.node_writer(clientURI, content_type);
+        }
+        if(writer) sink.reset(new NodeWriterSink(std::move(writer)));
+      }
+      if(sink) return sink;
+    }
+    result.buffered = true;
+    return std::unique_ptr<DownloadSink>(new MemorySink(result.body));
+  }
+
+  void CommandQueue::record_transfer(size_t index, const std::string &url, bool upload, unsigned long long bytes, unsigned long long wire_bytes, std::chrono::steady_clock::duration duration) {
+    TransferStats stats{index, url, upload, bytes, wire_bytes, (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()};
+    LOG_INFO((upload ? "Upload to " : "HGET ") << url << ": " << bytes << " bytes (" << wire_bytes << (upload ? " sent" : " received") << ") in " 
+             << stats.duration_ns / 1000000 << " ms, " << (unsigned long long)(stats.throughput() / 1024) << " kB/s");
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    transfers.push_back(stats);
   }
 
   json CommandQueue::p3_SC_json() {
     json status;
 
+    std::lock_guard<std::mutex> lock(responses_mutex);
     while(!responses.empty()) {
-      auto response = responses.front();
-      json jresponse;
-      jresponse["sc"] = response.code;
-      for(auto uri : response.URI) {
-        jresponse["URI"].push_back(uri);
-      }
-      status.push_back(jresponse);
+      status.push_back(status_json(responses.front()));
       responses.pop_front();
     }
     return status;  
   }
 
+  /**
+   * @brief Take the next status for the P3 package, waiting for it if necessary
+   *
+   * If commands are currently executing and no status is available yet, this blocks
+   * until the next command finishes.
+   *
+   * @param[out] status - json object for one entry of the P3 Status vector
+   * @return false if there are no more statuses and no commands are executing
+   */
+  bool CommandQueue::next_status_json(json &status) {
+    // waiting for commands to finish doesn't count as time spent building P3
+    SessionMetrics::Stopwatch::Pause pause;
+    std::unique_lock<std::mutex> lock(responses_mutex);
+    response_ready.wait(lock, [this]{ return !responses.empty() || !executing; });
+    if(responses.empty()) return false;
+
+    status = status_json(responses.front());
+    responses.pop_front();
+    return true;
+  }
+
+  json CommandQueue::status_json(const Status &response) 
+  const {
+    json jresponse;
+    jresponse["sc"] = response.code;
+    for(auto uri : response.URI) {
+      jresponse["URI"].push_back(uri);
+    }
+    return jresponse;
+  }
+
 } // namespace
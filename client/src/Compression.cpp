@@ -0,0 +1,243 @@
+/**
+ * Content-Encoding support for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "Compression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+
+#include "Log.h"
+
+namespace Grandma {
+
+namespace {
+
+  const size_t buffer_size = 16384;
+
+  unsigned long long thread_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  }
+
+  std::string lowercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::tolower(c); });
+    return s;
+  }
+
+} // namespace
+
+Compression::Stats::Stats() : packages(0), raw_bytes(0), wire_bytes(0), cpu_ns(0) {}
+
+void Compression::Stats::add(const Stats &other) {
+  packages += other.packages;
+  raw_bytes += other.raw_bytes;
+  wire_bytes += other.wire_bytes;
+  cpu_ns += other.cpu_ns;
+}
+
+double Compression::Stats::ratio()
+const {
+  return raw_bytes ? static_cast<double>(wire_bytes) / raw_bytes : 1.0;
+}
+
+/**
+ * @brief Map a Content-Encoding header value to an Encoding
+ *
+ * Unknown encodings are mapped to Identity.
+ */
+Compression::Encoding Compression::parse_encoding(const std::string &content_encoding) {
+  std::string encoding = lowercase(content_encoding);
+  if(encoding == "gzip" || encoding == "x-gzip") return Encoding::Gzip;
+  if(encoding == "deflate") return Encoding::Deflate;
+  return Encoding::Identity;
+}
+
+const char *Compression::encoding_name(Encoding encoding) {
+  switch(encoding) {
+    case Encoding::Gzip: return "gzip";
+    case Encoding::Deflate: return "deflate";
+    default: return "identity";
+  }
+}
+
+/**
+ * @brief Check if an Accept-Encoding header value lists the given encoding
+ *
+ * An encoding is accepted if it (or "*") is listed without a q-value of 0.
+ */
+bool Compression::accepts(const std::string &accept_encoding, Encoding encoding) {
+  std::string accept = lowercase(accept_encoding);
+  std::string name = encoding_name(encoding);
+
+  size_t pos = 0;
+  while(pos < accept.size()) {
+    size_t end = accept.find(',', pos);
+    if(end == std::string::npos) end = accept.size();
+    std::string token = accept.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t params = token.find(';');
+    std::string coding = token.substr(0, params);
+    coding.erase(0, coding.find_first_not_of(" \t"));
+    coding.erase(coding.find_last_not_of(" \t") + 1);
+    if(coding != name && coding != "*") continue;
+
+    size_t q = token.find("q=", params == std::string::npos ? token.size() : params);
+    return q == std::string::npos || std::strtod(token.c_str() + q + 2, nullptr) > 0.0;
+  }
+  return false;
+}
+
+/**
+ * @{
+ * Deflater
+ */
+Compression::Deflater::Deflater(Encoding encoding, int level) : stream() {
+  // 15 bits window, +16 selects the gzip instead of the zlib wrapper
+  int window_bits = (encoding == Encoding::Gzip) ? 15 + 16 : 15;
+  ok = deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  if(!ok) {
+    LOG_ERROR("ERROR: Compression - could not initialize zlib deflate");
+  }
+  counters.packages = 1;
+}
+
+Compression::Deflater::~Deflater() {
+  if(ok) deflateEnd(&stream);
+}
+
+/**
+ * @brief Compress the next piece of the body, passing compressed output to the sink
+ *
+ * Compressed output is only passed on when a full buffer is available, so the sink
+ * doesn't see lots of tiny pieces.
+ */
+bool Compression::Deflater::write(const char *data, size_t length, const Sink &sink) {
+  if(!ok) return false;
+  counters.raw_bytes += length;
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  stream.avail_in = length;
+  return run(Z_NO_FLUSH, sink);
+}
+
+/**
+ * @brief Flush all remaining compressed output into the sink and end the stream
+ */
+bool Compression::Deflater::finish(const Sink &sink) {
+  if(!ok) return false;
+  stream.next_in = nullptr;
+  stream.avail_in = 0;
+  return run(Z_FINISH, sink);
+}
+
+bool Compression::Deflater::run(int flush, const Sink &sink) {
+  char buffer[buffer_size];
+  unsigned long long start = thread_cpu_ns();
+
+  int result;
+  do {
+    stream.next_out = reinterpret_cast<Bytef *>(buffer);
+    stream.avail_out = buffer_size;
+    result = deflate(&stream, flush);
+    if(result == Z_STREAM_ERROR) {
+      ok = false;
+      return false;
+    }
+    size_t produced = buffer_size - stream.avail_out;
+    if(produced) {
+      counters.cpu_ns += thread_cpu_ns() - start;
+      counters.wire_bytes += produced;
+      if(!sink(buffer, produced)) return false;
+      start = thread_cpu_ns();
+    }
+  } while(stream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+
+  counters.cpu_ns += thread_cpu_ns() - start;
+  return true;
+}
+
+const Compression::Stats &Compression::Deflater::stats()
+const {
+  return counters;
+}
+/**
+ * @}
+ * @{
+ * Inflater
+ */
+Compression::Inflater::Inflater() : stream(), ended(false) {
+  // +32: automatically detect gzip or zlib wrapper
+  ok = inflateInit2(&stream, 15 + 32) == Z_OK;
+  if(!ok) {
+    LOG_ERROR("ERROR: Compression - could not initialize zlib inflate");
+  }
+  counters.packages = 1;
+}
+
+Compression::Inflater::~Inflater() {
+  if(ok) inflateEnd(&stream);
+}
+
+/**
+ * @brief Decompress the next piece of a body, passing decompressed output to the sink
+ *
+ * @return false on corrupt input or if the sink failed
+ */
+bool Compression::Inflater::write(const char *data, size_t length, const Sink &sink) {
+  if(!ok) return false;
+  counters.wire_bytes += length;
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  stream.avail_in = length;
+
+  char buffer[buffer_size];
+  unsigned long long start = thread_cpu_ns();
+  // also loop while the output buffer got filled, zlib may hold back more output
+  do {
+    stream.next_out = reinterpret_cast<Bytef *>(buffer);
+    stream.avail_out = buffer_size;
+    int result = inflate(&stream, Z_NO_FLUSH);
+    if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+      LOG_ERROR("ERROR: Compression - corrupt compressed data");
+      ok = false;
+      return false;
+    }
+    if(result == Z_STREAM_END) ended = true;
+    size_t produced = buffer_size - stream.avail_out;
+    if(produced) {
+      counters.cpu_ns += thread_cpu_ns() - start;
+      counters.raw_bytes += produced;
+      if(!sink(buffer, produced)) return false;
+      start = thread_cpu_ns();
+    } else if(result == Z_BUF_ERROR) {
+      break;  // no progress possible, need more input
+    }
+  } while(!ended && (stream.avail_in > 0 || stream.avail_out == 0));
+  counters.cpu_ns += thread_cpu_ns() - start;
+  return true;
+}
+
+/**
+ * @return true if the complete compressed stream was decompressed
+ */
+bool Compression::Inflater::finish()
+const {
+  return ok && ended;
+}
+
+const Compression::Stats &Compression::Inflater::stats()
+const {
+  return counters;
+}
+/**
+ * @}
+ */
+
+} // namespace
@@ -0,0 +1,256 @@
+/**
+ * HTTP(S) connection pool for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "ConnectionPool.h"
+
+#define CPPHTTPLIB_OPENSSL_SUPPORT
+#include <httplib.h>
+// httplib includes some arpa stuff, which defines DELETE as a macro, but we use it as a enum value for OMADM commands
+#undef DELETE
+
+namespace Grandma {
+
+ConnectionPool::Origin::Origin() : open(0) {}
+
+ConnectionPool::ConnectionPool(unsigned max_per_origin, std::chrono::seconds idle_timeout)
+  : max_per_origin(max_per_origin ? max_per_origin : 1), idle_timeout(idle_timeout), 
+    tls_sessions(std::make_shared<TlsSessionCache>()), counters() {}
+
+// defined here, where httplib::Client is a complete type
+ConnectionPool::~ConnectionPool() {}
+
+/**
+ * @brief Build the pool key for an URL
+ *
+ * @param[in] url - parsed URL, only protocol, server and port are relevant
+ * @return origin string, e.g. "https://dm.example.com:443"
+ */
+std::string ConnectionPool::origin_of(const Helper::URL &url) {
+  std::string scheme = (url.protocol == Helper::URL::Protocol::HTTPS) ? "https" : "http";
+  return scheme + "://" + url.server + ":" + std::to_string(url.port);
+}
+
+/**
+ * @brief The process wide default pool, shared by all DMClient instances that weren't given their own
+ */
+std::shared_ptr<ConnectionPool> ConnectionPool::shared() {
+  static std::shared_ptr<ConnectionPool> pool = std::make_shared<ConnectionPool>();
+  return pool;
+}
+
+/**
+ * @brief Get exclusive use of a connection to the origin of the given URL
+ *
+ * Reuses the most recently returned idle connection to the same origin if there
+ * is one. Otherwise a new (keep-alive) client is created, unless the per-origin
+ * limit is reached, in which case this blocks until another user returns a
+ * connection to this origin.
+ *
+ * @param[in] url - target URL, only protocol, server and port are used
+ * @param[in] lane - Session for protocol packages, Transfer for everything else. See class description
+ * @return Lease on the connection, to be used like a pointer to httplib::Client
+ */
+ConnectionPool::Lease ConnectionPool::acquire(const Helper::URL &url, Lane lane) {
+  const std::string origin_name = origin_of(url);
+  const std::string key = (lane == Lane::Session ? "session " : "transfer ") + origin_name;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  Origin &origin = origins[key];
+
+  bool waited = false;
+  for(;;) {
+    auto now = std::chrono::steady_clock::now();
+    purge_idle_locked(origin, now);
+
+    if(!origin.idle.empty()) {
+      std::unique_ptr<httplib::Client> client = std::move(origin.idle.back().client);
+      origin.idle.pop_back();
+      ++counters.hits;
+      return Lease(this, key, std::move(client));
+    }
+    if(origin.open < max_per_origin) {
+      break;
+    }
+    if(!waited) {
+      ++counters.waits;
+      waited = true;
+    }
+    released.wait(lock);
+  }
+
+  ++origin.open;
+  ++counters.misses;
+  lock.unlock();
+
+  // connection setup happens lazily in httplib on the first request, so creating the
+  // client outside of the lock is only about not blocking other users of the pool
+  std::unique_ptr<httplib::Client> client(new httplib::Client(origin_name));
+  client->set_keep_alive(true);
+  client->set_decompress(false);  // Content-Encoding is handled by us, see Compression
+  if(url.protocol == Helper::URL::Protocol::HTTPS) {
+    TlsSessionCache::attach(tls_sessions, client->ssl_context(), origin_name);
+  }
+  return Lease(this, key, std::move(client));
+}
+
+/**
+ * @brief Return a connection to the pool
+ *
+ * Called from the Lease destructor. Connections that were discarded are closed
+ * and only free their slot in the per-origin limit.
+ */
+void ConnectionPool::release(const std::string &key, std::unique_ptr<httplib::Client> client, bool reusable) {
+  std::unique_ptr<httplib::Client> doomed;  // destroyed (and thereby closed) outside of the lock
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Origin &origin = origins[key];
+    if(reusable && client) {
+      origin.idle.push_back(IdleConnection{std::move(client), std::chrono::steady_clock::now()});
+    } else {
+      doomed = std::move(client);
+      --origin.open;
+      ++counters.discarded;
+    }
+  }
+  released.notify_all();
+}
+
+/**
+ * @brief Close all connections that exceeded the idle timeout
+ *
+ * This also happens automatically on every acquire() for the requested origin, but
+ * applications can call it from time to time to close connections to origins that
+ * are not used anymore.
+ */
+void ConnectionPool::purge_idle() {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto now = std::chrono::steady_clock::now();
+  for(auto &origin : origins) {
+    purge_idle_locked(origin.second, now);
+  }
+}
+
+void ConnectionPool::purge_idle_locked(Origin &origin, std::chrono::steady_clock::time_point now) {
+  // idle connections are ordered by last use, so the expired ones are at the front
+  auto first_alive = origin.idle.begin();
+  while(first_alive != origin.idle.end() && now - first_alive->last_used > idle_timeout) {
+    ++first_alive;
+  }
+  auto n_expired = first_alive - origin.idle.begin();
+  origin.idle.erase(origin.idle.begin(), first_alive);
+  origin.open -= n_expired;
+  counters.expired += n_expired;
+}
+
+void ConnectionPool::set_max_per_origin(unsigned max) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    max_per_origin = max ? max : 1;
+  }
+  released.notify_all();
+}
+
+void ConnectionPool::set_idle_timeout(std::chrono::seconds timeout) {
+  std::lock_guard<std::mutex> lock(mutex);
+  idle_timeout = timeout;
+}
+
+/**
+ * @brief Snapshot of the pool counters
+ */
+ConnectionPool::Stats ConnectionPool::stats()
+const {
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats snapshot = counters;
+  snapshot.open = 0;
+  snapshot.idle = 0;
+  for(auto &origin : origins) {
+    snapshot.open += origin.second.open;
+    snapshot.idle += origin.second.idle.size();
+  }
+  return snapshot;
+}
+
+/**
+ * @brief TLS session cache shared by all https connections of this pool
+ */
+TlsSessionCache &ConnectionPool::tls_session_cache() {
+  return *tls_sessions;
+}
+
+/**
+ * @brief Attach the pool's TlsSessionCache to the TLS context of connections made outside of the pool
+ *
+ * Like the pooled connections, they then resume the sessions of earlier connections to
+ * the same origin, and their sessions can be resumed by the pooled connections. See
+ * TlsSessionCache::attach()
+ */
+void ConnectionPool::attach_tls_sessions(SSL_CTX *ctx, const std::string &origin) {
+  TlsSessionCache::attach(tls_sessions, ctx, origin);
+}
+
+/**
+ * @{
+ * Lease
+ */
+ConnectionPool::Lease::Lease() : pool(nullptr) {}
+
+ConnectionPool::Lease::Lease(ConnectionPool *pool, std::string origin, std::unique_ptr<httplib::Client> client)
+  : pool(pool), origin(origin), client(std::move(client)) {}
+
+ConnectionPool::Lease::Lease(Lease &&other)
+  : pool(other.pool), origin(std::move(other.origin)), client(std::move(other.client)) {
+  other.pool = nullptr;
+}
+
+ConnectionPool::Lease &ConnectionPool::Lease::operator=(Lease &&other) {
+  if(this != &other) {
+    if(pool && client) pool->release(origin, std::move(client), true);
+    pool = other.pool;
+    origin = std::move(other.origin);
+    client = std::move(other.client);
+    other.pool = nullptr;
+  }
+  return *this;
+}
+
+ConnectionPool::Lease::~Lease() {
+  if(pool && client) pool->release(origin, std::move(client), true);
+}
+
+httplib::Client *ConnectionPool::Lease::operator->()
+const {
+  return client.get();
+}
+
+httplib::Client &ConnectionPool::Lease::operator*()
+const {
+  return *client;
+}
+
+ConnectionPool::Lease::operator bool()
+const {
+  return client != nullptr;
+}
+
+/**
+ * @brief Close the connection instead of returning it to the pool
+ *
+ * Use this after transport errors, so the next user of the pool does not inherit
+ * a connection in an unknown state.
+ */
+void ConnectionPool::Lease::discard() {
+  if(pool && client) pool->release(origin, std::move(client), false);
+  pool = nullptr;
+}
+/**
+ * @}
+ */
+
+} // namespace
@@ -1,11 +1,24 @@
 #include "DMClient.h"
 
-#include <iostream>
-#include <iomanip>
+#include "Log.h"
 
 namespace Grandma {
 
-DMClient::DMClient() : command_queue(motree), session(motree, command_queue) {}
+/**
+ * Create a client using the process wide shared connection and worker pools
+ */
+DMClient::DMClient() : DMClient(ConnectionPool::shared(), WorkerPool::shared()) {}
+
+/**
+ * Create a client using the given connection and worker pools
+ *
+ * Any number of clients can share the same pools. Each client has its own MO tree,
+ * device id and server URL.
+ */
+DMClient::DMClient(std::shared_ptr<ConnectionPool> connection_pool, std::shared_ptr<WorkerPool> worker_pool)
+  : connection_pool(connection_pool), worker_pool(worker_pool), event_loop(EventLoop::shared()),
+    command_queue(motree, *connection_pool, *worker_pool, metrics), session(motree, command_queue, *connection_pool, metrics),
+    P1_dump_tree(false), P1_incremental_tree(false) {}
 
 /**
  * Pass through to MOTree - see there for documentation
@@ -26,39 +39,474 @@ void DMClient::add_MO(std::string urn, std::shared_ptr<MO::Interface> mo, std::s
 // finished at this moment, so it can stay here until the design gets more refined.
 void DMClient::start_session(bool server_initiated) {
 
+  if(DevId.empty()) {
+    LOG_ERROR("ERROR: can't start session without a device ID, see set_device_id()");
+    return;
+  }
+  if(!session.begin()) {
+    LOG_ERROR("ERROR: can't start session, another session is still running");
+    return;
+  }
+  auto started = SessionMetrics::Clock::now();
+
+  prepare_P1(server_initiated);
+  bool received = session.send_P1([this](const Transport::BodySink &sink) {
+    return write_P1(sink);
+  });
+  settle_alerts(received);
+
+  session.set_state(Session::SessionState::P2);
+  while(received && session.continues()) {
+    // the commands of this round execute in the background, while P3 is already being
+    // streamed to the server with the status of each command as soon as it finished
+    auto execution = command_queue.do_commands_async();
+    session.set_state(Session::SessionState::P3cont);
+    received = session.send_P3([this](const Transport::BodySink &sink) {
+      return write_P3(sink);
+    });
+    settle_alerts(received);
+    execution.wait();
+    session.set_state(Session::SessionState::P2);
+  }
+  session.set_state(Session::SessionState::P3end);
+  acknowledge_tree();
+  metrics.record(SessionMetrics::Phase::Total, SessionMetrics::Clock::now() - started);
+  session.set_state(Session::SessionState::Idle);
+}
+
+/**
+ * @brief Start a session without blocking the calling thread
+ *
+ * The session is driven by the client's event loop: each step of the session runs
+ * on the loop thread, while building packages and executing commands is done by the
+ * worker pool. With the default HttpTransport, the packages are sent and the server's
+ * answers received on the loop (see Transport::post_async()), so sessions waiting for
+ * the server don't hold a worker. Many clients can run their sessions concurrently
+ * this way, with only the loop thread and the worker threads involved. Transfers of
+ * commands (HGET, HPUT, HPOST) still block a worker while they run.
+ *
+ * The client must not be destroyed before the session has completed.
+ *
+ * @param[in] server_initiated - see start_session()
+ * @param[in] on_complete - optional callback, called on the loop thread when the session completed
+ * @return future that becomes ready when the session has completed. The value (also passed
+ *    to on_complete) is false if the session could not be started (e.g. no device ID set) or the server could not be reached.
+ *    If a step of the session threw, the future holds that exception (on_complete gets false).
+ */
+std::future<bool> DMClient::start_session_async(bool server_initiated, std::function<void(bool)> on_complete) {
+  auto async = std::make_shared<AsyncSession>();
+  async->on_complete = on_complete;
+  std::future<bool> result = async->done.get_future();
+
+  event_loop->post([this, async, server_initiated] {
+    if(DevId.empty() || !session.begin()) {
+      LOG_ERROR("ERROR: can't start session, " << (DevId.empty() ? "no device ID set" : "another session is still running"));
+      if(async->on_complete) async->on_complete(false);
+      async->done.set_value(false);
+      return;
+    }
+    async->started = SessionMetrics::Clock::now();
+    async_send_P1(async, server_initiated);
+  });
+  return result;
+}
+
+/**
+ * @{
+ * Steps of the asynchronous session state machine. All of them run on the event loop.
+ */
+void DMClient::async_send_P1(std::shared_ptr<AsyncSession> async, bool server_initiated) {
+  prepare_P1(server_initiated);
+  // the package is built on a worker, the answer is then awaited on the loop
+  worker_pool->submit([this, async] {
+    try {
+      session.send_P1_async([this](const Transport::BodySink &sink) {
+        return write_P1(sink);
+      }, *event_loop, [this, async](bool received) {
+        async_received_P2(async, received);
+      });
+    } catch(...) {
+      async_abort(async, std::current_exception());
+    }
+  });
+}
+
+// the package exchange is over. Called on the loop thread, or on a worker if the transport can only send blocking
+void DMClient::async_received_P2(std::shared_ptr<AsyncSession> async, bool received) {
+  event_loop->post([this, async, received] {
+    settle_alerts(received);
+    async_handle_P2(async, received);
+  });
+}
+
+void DMClient::async_handle_P2(std::shared_ptr<AsyncSession> async, bool received) {
+  if(!received) { // transport failure
+    async_finish(async, false);
+    return;
+  }
+
+  session.set_state(Session::SessionState::P2);
+  if(!session.continues()) {
+    async_finish(async, true);
+    return;
+  }
+
+  // unlike the blocking session, P3 is only sent after all commands are executed. Streaming it 
+  // while commands still execute would tie up two workers per session, and with many sessions
+  // all workers could end up waiting for command executions that can't get a worker.
+  worker_pool->submit([this, async] {
+    try {
+      command_queue.do_commands();
+    } catch(...) {
+      async_abort(async, std::current_exception());
+      return;
+    }
+    event_loop->post([this, async] { async_send_P3(async); });
+  });
+}
+
+void DMClient::async_send_P3(std::shared_ptr<AsyncSession> async) {
+  session.set_state(Session::SessionState::P3cont);
+  worker_pool->submit([this, async] {
+    try {
+      session.send_P3_async([this](const Transport::BodySink &sink) {
+        return write_P3(sink);
+      }, *event_loop, [this, async](bool received) {
+        async_received_P2(async, received);
+      });
+    } catch(...) {
+      async_abort(async, std::current_exception());
+    }
+  });
+}
+
+void DMClient::async_finish(std::shared_ptr<AsyncSession> async, bool success) {
+  session.set_state(Session::SessionState::P3end);
+  acknowledge_tree();
+  metrics.record(SessionMetrics::Phase::Total, SessionMetrics::Clock::now() - async->started);
+  session.set_state(Session::SessionState::Idle);
+  // callback first, so that it has completed when the future becomes ready
+  if(async->on_complete) async->on_complete(success);
+  async->done.set_value(success);
+}
+
+/**
+ * Called from a worker when its task threw. The exception would otherwise be lost in
+ * the pool and the session would never complete, so end the session and hand the
+ * exception to the caller through the future.
+ */
+void DMClient::async_abort(std::shared_ptr<AsyncSession> async, std::exception_ptr error) {
+  event_loop->post([this, async, error] {
+    LOG_ERROR("ERROR: session aborted, a step of the asynchronous session threw an exception");
+    metrics.record(SessionMetrics::Phase::Total, SessionMetrics::Clock::now() - async->started);
+    session.set_state(Session::SessionState::Idle);
+    if(async->on_complete) async->on_complete(false);
+    async->done.set_exception(error);
+  });
+}
+/**
+ * @}
+ */
+
+Session::SessionState DMClient::session_state()
+const {
+  return session.get_state();
+}
+
+/**
+ * Drive asynchronous sessions of this client with the given event loop instead of
+ * the process wide shared one. Must not be called while a session is running.
+ */
+void DMClient::set_event_loop(std::shared_ptr<EventLoop> loop) {
+  event_loop = loop;
+}
+
+/**
+ * @brief Queue the alert that starts a new session, to be sent in P1
+ */
+void DMClient::prepare_P1(bool server_initiated) {
+  // left over if the P1 of an earlier session didn't reach the server
+  alert_queue.remove_alerts("urn:oma:at:dm:2.0:ServerInitiatedMgmt");
+  alert_queue.remove_alerts("urn:oma:at:dm:2.0:ClientInitiatedMgmt");
   if(server_initiated) {
     alert_queue.add_alert(Alert("urn:oma:at:dm:2.0:ServerInitiatedMgmt"));
   } else {
     alert_queue.add_alert(Alert("urn:oma:at:dm:2.0:ClientInitiatedMgmt"));
   }
+}
+
+/**
+ * @brief Forget the alerts sent in a package once it was delivered, keep them for the next one otherwise
+ *
+ * The package writers don't do this themselves, the transport may fail after the
+ * package was written, or write it again for a retry.
+ */
+void DMClient::settle_alerts(bool delivered) {
+  if(delivered) {
+    alert_queue.acknowledge();
+  } else {
+    alert_queue.release();
+  }
+}
 
-  nlohmann::json P1_json;
-  P1_json["MOS"] = motree.p1_MOS_json();
-  P1_json["Alert"] = alert_queue.package_alert_json();
+/**
+ * @brief Serialize package P1 into a streamed request body
+ *
+ * The MgmtTree (if enabled, see set_P1_dump_tree()) is written directly from the MO
+ * tree while it is being sent, so memory use doesn't grow with the size of the tree.
+ * Asynchronous sessions are the exception, HttpTransport::post_async() holds the whole
+ * package in memory before sending it.
+ *
+ * @param[in] sink - receives the serialized package piece by piece, in the session's package format
+ * @return false if the sink failed (the transfer was aborted)
+ */
+bool DMClient::write_P1(const Transport::BodySink &sink) {
+  PackageWriter writer(session.get_package_format(), sink);
+  writer.begin_object();
+  writer.key("MOS");
+  writer.value(motree.p1_MOS_json());
+  writer.key("Alert");
+  writer.value(alert_queue.package_alert_json());
 
-  if(P1_dump_tree) {
-    P1_json["MgmtTree"] = motree.dump_serialized_MOS();
+  if(P1_dump_tree && P1_incremental_tree) {
+    P1_tree_versions.clear();
+    writer.key("MgmtTree");
+    if(!motree.write_changed_MOS(writer, tree_sync.acknowledged_versions(tree_sync_key()), P1_tree_versions)) return false;
+  } else if(P1_dump_tree) {
+    writer.key("MgmtTree");
+    if(!motree.write_serialized_MOS(writer)) return false;
   }
 
-  std::cout << "Sending P1 to Server:" << std::endl << std::setw(2) << P1_json << std::endl;
+  writer.end_object();
+  LOG_INFO("Sending P1 to Server" << (P1_dump_tree ? " (with MgmtTree)" : ""));
+  return writer.flush();
+}
 
-  std::string P2_json = session.send_P1(P1_json.dump());
+/**
+ * @brief Serialize package P3 into a streamed request body
+ *
+ * Waits for the status of each command executed in the current round and writes it
+ * as soon as it is available. The alerts are written last, so that alerts raised
+ * while executing the commands are included.
+ *
+ * @param[in] sink - receives the serialized package piece by piece, in the session's package format
+ * @return false if the sink failed (the transfer was aborted)
+ */
+bool DMClient::write_P3(const Transport::BodySink &sink) {
+  PackageWriter writer(session.get_package_format(), sink);
+  writer.begin_object();
+  writer.key("Status");
+  writer.begin_array();
 
-  while(session.parse_P2(P2_json)) {
-    command_queue.do_commands();
-    nlohmann::json p3_json;
-    p3_json["Status"] = command_queue.p3_SC_json();
-    p3_json["Alert"] = alert_queue.package_alert_json();
-    P2_json = session.send_P3(p3_json.dump());
+  nlohmann::json status;
+  while(command_queue.next_status_json(status)) {
+    writer.value(status);
+    // every status is sent right away, the next one may take a while
+    if(!writer.flush()) {
+      // drain the remaining statuses, so they don't end up in the next round's P3
+      while(command_queue.next_status_json(status)) {}
+      return false;
+    }
   }
+
+  writer.end_array();
+  writer.key("Alert");
+  writer.value(alert_queue.package_alert_json());
+  writer.end_object();
+  return writer.flush();
 }
 
-void DMClient::set_P1_dump_tree(bool enable) {
+/**
+ * @brief Include the contents of the MO tree (MgmtTree) in package P1
+ *
+ * @param[in] enable - send the MgmtTree at all
+ * @param[in] incremental - send only the MO instances and nodes that changed since the last
+ *    session the server completed. See MOTree::write_changed_MOS() for the format, and 
+ *    MO::Interface for the change tracking MOs need to support for this. MOs without
+ *    change tracking are always sent completely.
+ */
+void DMClient::set_P1_dump_tree(bool enable, bool incremental) {
   P1_dump_tree = enable;
+  P1_incremental_tree = incremental;
+}
+
+/**
+ * Persist which MgmtTree versions each server has seen in the given directory, so that
+ * incremental MgmtTree dumps (see set_P1_dump_tree) continue after a restart of the
+ * application. See TreeSyncState
+ */
+void DMClient::set_tree_sync_dir(std::string dir) {
+  tree_sync.set_persist_dir(dir);
+}
+
+std::string DMClient::tree_sync_key()
+const {
+  return DevId + " " + session.get_server_url();
 }
 
+/**
+ * @brief Remember the MgmtTree versions sent in P1 as seen by the server
+ *
+ * Only sessions that the server ended regularly count, otherwise the server
+ * may never have processed our P1.
+ */
+void DMClient::acknowledge_tree() {
+  if(P1_dump_tree && P1_incremental_tree && session.ended_by_server()) {
+    tree_sync.acknowledge(tree_sync_key(), P1_tree_versions);
+  }
+}
+
+/**
+ * @brief Set the device ID sent to the server with every package (OMADM-DevID header)
+ *
+ * There is no default, sessions can only be started once a device ID was set.
+ */
 void DMClient::set_device_id(std::string id) {
   DevId = id;
+  session.set_device_id(id);
+}
+
+/**
+ * Pass through to Session - see there for documentation
+ */
+bool DMClient::set_server_url(std::string url) {
+  return session.set_server_url(url);
+}
+
+/**
+ * Pass through to Session - see there for documentation
+ *
+ * Use this to replace the default http(s) transport, e.g. with a LoopbackTransport
+ * for testing and benchmarking without network.
+ */
+void DMClient::set_transport(std::shared_ptr<Transport> transport) {
+  session.set_transport(transport);
+}
+
+/**
+ * Encoding of the protocol packages and of MO data requested with HGET. See
+ * Session::set_package_format() and CommandQueue::set_mo_format()
+ */
+void DMClient::set_package_format(Codec::Format format) {
+  session.set_package_format(format);
+  command_queue.set_mo_format(format);
+}
+
+/**
+ * Pass through to Session - see there for documentation
+ */
+void DMClient::set_compression(Compression::Mode mode) {
+  session.set_compression(mode);
+}
+
+/**
+ * Pass through to Session - see there for documentation
+ */
+Compression::Stats DMClient::compression_stats(bool received)
+const {
+  return session.get_compression_stats(received);
+}
+
+/**
+ * Configure the pool of persistent http(s) connections used for all packages
+ * and HGET transfers of this client.
+ *
+ * Note that the pool is usually shared with other clients, so this affects
+ * all of them.
+ *
+ * @param[in] max_per_origin - maximum number of parallel connections to the same scheme/host/port
+ * @param[in] idle_timeout_s - idle connections are closed instead of being reused after this many seconds
+ */
+void DMClient::set_connection_limits(unsigned max_per_origin, unsigned idle_timeout_s) {
+  connection_pool->set_max_per_origin(max_per_origin);
+  connection_pool->set_idle_timeout(std::chrono::seconds(idle_timeout_s));
+}
+
+/**
+ * Pass through to ConnectionPool - see there for documentation
+ */
+ConnectionPool::Stats DMClient::connection_stats()
+const {
+  return connection_pool->stats();
+}
+
+/**
+ * Pass through to CommandQueue::set_concurrency - see there for documentation
+ */
+void DMClient::set_command_concurrency(unsigned max_parallel, unsigned max_per_origin) {
+  command_queue.set_concurrency(max_parallel, max_per_origin);
+}
+
+/**
+ * Pass through to CommandQueue::set_download_sinks - see there for documentation
+ */
+void DMClient::set_download_sinks(CommandQueue::SinkFactory factory) {
+  command_queue.set_download_sinks(factory);
+}
+
+/**
+ * Pass through to CommandQueue::set_download_state_dir - see there for documentation
+ */
+void DMClient::set_download_state_dir(std::string dir) {
+  command_queue.set_download_state_dir(dir);
+}
+
+/**
+ * Pass through to CommandQueue::set_download_cache_size - see there for documentation
+ */
+void DMClient::set_download_cache_size(unsigned long long max_bytes) {
+  command_queue.set_download_cache_size(max_bytes);
+}
+
+/**
+ * Pass through to CommandQueue::download_cache_stats - see there for documentation
+ */
+DownloadCache::Stats DMClient::download_cache_stats()
+const {
+  return command_queue.download_cache_stats();
+}
+
+/**
+ * Pass through to CommandQueue::transfer_stats - see there for documentation
+ */
+std::vector<CommandQueue::TransferStats> DMClient::transfer_stats()
+const {
+  return command_queue.transfer_stats();
+}
+
+/**
+ * @brief Latency and package size distributions over all sessions of this client
+ *
+ * See SessionMetrics. The histograms can be read at any time, also while a session
+ * is running, e.g. to periodically report them from many clients to a monitoring system.
+ */
+const SessionMetrics &DMClient::session_metrics()
+const {
+  return metrics;
+}
+
+/**
+ * Start over with empty session metrics, e.g. after they were reported
+ */
+void DMClient::reset_session_metrics() {
+  metrics.reset();
+}
+
+/**
+ * Persist TLS sessions to the given directory, so that sessions to the DM server
+ * can be resumed even after the application was restarted. See TlsSessionCache
+ */
+void DMClient::set_tls_session_dir(std::string dir) {
+  connection_pool->tls_session_cache().set_persist_dir(dir);
+}
+
+/**
+ * Number of TLS handshakes and how many of them were resumed. The TLS session cache
+ * belongs to the ConnectionPool, so these are the totals of all clients sharing the pool.
+ */
+TlsSessionCache::Stats DMClient::tls_stats()
+const {
+  return connection_pool->tls_session_cache().stats();
 }
 
 } // namespace
@@ -0,0 +1,117 @@
+/**
+ * Download cache for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "DownloadCache.h"
+
+namespace Grandma {
+
+double DownloadCache::Stats::hit_ratio()
+const {
+  return lookups ? static_cast<double>(hits) / lookups : 0.0;
+}
+
+/**
+ * @param[in] max_bytes - limit for the total size of the cached data, 0 disables the cache
+ */
+DownloadCache::DownloadCache(unsigned long long max_bytes) : max_bytes(max_bytes), bytes(0), counters() {}
+
+void DownloadCache::set_max_bytes(unsigned long long max_bytes) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->max_bytes = max_bytes;
+  evict_locked();
+}
+
+/**
+ * @brief Find the cached data of an URL, to revalidate it with a conditional request
+ *
+ * Counts as a lookup for the hit ratio, whether there is an entry or not. Report the 
+ * server's "304 Not Modified" with hit().
+ *
+ * @return false if nothing is cached for the URL
+ */
+bool DownloadCache::lookup(const std::string &url, Entry &entry) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++counters.lookups;
+  auto it = slots.find(url);
+  if(it == slots.end()) return false;
+
+  entry = it->second.entry;
+  return true;
+}
+
+/**
+ * @brief Record that the cached data of an URL was still valid and has been used
+ */
+void DownloadCache::hit(const std::string &url, unsigned long long size) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++counters.hits;
+  counters.bytes_saved += size;
+
+  auto it = slots.find(url);
+  if(it != slots.end()) {
+    lru.splice(lru.begin(), lru, it->second.position);
+  }
+}
+
+/**
+ * @brief Cache the data received for an URL, replacing what was cached before
+ *
+ * Data without validator, or bigger than the whole cache, is not cached.
+ */
+void DownloadCache::store(const std::string &url, Entry entry) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = slots.find(url);
+  if(it != slots.end()) {
+    bytes -= it->second.entry.data.size();
+    lru.erase(it->second.position);
+    slots.erase(it);
+  }
+  if((entry.etag == "" && entry.last_modified == "") || entry.data.size() > max_bytes) return;
+
+  bytes += entry.data.size();
+  lru.push_front(url);
+  slots[url] = Slot{std::move(entry), lru.begin()};
+  ++counters.stores;
+  evict_locked();
+}
+
+/**
+ * @brief Forget the data of an URL
+ */
+void DownloadCache::remove(const std::string &url) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = slots.find(url);
+  if(it == slots.end()) return;
+  bytes -= it->second.entry.data.size();
+  lru.erase(it->second.position);
+  slots.erase(it);
+}
+
+void DownloadCache::evict_locked() {
+  while(bytes > max_bytes && !lru.empty()) {
+    auto it = slots.find(lru.back());
+    bytes -= it->second.entry.data.size();
+    slots.erase(it);
+    lru.pop_back();
+    ++counters.evictions;
+  }
+}
+
+/**
+ * @brief Snapshot of the cache counters
+ */
+DownloadCache::Stats DownloadCache::stats()
+const {
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats snapshot = counters;
+  snapshot.entries = slots.size();
+  snapshot.bytes = bytes;
+  return snapshot;
+}
+
+} // namespace
@@ -0,0 +1,116 @@
+/**
+ * Progress of interrupted HGET downloads for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "DownloadProgress.h"
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
+#include <nlohmann/json.hpp>
+
+#include "Log.h"
+
+namespace Grandma {
+
+using namespace nlohmann;
+
+DownloadProgress::Entry::Entry() : length(-1), offset(0) {}
+
+/**
+ * @brief The value for If-Range: the ETag if there is one, Last-Modified otherwise
+ */
+std::string DownloadProgress::Entry::validator()
+const {
+  return etag != "" ? etag : last_modified;
+}
+
+/**
+ * @brief Persist download progress in the given directory
+ *
+ * Pass an empty string to keep it in memory only (the default).
+ */
+void DownloadProgress::set_persist_dir(const std::string &dir) {
+  std::lock_guard<std::mutex> lock(mutex);
+  persist_dir = dir;
+}
+
+// keys contain URLs of any length, so the file name is a readable prefix plus a hash of the whole key
+std::string DownloadProgress::persist_filename(const std::string &key)
+const {
+  std::string name;
+  for(char c : key.substr(0, 64)) {
+    name += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  char hash[20];
+  std::snprintf(hash, sizeof(hash), "_%016zx", std::hash<std::string>()(key));
+  return persist_dir + "/" + name + hash + ".download";
+}
+
+/**
+ * @brief Look up the progress of an interrupted download
+ *
+ * @param[in] key - identifies the download, "<url> <client uri>"
+ * @return false if there is no interrupted download for this key
+ */
+bool DownloadProgress::find(const std::string &key, Entry &entry) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = entries.find(key);
+  if(it != entries.end()) {
+    entry = it->second;
+    return true;
+  }
+  if(persist_dir == "") return false;
+
+  std::ifstream file(persist_filename(key));
+  if(!file) return false;
+  json jentry = json::parse(file, nullptr, false);
+  if(!jentry.is_object() || jentry["Key"] != key || !jentry["Offset"].is_number_unsigned() || !jentry["Length"].is_number_integer()) {
+    LOG_WARNING("Warning: DownloadProgress - ignoring unreadable " << persist_filename(key));
+    return false;
+  }
+  entry.content_type = jentry["ContentType"].is_string() ? jentry["ContentType"].get<std::string>() : "";
+  entry.etag = jentry["ETag"].is_string() ? jentry["ETag"].get<std::string>() : "";
+  entry.last_modified = jentry["LastModified"].is_string() ? jentry["LastModified"].get<std::string>() : "";
+  entry.length = jentry["Length"].get<long long>();
+  entry.offset = jentry["Offset"].get<unsigned long long>();
+  entries[key] = entry;
+  return true;
+}
+
+/**
+ * @brief Record the progress of a download
+ */
+void DownloadProgress::save(const std::string &key, const Entry &entry) {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries[key] = entry;
+
+  if(persist_dir != "") {
+    json jentry = {{"Key", key}, {"ContentType", entry.content_type}, {"ETag", entry.etag}, 
+                   {"LastModified", entry.last_modified}, {"Length", entry.length}, {"Offset", entry.offset}};
+    std::ofstream file(persist_filename(key), std::ios::trunc);
+    if(!(file << jentry.dump())) {
+      LOG_WARNING("Warning: DownloadProgress - could not persist progress of " << key);
+    }
+  }
+}
+
+/**
+ * @brief Forget a download, because it completed or can't be resumed
+ */
+void DownloadProgress::forget(const std::string &key) {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.erase(key);
+  if(persist_dir != "") {
+    std::remove(persist_filename(key).c_str());
+  }
+}
+
+} // namespace
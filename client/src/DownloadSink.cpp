@@ -0,0 +1,354 @@
+/**
+ * Download sinks for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "DownloadSink.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "Log.h"
+
+namespace Grandma {
+
+namespace {
+
+  // an MmapSink without known length grows its file at least by this much at a time
+  const size_t mmap_min_growth = 1024 * 1024;
+
+  bool length_matches(long long length, unsigned long long size, const std::string &what) {
+    if(length >= 0 && static_cast<unsigned long long>(length) != size) {
+      LOG_ERROR("ERROR: " << what << " - received " << size << " bytes, expected " << length);
+      return false;
+    }
+    return true;
+  }
+
+  bool digest_matches(const std::string &expected, const unsigned char *actual, const std::string &what) {
+    if(expected.size() != 32 || std::memcmp(expected.data(), actual, 32) != 0) {
+      LOG_ERROR("ERROR: " << what << " - SHA-256 digest doesn't match");
+      return false;
+    }
+    return true;
+  }
+
+  bool sha256_matches(const std::string &expected, const char *data, size_t length, const std::string &what) {
+    unsigned char actual[EVP_MAX_MD_SIZE];
+    if(!EVP_Digest(data, length, actual, nullptr, EVP_sha256(), nullptr)) return false;
+    return digest_matches(expected, actual, what);
+  }
+
+  bool sha256_file_matches(const std::string &expected, const std::string &filename, const std::string &what) {
+    std::ifstream file(filename, std::ios::binary);
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    bool ok = file && context && EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+    char buffer[65536];
+    while(ok && file) {
+      file.read(buffer, sizeof(buffer));
+      ok = EVP_DigestUpdate(context, buffer, file.gcount());
+    }
+    unsigned char actual[EVP_MAX_MD_SIZE];
+    ok = ok && file.eof() && EVP_DigestFinal_ex(context, actual, nullptr);
+    EVP_MD_CTX_free(context);
+    if(!ok) {
+      LOG_ERROR("ERROR: " << what << " - can't read back the data for verification");
+      return false;
+    }
+    return digest_matches(expected, actual, what);
+  }
+
+  unsigned long long file_size(const std::string &filename) {
+    struct stat info;
+    return ::stat(filename.c_str(), &info) == 0 ? info.st_size : 0;
+  }
+
+}
+
+/**
+ * @{
+ * MemorySink
+ */
+MemorySink::MemorySink(std::string &buffer) : buffer(buffer) {}
+
+bool MemorySink::begin(const std::string &content_type, long long length) {
+  (void)content_type;
+  buffer.clear();
+  if(length > 0) buffer.reserve(length);
+  return true;
+}
+
+bool MemorySink::write(const char *data, size_t length) {
+  buffer.append(data, length);
+  return true;
+}
+
+bool MemorySink::finish() {
+  return true;
+}
+
+void MemorySink::abort() {
+  buffer.clear();
+}
+
+bool MemorySink::verify(long long length, const std::string &sha256) {
+  return length_matches(length, buffer.size(), "MemorySink")
+    && (sha256.empty() || sha256_matches(sha256, buffer.data(), buffer.size(), "MemorySink"));
+}
+/**
+ * @}
+ */
+
+/**
+ * @{
+ * FileSink
+ */
+FileSink::FileSink(std::string path) : path(path), size(0) {}
+
+FileSink::~FileSink() {
+  if(file.is_open()) abort();
+}
+
+bool FileSink::begin(const std::string &content_type, long long length) {
+  (void)content_type; (void)length;
+  file.open(path + ".part", std::ios::binary | std::ios::trunc);
+  size = 0;
+  if(!file) {
+    LOG_ERROR("ERROR: FileSink can't open " << path << ".part for writing");
+    return false;
+  }
+  return true;
+}
+
+bool FileSink::write(const char *data, size_t length) {
+  file.write(data, length);
+  size += length;
+  return static_cast<bool>(file);
+}
+
+bool FileSink::verify(long long length, const std::string &sha256) {
+  if(!file.flush()) return false;
+  return length_matches(length, size, path)
+    && (sha256.empty() || sha256_file_matches(sha256, path + ".part", path));
+}
+
+bool FileSink::resumable()
+const {
+  return true;
+}
+
+unsigned long long FileSink::partial_size() {
+  return file_size(path + ".part");
+}
+
+bool FileSink::resume(const std::string &content_type, long long length, unsigned long long offset) {
+  (void)content_type; (void)length;
+  // drop anything beyond offset, e.g. data written after the progress was last saved
+  if(::truncate((path + ".part").c_str(), offset) != 0) return false;
+  file.open(path + ".part", std::ios::binary | std::ios::app);
+  size = offset;
+  return static_cast<bool>(file);
+}
+
+void FileSink::suspend() {
+  if(file.is_open()) file.close();
+}
+
+bool FileSink::flush() {
+  return static_cast<bool>(file.flush());
+}
+
+bool FileSink::finish() {
+  file.close();
+  if(file.fail() || std::rename((path + ".part").c_str(), path.c_str()) != 0) {
+    LOG_ERROR("ERROR: FileSink could not complete " << path);
+    std::remove((path + ".part").c_str());
+    return false;
+  }
+  return true;
+}
+
+void FileSink::abort() {
+  file.close();
+  std::remove((path + ".part").c_str());
+}
+/**
+ * @}
+ */
+
+/**
+ * @{
+ * MmapSink
+ */
+MmapSink::MmapSink(std::string path) : path(path), fd(-1), region(nullptr), capacity(0), size(0) {}
+
+MmapSink::~MmapSink() {
+  if(fd >= 0) abort();
+}
+
+bool MmapSink::begin(const std::string &content_type, long long length) {
+  (void)content_type;
+  fd = ::open((path + ".part").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    LOG_ERROR("ERROR: MmapSink can't open " << path << ".part for writing");
+    return false;
+  }
+  size = 0;
+  return length > 0 ? resize(length) : true;
+}
+
+bool MmapSink::write(const char *data, size_t length) {
+  if(size + length > capacity && !resize(std::max(size + length, std::max(2 * capacity, mmap_min_growth)))) {
+    return false;
+  }
+  std::memcpy(region + size, data, length);
+  size += length;
+  return true;
+}
+
+bool MmapSink::verify(long long length, const std::string &sha256) {
+  return length_matches(length, size, path)
+    && (sha256.empty() || sha256_matches(sha256, region ? region : "", size, path));
+}
+
+bool MmapSink::resumable()
+const {
+  return true;
+}
+
+unsigned long long MmapSink::partial_size() {
+  return file_size(path + ".part");
+}
+
+bool MmapSink::resume(const std::string &content_type, long long length, unsigned long long offset) {
+  (void)content_type;
+  fd = ::open((path + ".part").c_str(), O_RDWR);
+  if(fd < 0) return false;
+  size = offset;
+  size_t wanted = length > 0 ? std::max<size_t>(length, offset) : offset;
+  return wanted > 0 ? resize(wanted) : true;
+}
+
+void MmapSink::suspend() {
+  if(fd < 0) return;
+  unmap();
+  // cut off the space reserved for data that didn't arrive
+  if(::ftruncate(fd, size) != 0) {
+    LOG_WARNING("Warning: MmapSink can't truncate " << path << ".part");
+  }
+  ::close(fd);
+  fd = -1;
+}
+
+// the mapping is shared with the file, what was copied into it is already in the page cache
+bool MmapSink::flush() {
+  return !region || ::msync(region, size, MS_ASYNC) == 0;
+}
+
+bool MmapSink::finish() {
+  unmap();
+  // the file may have been grown beyond the data received
+  bool ok = ::ftruncate(fd, size) == 0;
+  ok = (::close(fd) == 0) && ok;
+  fd = -1;
+  if(!ok || std::rename((path + ".part").c_str(), path.c_str()) != 0) {
+    LOG_ERROR("ERROR: MmapSink could not complete " << path);
+    std::remove((path + ".part").c_str());
+    return false;
+  }
+  return true;
+}
+
+void MmapSink::abort() {
+  unmap();
+  ::close(fd);
+  fd = -1;
+  std::remove((path + ".part").c_str());
+}
+
+bool MmapSink::resize(size_t new_capacity) {
+  unmap();
+  if(::ftruncate(fd, new_capacity) != 0) {
+    LOG_ERROR("ERROR: MmapSink can't grow " << path << ".part to " << new_capacity << " bytes");
+    return false;
+  }
+  void *mapped = ::mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(mapped == MAP_FAILED) {
+    LOG_ERROR("ERROR: MmapSink can't map " << path << ".part");
+    return false;
+  }
+  region = static_cast<char *>(mapped);
+  capacity = new_capacity;
+  return true;
+}
+
+void MmapSink::unmap() {
+  if(region) ::munmap(region, capacity);
+  region = nullptr;
+  capacity = 0;
+}
+/**
+ * @}
+ */
+
+/**
+ * @{
+ * NodeWriterSink
+ */
+NodeWriterSink::NodeWriterSink(std::unique_ptr<MO::Interface::NodeWriter> writer)
+  : writer(std::move(writer)), size(0), digest(EVP_MD_CTX_new()) {}
+
+NodeWriterSink::~NodeWriterSink() {
+  if(writer) abort();
+  EVP_MD_CTX_free(digest);
+}
+
+bool NodeWriterSink::begin(const std::string &content_type, long long length) {
+  (void)content_type; (void)length;
+  if(!digest || !EVP_DigestInit_ex(digest, EVP_sha256(), nullptr)) {
+    LOG_ERROR("ERROR: NodeWriterSink can't initialize SHA-256");
+    return false;
+  }
+  return true;
+}
+
+bool NodeWriterSink::write(const char *data, size_t length) {
+  size += length;
+  return EVP_DigestUpdate(digest, data, length) && writer->write(data, length);
+}
+
+// the data is not accessible anymore, the digest was calculated while it was written
+bool NodeWriterSink::verify(long long length, const std::string &sha256) {
+  if(!length_matches(length, size, "NodeWriterSink")) return false;
+  if(sha256.empty()) return true;
+  unsigned char actual[EVP_MAX_MD_SIZE];
+  if(!EVP_DigestFinal_ex(digest, actual, nullptr)) return false;
+  return digest_matches(sha256, actual, "NodeWriterSink");
+}
+
+bool NodeWriterSink::finish() {
+  bool ok = writer->close(true);
+  writer.reset();
+  return ok;
+}
+
+void NodeWriterSink::abort() {
+  writer->close(false);
+  writer.reset();
+}
+/**
+ * @}
+ */
+
+} // namespace
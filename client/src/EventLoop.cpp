@@ -0,0 +1,264 @@
+/**
+ * Event loop for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "EventLoop.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <climits>
+
+#include "Log.h"
+
+namespace Grandma {
+
+EventLoop::EventLoop() : stopping(false), last_id(0) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(epoll_fd < 0 || wake_fd < 0) {
+    // nothing sensible to do without exceptions. The loop will not run, post() will run handlers directly
+    LOG_ERROR("ERROR: EventLoop - could not create epoll/eventfd instance");
+    return;
+  }
+
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = 0;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+
+  thread = std::thread(&EventLoop::run, this);
+}
+
+/**
+ * Runs the handlers that are already posted, then stops the loop thread
+ */
+EventLoop::~EventLoop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake();
+  if(thread.joinable()) thread.join();
+  if(wake_fd >= 0) close(wake_fd);
+  if(epoll_fd >= 0) close(epoll_fd);
+}
+
+/**
+ * @brief Queue a handler to be run on the loop thread
+ *
+ * Can be called from any thread, including from handlers running on the loop.
+ */
+void EventLoop::post(std::function<void()> handler) {
+  if(!thread.joinable()) { // loop could not be started
+    handler();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    handlers.push_back(std::move(handler));
+  }
+  wake();
+}
+
+bool EventLoop::in_loop_thread()
+const {
+  return std::this_thread::get_id() == thread.get_id();
+}
+
+/**
+ * @brief Run a handler on the loop thread whenever a file descriptor is ready
+ *
+ * The descriptor is watched level triggered, so the handler is called again and again
+ * as long as the condition persists (e.g. unread data). Handlers must cope with spurious
+ * calls, a non-blocking read or write may still fail with EAGAIN.
+ *
+ * Can be called from any thread.
+ *
+ * @param[in] fd - file descriptor, must stay open until unwatch() was called
+ * @param[in] events - epoll events to wait for, e.g. EPOLLIN or EPOLLOUT
+ * @param[in] handler - called with the ready events
+ * @return id of the watch, for modify() and unwatch(). 0 if the descriptor could not be watched
+ */
+EventLoop::WatchId EventLoop::watch(int fd, uint32_t events, IoHandler handler) {
+  if(!thread.joinable()) return 0;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  WatchId id = ++last_id;
+  epoll_event event = {};
+  event.events = events;
+  event.data.u64 = id;
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    LOG_ERROR("ERROR: EventLoop - could not watch file descriptor " << fd << ", errno " << errno);
+    return 0;
+  }
+  watches[id] = Watch{fd, std::move(handler)};
+  return id;
+}
+
+/**
+ * @brief Change the events a watched file descriptor is waited for
+ */
+bool EventLoop::modify(WatchId id, uint32_t events) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto watch = watches.find(id);
+  if(watch == watches.end()) return false;
+  epoll_event event = {};
+  event.events = events;
+  event.data.u64 = id;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, watch->second.fd, &event) == 0;
+}
+
+/**
+ * @brief Stop watching a file descriptor
+ *
+ * Must be called before the descriptor is closed. When called on the loop thread, the
+ * handler is not called anymore afterwards. When called from another thread, a call
+ * of the handler may still be running (or about to start).
+ */
+void EventLoop::unwatch(WatchId id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto watch = watches.find(id);
+  if(watch == watches.end()) return;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch->second.fd, nullptr);
+  watches.erase(watch);
+}
+
+/**
+ * @brief Run a handler on the loop thread once the given time has passed
+ *
+ * Can be called from any thread.
+ *
+ * @return id of the timer, for cancel(). 0 if the loop is not running
+ */
+EventLoop::TimerId EventLoop::run_after(Clock::duration delay, std::function<void()> handler) {
+  if(!thread.joinable()) return 0;
+
+  TimerId id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    id = ++last_id;
+    Clock::time_point deadline = Clock::now() + delay;
+    timers[std::make_pair(deadline, id)] = std::move(handler);
+    timer_deadlines[id] = deadline;
+  }
+  // the loop thread may be waiting with a timeout for a later timer
+  if(!in_loop_thread()) wake();
+  return id;
+}
+
+/**
+ * @brief Cancel a timer that has not run yet
+ *
+ * When called on the loop thread, the timer's handler will not run anymore.
+ */
+void EventLoop::cancel(TimerId id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto deadline = timer_deadlines.find(id);
+  if(deadline == timer_deadlines.end()) return;
+  timers.erase(std::make_pair(deadline->second, id));
+  timer_deadlines.erase(deadline);
+}
+
+/**
+ * @brief The process wide default loop, shared by all DMClient instances that weren't given their own
+ */
+std::shared_ptr<EventLoop> EventLoop::shared() {
+  static std::shared_ptr<EventLoop> loop = std::make_shared<EventLoop>();
+  return loop;
+}
+
+void EventLoop::wake() {
+  uint64_t one = 1;
+  if(write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("ERROR: EventLoop - could not wake up loop thread");
+  }
+}
+
+// epoll_wait timeout until the next timer is due, in ms. Called with the mutex locked
+int EventLoop::wait_timeout() {
+  if(timers.empty()) return -1;
+  auto remaining = timers.begin()->first.first - Clock::now();
+  if(remaining <= Clock::duration::zero()) return 0;
+  // round up, or we would wake up just before the timer is due and spin
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining + std::chrono::milliseconds(1) - Clock::duration(1)).count();
+  return ms > INT_MAX ? INT_MAX : static_cast<int>(ms);
+}
+
+void EventLoop::run_timers() {
+  const Clock::time_point now = Clock::now();
+  for(;;) {
+    std::function<void()> handler;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(timers.empty() || timers.begin()->first.first > now) return;
+      handler = std::move(timers.begin()->second);
+      timer_deadlines.erase(timers.begin()->first.second);
+      timers.erase(timers.begin());
+    }
+    handler();
+  }
+}
+
+void EventLoop::run() {
+  // socket writes of handlers fail with EPIPE instead of killing the process. TLS connections
+  // can't ask for that with MSG_NOSIGNAL on every write
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+
+  epoll_event events[64];
+
+  for(;;) {
+    int timeout;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(handlers.empty() && stopping) return;
+      timeout = handlers.empty() ? wait_timeout() : 0;
+    }
+
+    // handlers and timers added after the check above also write to wake_fd, so we can't miss them
+    int n = epoll_wait(epoll_fd, events, 64, timeout);
+    if(n < 0 && errno != EINTR) {
+      LOG_ERROR("ERROR: EventLoop - epoll_wait failed, stopping loop");
+      return;
+    }
+    for(int i = 0; i < n; ++i) {
+      if(events[i].data.u64 == 0) {
+        uint64_t count;
+        while(read(wake_fd, &count, sizeof(count)) > 0) {}
+        continue;
+      }
+      // the watch may have been removed by a handler before us. Ids are never reused,
+      // so an event can't reach the handler of a newer watch on the same descriptor
+      IoHandler handler;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto watch = watches.find(events[i].data.u64);
+        if(watch != watches.end()) handler = watch->second.handler;
+      }
+      if(handler) handler(events[i].events);
+    }
+
+    run_timers();
+
+    std::deque<std::function<void()>> ready;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ready.swap(handlers);
+    }
+    for(auto &handler : ready) {
+      handler();
+    }
+  }
+}
+
+} // namespace
@@ -8,7 +8,8 @@
 #include "Helper.h"
 
 #include <sstream>
-#include <iostream>
+
+#include "Log.h"
 
 namespace Grandma {
 
@@ -33,13 +34,13 @@ std::vector<std::string> Helper::vectorize_path(const std::string path) {
 // TODO: this can hardly be called a real URL parser. It is very simplicistic and supports only a
 // small part of RFCxxxx. Also, string operations in C++ are not my forte...
 bool Helper::URL::parse_from_string(std::string s_uri) {
-  std::cout << "Parsing URI " << s_uri  << std::endl;
+  LOG_TRACE("Parsing URI " << s_uri);
 
   // parse protocol
   size_t delim = s_uri.find("://");
   if(delim == std::string::npos) return false;
   std::string proto_s = s_uri.substr(0, delim);
-  std::cout << "proto_s is " << proto_s << std::endl;
+  LOG_TRACE("proto_s is " << proto_s);
   if("http" == proto_s || "HTTP" == proto_s) {
     protocol = Protocol::HTTP;
   } else if("https" == proto_s || "HTTPS" == proto_s) {
@@ -57,7 +58,7 @@ bool Helper::URL::parse_from_string(std::string s_uri) {
     path = s_uri.substr(delim);
     s_uri = s_uri.substr(0, delim);
   }
-  std::cout << "Path is " << path << std::endl;
+  LOG_TRACE("Path is " << path);
 
   //parse port
   delim = s_uri.find(":");
@@ -67,11 +68,11 @@ bool Helper::URL::parse_from_string(std::string s_uri) {
     std::string s_port = s_uri.substr(delim+1);
     port = std::stoi(s_port); // FIXME: may throw exception
   } 
-  std::cout << "Port is " << port << std::endl;
+  LOG_TRACE("Port is " << port);
 
   // reminder is server
   server = s_uri.substr(0, delim);
-  std::cout << "server is " << server << std::endl;
+  LOG_TRACE("server is " << server);
 
   return true;
 }
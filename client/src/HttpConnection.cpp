@@ -0,0 +1,627 @@
+/**
+ * Non-blocking HTTP(S) connection for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "HttpConnection.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <exception>
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "Log.h"
+
+namespace Grandma {
+
+namespace {
+
+  const size_t max_head_size = 64 * 1024;   // status line and headers of a response
+  const size_t max_line_size = 4 * 1024;    // chunk size and trailer lines
+  const int reads_per_turn = 16;            // then the other handlers of the loop get their turn
+
+  std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+  }
+
+  std::string trim(const std::string &s) {
+    size_t first = s.find_first_not_of(" \t");
+    if(first == std::string::npos) return "";
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+  }
+
+  // the reason for the last failed TLS operation, from the OpenSSL error queue
+  std::string tls_error(SSL *ssl) {
+    long verify_result = SSL_get_verify_result(ssl);
+    if(verify_result != X509_V_OK) return X509_verify_cert_error_string(verify_result);
+    unsigned long error = ERR_get_error();
+    if(!error) return "unknown error";
+    char text[256];
+    ERR_error_string_n(error, text, sizeof(text));
+    return text;
+  }
+
+} // namespace
+
+const std::chrono::seconds HttpConnection::io_timeout(60);
+const std::chrono::seconds HttpConnection::idle_timeout(30);
+
+/**
+ * @return value of the response header with the given name (in lower case), "" if there is none
+ */
+std::string HttpConnection::Response::header(const std::string &name)
+const {
+  auto header = headers.find(name);
+  return header == headers.end() ? "" : header->second;
+}
+
+/**
+ * @param[in] loop - event loop driving the connection
+ * @param[in] url - server. Host and port are used for the Host header, TLS server name and certificate check
+ * @param[in] address - resolved address of the server
+ * @param[in] address_length - length of the address
+ * @param[in] ssl_ctx - TLS context for https, null for plain http
+ */
+HttpConnection::HttpConnection(EventLoop &loop, const Helper::URL &url, const sockaddr_storage &address, socklen_t address_length, SSL_CTX *ssl_ctx)
+  : loop(loop), url(url), address(address), address_length(address_length), ssl_ctx(ssl_ctx), state(State::Closed),
+    fd(-1), ssl(nullptr), watch_id(0), timer_id(0), sent(0), keep_alive(false), response_started(false),
+    connect_error(false), body_state(Body::Head), remaining(0) {
+  if(ssl_ctx) SSL_CTX_up_ref(ssl_ctx);
+}
+
+HttpConnection::~HttpConnection() {
+  if(timer_id) loop.cancel(timer_id);
+  close_socket();
+  if(ssl_ctx) SSL_CTX_free(ssl_ctx);
+}
+
+/**
+ * @brief Send a request and receive its response
+ *
+ * Connects first if the connection isn't idle. done is never called before send() returned.
+ *
+ * @param[in] request - request to send. The connection keeps a copy until done was called
+ * @param[in] done - called when the response is complete or the request failed
+ */
+void HttpConnection::send(const Request &request, Completion done) {
+  this->request = request;
+  this->done = std::move(done);
+
+  bool default_port = url.port == (url.protocol == Helper::URL::Protocol::HTTPS ? 443 : 80);
+  head = request.method + " " + (request.path.empty() ? "/" : request.path) + " HTTP/1.1\r\n";
+  head += "Host: " + url.server + (default_port ? "" : ":" + std::to_string(url.port)) + "\r\n";
+  for(auto &header : request.headers) {
+    head += header.first + ": " + header.second + "\r\n";
+  }
+  head += "Content-Length: " + std::to_string(request.body ? request.body->size() : 0) + "\r\n\r\n";
+  sent = 0;
+
+  keep_alive = false;
+  response_started = false;
+  connect_error = false;
+  error.clear();
+  response = Response();
+  response.status = 0;
+  body_state = Body::Head;
+  received.clear();
+  remaining = 0;
+
+  auto self = shared_from_this();
+  loop.post([self] {
+    self->arm_timer(io_timeout);
+    if(self->state == State::Idle) {
+      self->state = State::Sending;
+      self->advance();
+    } else {
+      self->connect();
+    }
+  });
+}
+
+/**
+ * @return true if the connection is open and can take the next request
+ */
+bool HttpConnection::idle()
+const {
+  return state == State::Idle;
+}
+
+/**
+ * @return true if the last request failed because the server could not be reached
+ */
+bool HttpConnection::connect_failed()
+const {
+  return connect_error;
+}
+
+/**
+ * @return true if any part of the response to the last request was received. If not,
+ *    a failed request can safely be sent again.
+ */
+bool HttpConnection::received_response()
+const {
+  return response_started;
+}
+
+/**
+ * @return why the last request failed
+ */
+const std::string &HttpConnection::last_error()
+const {
+  return error;
+}
+
+EventLoop &HttpConnection::event_loop()
+const {
+  return loop;
+}
+
+void HttpConnection::connect() {
+  close_socket();
+  state = State::Connecting;
+
+  fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0) return fail("could not create socket: " + std::string(strerror(errno)));
+  // the request head and body are written separately, don't let the body wait for the head's ACK
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if(ssl_ctx) {
+    ssl = SSL_new(ssl_ctx);
+    if(!ssl) return fail("could not create TLS connection");
+    SSL_set_fd(ssl, fd);
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    unsigned char ip[sizeof(in6_addr)];
+    if(inet_pton(AF_INET, url.server.c_str(), ip) == 1 || inet_pton(AF_INET6, url.server.c_str(), ip) == 1) {
+      X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), url.server.c_str());
+    } else {
+      SSL_set_tlsext_host_name(ssl, url.server.c_str());
+      SSL_set1_host(ssl, url.server.c_str());
+    }
+    SSL_set_connect_state(ssl);
+  }
+
+  std::weak_ptr<HttpConnection> weak = shared_from_this();
+  watch_id = loop.watch(fd, EPOLLOUT, [weak](uint32_t events) {
+    if(auto self = weak.lock()) self->on_ready(events);
+  });
+  if(!watch_id) return fail("could not register socket with the event loop");
+
+  // EINTR: the connection is still established asynchronously, like with EINPROGRESS
+  if(::connect(fd, reinterpret_cast<const sockaddr *>(&address), address_length) < 0 && errno != EINPROGRESS && errno != EINTR) {
+    return fail("could not connect: " + std::string(strerror(errno)));
+  }
+  // even if connect() succeeded at once, we wait for the socket to be writable
+}
+
+void HttpConnection::on_ready(uint32_t events) {
+  auto self = shared_from_this();   // the completion handler may drop the last other reference
+
+  switch(state) {
+    case State::Closed:
+      return;
+    case State::Idle:
+      // an idle connection only gets readable when the server closes it
+      if(timer_id) loop.cancel(timer_id);
+      timer_id = 0;
+      close_socket();
+      return;
+    case State::Connecting: {
+      int socket_error = 0;
+      socklen_t length = sizeof(socket_error);
+      if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &socket_error, &length) < 0) socket_error = errno;
+      if(socket_error) return fail("could not connect: " + std::string(strerror(socket_error)));
+      if(!(events & EPOLLOUT)) return;
+      state = ssl ? State::Handshaking : State::Sending;
+      break;
+    }
+    default:
+      break;
+  }
+
+  arm_timer(io_timeout);
+  advance();
+}
+
+// does as much of the exchange as the socket allows without blocking
+void HttpConnection::advance() {
+  for(;;) {
+    switch(state) {
+      case State::Handshaking: {
+        ERR_clear_error();
+        int ret = SSL_connect(ssl);
+        if(ret == 1) {
+          state = State::Sending;
+          break;
+        }
+        Io io = ssl_result(ret);
+        if(io == Io::WantRead) return wait_for(EPOLLIN);
+        if(io == Io::WantWrite) return wait_for(EPOLLOUT);
+        return fail("TLS handshake failed: " + tls_error(ssl));
+      }
+      case State::Sending:
+        if(!send_some()) return;
+        state = State::Receiving;
+        break;
+      case State::Receiving:
+        return receive_some();
+      default:
+        return;
+    }
+  }
+}
+
+// @return true when the whole request is sent
+bool HttpConnection::send_some() {
+  const size_t body_size = request.body ? request.body->size() : 0;
+  while(sent < head.size() + body_size) {
+    const char *data;
+    size_t length;
+    if(sent < head.size()) {
+      data = head.data() + sent;
+      length = head.size() - sent;
+    } else {
+      data = request.body->data() + (sent - head.size());
+      length = body_size - (sent - head.size());
+    }
+
+    size_t written = 0;
+    switch(write_some(data, length, written)) {
+      case Io::Done:
+        sent += written;
+        break;
+      case Io::WantRead:
+        wait_for(EPOLLIN);
+        return false;
+      case Io::WantWrite:
+        wait_for(EPOLLOUT);
+        return false;
+      default:
+        fail("sending the request failed: " + std::string(ssl ? tls_error(ssl) : strerror(errno)));
+        return false;
+    }
+  }
+  wait_for(EPOLLIN);
+  return true;
+}
+
+void HttpConnection::receive_some() {
+  char buffer[16 * 1024];
+  for(int i = 0; i < reads_per_turn; ++i) {
+    size_t length = 0;
+    switch(read_some(buffer, sizeof(buffer), length)) {
+      case Io::Done:
+        response_started = true;
+        received.append(buffer, length);
+        if(!parse()) return;
+        break;
+      case Io::WantRead:
+        return wait_for(EPOLLIN);
+      case Io::WantWrite:
+        return wait_for(EPOLLOUT);
+      case Io::Closed:
+        if(body_state == Body::UntilClose) {
+          keep_alive = false;
+          return complete();
+        }
+        return fail(response_started ? "connection closed before the response was complete" : "connection closed by server");
+      default:
+        return fail("receiving the response failed: " + std::string(ssl ? tls_error(ssl) : strerror(errno)));
+    }
+  }
+
+  // give the other handlers their turn. TLS may hold already decrypted data that epoll
+  // doesn't know about, so we can't rely on the socket getting ready again
+  std::weak_ptr<HttpConnection> weak = shared_from_this();
+  loop.post([weak] {
+    auto self = weak.lock();
+    if(self && self->state == State::Receiving) self->advance();
+  });
+}
+
+// @return false if the exchange is over (complete or failed)
+bool HttpConnection::parse() {
+  for(;;) {
+    switch(body_state) {
+      case Body::Head: {
+        size_t end = received.find("\r\n\r\n");
+        if(end == std::string::npos) {
+          if(received.size() <= max_head_size) return true;
+          fail("response header too large");
+          return false;
+        }
+        if(!parse_head(end)) return false;
+        break;
+      }
+      case Body::Length:
+      case Body::ChunkData: {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(remaining, received.size()));
+        if(length == 0) return true;
+        if(!deliver(length)) return false;
+        remaining -= length;
+        if(remaining > 0) return true;
+        if(body_state == Body::Length) {
+          complete();
+          return false;
+        }
+        body_state = Body::ChunkEnd;
+        break;
+      }
+      case Body::ChunkEnd:
+        if(received.size() < 2) return true;
+        if(received.compare(0, 2, "\r\n") != 0) {
+          fail("invalid chunked encoding");
+          return false;
+        }
+        received.erase(0, 2);
+        body_state = Body::ChunkSize;
+        break;
+      case Body::ChunkSize: {
+        size_t end = received.find("\r\n");
+        if(end == std::string::npos) {
+          if(received.size() <= max_line_size) return true;
+          fail("invalid chunked encoding");
+          return false;
+        }
+        char *stop;
+        errno = 0;
+        remaining = std::strtoull(received.c_str(), &stop, 16);
+        // anything after the size is a chunk extension, which we ignore
+        if(stop == received.c_str() || errno || (*stop != '\r' && *stop != ';' && *stop != ' ' && *stop != '\t')) {
+          fail("invalid chunked encoding");
+          return false;
+        }
+        received.erase(0, end + 2);
+        body_state = remaining ? Body::ChunkData : Body::Trailer;
+        break;
+      }
+      case Body::Trailer: {
+        size_t end = received.find("\r\n");
+        if(end == std::string::npos) {
+          if(received.size() <= max_line_size) return true;
+          fail("invalid chunked encoding");
+          return false;
+        }
+        received.erase(0, end + 2);
+        if(end == 0) {
+          complete();
+          return false;
+        }
+        break;
+      }
+      case Body::UntilClose:
+        return received.empty() || deliver(received.size());
+    }
+  }
+}
+
+// parses status line and headers, which end at the given position of the received data
+// @return false if the exchange is over (complete or failed)
+bool HttpConnection::parse_head(size_t length) {
+  std::string head_data = received.substr(0, length);
+  received.erase(0, length + 4);
+
+  size_t line_end = head_data.find("\r\n");
+  std::string status_line = head_data.substr(0, line_end);
+  size_t status_start = status_line.find(' ');
+  if(status_line.compare(0, 5, "HTTP/") != 0 || status_start == std::string::npos) {
+    fail("invalid response status line");
+    return false;
+  }
+  int status = std::atoi(status_line.c_str() + status_start + 1);
+  if(status >= 100 && status < 200) return true;  // interim response, the real one follows
+
+  response.status = status;
+  response.headers.clear();
+  while(line_end != std::string::npos) {
+    size_t line_start = line_end + 2;
+    line_end = head_data.find("\r\n", line_start);
+    std::string line = head_data.substr(line_start, line_end == std::string::npos ? std::string::npos : line_end - line_start);
+    size_t colon = line.find(':');
+    if(colon == std::string::npos) continue;
+    std::string name = lower(trim(line.substr(0, colon)));
+    std::string value = trim(line.substr(colon + 1));
+    auto header = response.headers.find(name);
+    if(header == response.headers.end()) {
+      response.headers[name] = value;
+    } else {
+      header->second += ", " + value;
+    }
+  }
+
+  std::string connection = lower(response.header("connection"));
+  if(status_line.compare(0, 8, "HTTP/1.0") == 0) {
+    keep_alive = connection.find("keep-alive") != std::string::npos;
+  } else {
+    keep_alive = connection.find("close") == std::string::npos;
+  }
+
+  bool accepted = false;
+  try {
+    accepted = !request.response_handler || request.response_handler(response);
+  } catch(const std::exception &e) {
+    fail(std::string("response handler failed: ") + e.what());
+    return false;
+  }
+  if(!accepted) {
+    fail("response rejected");
+    return false;
+  }
+
+  if(status == 204 || status == 304 || request.method == "HEAD") {
+    complete();
+    return false;
+  }
+  if(lower(response.header("transfer-encoding")).find("chunked") != std::string::npos) {
+    body_state = Body::ChunkSize;
+  } else if(response.headers.count("content-length")) {
+    remaining = std::strtoull(response.header("content-length").c_str(), nullptr, 10);
+    body_state = Body::Length;
+    if(remaining == 0) {
+      complete();
+      return false;
+    }
+  } else {
+    body_state = Body::UntilClose;
+    keep_alive = false;
+  }
+  return true;
+}
+
+// passes the given number of received bytes on as response body
+// @return false if the exchange failed
+bool HttpConnection::deliver(size_t length) {
+  bool accepted = false;
+  try {
+    accepted = !request.content_receiver || request.content_receiver(received.data(), length);
+  } catch(const std::exception &e) {
+    fail(std::string("response receiver failed: ") + e.what());
+    return false;
+  }
+  received.erase(0, length);
+  if(!accepted) {
+    fail("response rejected");
+    return false;
+  }
+  return true;
+}
+
+void HttpConnection::complete() {
+  // anything received after the response would have to be the answer to a request we didn't send
+  if(keep_alive && received.empty()) {
+    state = State::Idle;
+    wait_for(EPOLLIN);
+    arm_timer(idle_timeout);
+  } else {
+    if(timer_id) loop.cancel(timer_id);
+    timer_id = 0;
+    close_socket();
+  }
+  finish(true);
+}
+
+void HttpConnection::fail(const std::string &reason) {
+  connect_error = state == State::Connecting;
+  error = reason;
+  LOG_DEBUG("HttpConnection to " << url.server << ": " << reason);
+  if(timer_id) loop.cancel(timer_id);
+  timer_id = 0;
+  close_socket();
+  finish(false);
+}
+
+void HttpConnection::finish(bool ok) {
+  Completion completion;
+  completion.swap(done);
+  request = Request();  // drops the body and the callbacks, which may hold on to their owner
+  head.clear();
+  if(completion) completion(ok);
+}
+
+void HttpConnection::close_socket() {
+  if(watch_id) loop.unwatch(watch_id);
+  watch_id = 0;
+  if(ssl) {
+    // close_notify is a courtesy, and only sent from the loop thread, which ignores SIGPIPE
+    if(state == State::Idle && loop.in_loop_thread()) SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ssl = nullptr;
+  }
+  if(fd >= 0) close(fd);
+  fd = -1;
+  state = State::Closed;
+}
+
+void HttpConnection::wait_for(uint32_t events) {
+  loop.modify(watch_id, events);
+}
+
+// (re)starts the timer that closes or fails the connection when nothing happens for too long
+void HttpConnection::arm_timer(std::chrono::seconds timeout) {
+  if(timer_id) loop.cancel(timer_id);
+  std::weak_ptr<HttpConnection> weak = shared_from_this();
+  timer_id = loop.run_after(timeout, [weak] {
+    auto self = weak.lock();
+    if(!self) return;
+    self->timer_id = 0;
+    if(self->state == State::Idle) {
+      self->close_socket();
+    } else if(self->state != State::Closed) {
+      self->fail("timed out");
+    }
+  });
+}
+
+HttpConnection::Io HttpConnection::write_some(const char *data, size_t length, size_t &written) {
+  if(ssl) {
+    ERR_clear_error();
+    int ret = SSL_write(ssl, data, static_cast<int>(std::min<size_t>(length, INT_MAX)));
+    if(ret <= 0) return ssl_result(ret);
+    written = ret;
+    return Io::Done;
+  }
+  for(;;) {
+    ssize_t ret = ::send(fd, data, length, MSG_NOSIGNAL);
+    if(ret >= 0) {
+      written = ret;
+      return Io::Done;
+    }
+    if(errno == EAGAIN || errno == EWOULDBLOCK) return Io::WantWrite;
+    if(errno != EINTR) return Io::Failed;
+  }
+}
+
+HttpConnection::Io HttpConnection::read_some(char *data, size_t length, size_t &read) {
+  if(ssl) {
+    ERR_clear_error();
+    int ret = SSL_read(ssl, data, static_cast<int>(std::min<size_t>(length, INT_MAX)));
+    if(ret <= 0) return ssl_result(ret);
+    read = ret;
+    return Io::Done;
+  }
+  for(;;) {
+    ssize_t ret = ::recv(fd, data, length, 0);
+    if(ret > 0) {
+      read = ret;
+      return Io::Done;
+    }
+    if(ret == 0) return Io::Closed;
+    if(errno == EAGAIN || errno == EWOULDBLOCK) return Io::WantRead;
+    if(errno != EINTR) return Io::Failed;
+  }
+}
+
+HttpConnection::Io HttpConnection::ssl_result(int ret) {
+  switch(SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+      return Io::WantRead;
+    case SSL_ERROR_WANT_WRITE:
+      return Io::WantWrite;
+    case SSL_ERROR_ZERO_RETURN:
+      return Io::Closed;
+    case SSL_ERROR_SYSCALL:
+      // many servers close the connection without close_notify
+      if(ERR_peek_error() == 0 && (ret == 0 || errno == 0)) return Io::Closed;
+      return Io::Failed;
+    default:
+      return Io::Failed;
+  }
+}
+
+} // namespace
@@ -0,0 +1,351 @@
+/**
+ * HTTP(S) transport for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "HttpTransport.h"
+
+#include <netdb.h>
+#include <string.h>
+
+#include <utility>
+#include <vector>
+
+#define CPPHTTPLIB_OPENSSL_SUPPORT
+#include <httplib.h>
+// httplib includes some arpa stuff, which defines DELETE as a macro, but we use it as a enum value for OMADM commands
+#undef DELETE
+
+#include "EventLoop.h"
+#include "HttpConnection.h"
+#include "Log.h"
+
+namespace Grandma {
+
+namespace {
+
+  // headers of a package request, except for the ones about the length of the body
+  std::vector<std::pair<std::string, std::string>> headers_of(const Transport::Request &request, bool compress) {
+    std::vector<std::pair<std::string, std::string>> headers(request.headers.begin(), request.headers.end());
+    if(request.accept != "") {
+      headers.emplace_back("Accept", request.accept);
+    }
+    headers.emplace_back("Accept-Encoding", "gzip, deflate");
+    headers.emplace_back("Content-Type", request.content_type);
+    if(compress) {
+      headers.emplace_back("Content-Encoding", Compression::encoding_name(Compression::Encoding::Gzip));
+    }
+    return headers;
+  }
+
+  // produces the request body into wire, compressing it on the way if asked to
+  bool write_body(const Transport::Request &request, std::unique_ptr<Compression::Deflater> &deflater, bool compress, const Compression::Sink &wire) {
+    Compression::Sink body = wire;
+    if(compress) {
+      // a new deflater each time, the body is written again if it has to be sent on a new connection
+      deflater.reset(new Compression::Deflater(Compression::Encoding::Gzip));
+      body = [&deflater, &wire](const char *data, size_t length) {
+        return deflater->write(data, length, wire);
+      };
+    }
+    bool ok = request.body_writer ? request.body_writer(body) : body(request.body.data(), request.body.size());
+    return ok && (!compress || deflater->finish(wire));
+  }
+
+  // decompresses the response body piece by piece while it is received, and passes it on
+  // to the request's response sink (or collects it in Response::body)
+  class ResponseReader {
+    const Transport::Request &request;
+    Transport::Response &response;
+    std::unique_ptr<Compression::Inflater> inflater;
+    bool wanted;  // the sink may refuse the rest of the body, that's not an error of ours
+
+  public:
+    ResponseReader(const Transport::Request &request, Transport::Response &response)
+      : request(request), response(response), wanted(true) {}
+
+    void begin(int status, const std::string &content_type, Compression::Encoding encoding) {
+      response.status = status;
+      response.content_type = content_type;
+      inflater.reset(encoding != Compression::Encoding::Identity ? new Compression::Inflater() : nullptr);
+      wanted = true;
+    }
+
+    bool read(const char *data, size_t length) {
+      if(!wanted) return true;  // discard the rest, but keep the connection usable
+      if(inflater) {
+        return inflater->write(data, length, [this](const char *inflated, size_t inflated_length) {
+          return deliver(inflated, inflated_length);
+        }) || !wanted;
+      }
+      deliver(data, length);
+      return true;
+    }
+
+    bool finish(const std::string &server) {
+      if(!inflater) return true;
+      if(wanted && !inflater->finish()) {
+        LOG_ERROR("ERROR: could not decompress response from server " << server);
+        return false;
+      }
+      response.response_compression = inflater->stats();
+      return true;
+    }
+
+  private:
+    bool deliver(const char *data, size_t length) {
+      if(request.response_sink) return wanted = request.response_sink(response, data, length);
+      response.body.append(data, length);
+      return true;
+    }
+  };
+
+} // namespace
+
+// state of one package sent with post_async()
+struct HttpTransport::AsyncPost {
+  const Request &request;
+  Response &response;
+  EventLoop &loop;
+  std::function<void(bool)> done;
+
+  ResponseReader reader;
+  HttpConnection::Request http_request;
+  sockaddr_storage address;
+  socklen_t address_length;
+  SSL_CTX *ssl_ctx;
+  std::shared_ptr<HttpConnection> connection;
+  bool reused;  // connection was kept open from an earlier package
+
+  AsyncPost(const Request &request, Response &response, EventLoop &loop, std::function<void(bool)> done)
+    : request(request), response(response), loop(loop), done(std::move(done)), reader(request, response),
+      address(), address_length(0), ssl_ctx(nullptr), reused(false) {}
+};
+
+HttpTransport::HttpTransport(ConnectionPool &connection_pool, const Helper::URL &server_url)
+  : connection_pool(connection_pool), server_url(server_url), server_accepts_gzip(false), address_resolved(false),
+    server_address(), server_address_length(0), ssl_ctx(nullptr) {}
+
+HttpTransport::~HttpTransport() {
+  idle_connection.reset();
+  if(ssl_ctx) SSL_CTX_free(ssl_ctx);
+}
+
+bool HttpTransport::post(const Request &request, Response &response) {
+  bool compress = request.compression == Compression::Mode::Always
+    || (request.compression == Compression::Mode::Auto && server_accepts_gzip);
+
+  httplib::Request req;
+  req.method = "POST";
+  req.path = server_url.path;
+  for(auto &header : headers_of(request, compress)) {
+    req.headers.emplace(header.first, header.second);
+  }
+
+  std::unique_ptr<Compression::Deflater> deflater;
+  if(compress || request.body_writer) {
+    // streamed body, sent with chunked transfer encoding while the writer is still producing
+    // it. Compressed bodies are always streamed, they are compressed piece by piece while sending
+    req.headers.emplace("Transfer-Encoding", "chunked");
+    req.is_chunked_content_provider_ = true;
+    req.content_provider_ = [&request, &deflater, compress](size_t, size_t, httplib::DataSink &sink) {
+      bool ok = write_body(request, deflater, compress, [&sink](const char *data, size_t length) {
+        return sink.write(data, length);
+      });
+      if(ok) sink.done();
+      return ok;
+    };
+  } else {
+    req.body = request.body;
+  }
+
+  ResponseReader reader(request, response);
+  req.response_handler = [this, &reader](const httplib::Response &res) {
+    std::string content_encoding = res.get_header_value("Content-Encoding");
+    learn_encodings(content_encoding, res.get_header_value("Accept-Encoding"));
+    reader.begin(res.status, res.get_header_value("Content-Type"), Compression::parse_encoding(content_encoding));
+    return true;
+  };
+  req.content_receiver = [&reader](const char *data, size_t length, uint64_t, uint64_t) {
+    return reader.read(data, length);
+  };
+
+  auto connection = connection_pool.acquire(server_url, ConnectionPool::Lane::Session);
+  auto res = connection->send(req);
+  if(deflater) response.request_compression = deflater->stats();
+
+  if(!res) {
+    LOG_ERROR("ERROR: connection to server " << server_url.server << " failed");
+    connection.discard();
+    return false;
+  }
+  LOG_DEBUG("http result is: " << res->status);
+
+  return reader.finish(server_url.server);
+}
+
+/**
+ * The body is produced (and compressed) on the calling thread, before anything is sent.
+ * Unlike with post(), it is therefore held in memory as a whole, and sent with a
+ * Content-Length. Everything else, from connecting to receiving the response, happens
+ * on the loop. If the kept-alive connection of the previous package turns out to be
+ * closed by the server before any response was received, the package is sent once more
+ * on a new connection.
+ */
+bool HttpTransport::post_async(const Request &request, Response &response, EventLoop &loop, std::function<void(bool delivered)> done) {
+  bool compress = request.compression == Compression::Mode::Always
+    || (request.compression == Compression::Mode::Auto && server_accepts_gzip);
+
+  auto post = std::make_shared<AsyncPost>(request, response, loop, std::move(done));
+  auto fail = [&loop, post] {
+    loop.post([post] { post->done(false); });
+    return true;
+  };
+
+  std::unique_ptr<Compression::Deflater> deflater;
+  auto body = std::make_shared<std::string>();
+  if(!write_body(request, deflater, compress, [&body](const char *data, size_t length) {
+        body->append(data, length);
+        return true;
+      })) {
+    return fail();
+  }
+  if(deflater) response.request_compression = deflater->stats();
+
+  if(!resolve(post->address, post->address_length)) return fail();
+  if(server_url.protocol == Helper::URL::Protocol::HTTPS) {
+    post->ssl_ctx = tls_context();
+    if(!post->ssl_ctx) {
+      LOG_ERROR("ERROR: could not create TLS context for server " << server_url.server);
+      return fail();
+    }
+  }
+
+  // the callbacks are owned by post, so they must not own it in turn
+  AsyncPost *state = post.get();
+  post->http_request.method = "POST";
+  post->http_request.path = server_url.path;
+  post->http_request.headers = headers_of(request, compress);
+  post->http_request.body = body;
+  post->http_request.response_handler = [this, state](const HttpConnection::Response &res) {
+    std::string content_encoding = res.header("content-encoding");
+    learn_encodings(content_encoding, res.header("accept-encoding"));
+    state->reader.begin(res.status, res.header("content-type"), Compression::parse_encoding(content_encoding));
+    return true;
+  };
+  post->http_request.content_receiver = [state](const char *data, size_t length) {
+    return state->reader.read(data, length);
+  };
+
+  loop.post([this, post] { start_async(post, false); });
+  return true;
+}
+
+// the server (or the responses it sends) can take gzip encoded bodies
+void HttpTransport::learn_encodings(const std::string &content_encoding, const std::string &accept_encoding) {
+  if(Compression::parse_encoding(content_encoding) == Compression::Encoding::Gzip
+      || Compression::accepts(accept_encoding, Compression::Encoding::Gzip)) {
+    server_accepts_gzip = true;
+  }
+}
+
+// resolves the server's address, or gets it from the last time
+bool HttpTransport::resolve(sockaddr_storage &address, socklen_t &length) {
+  {
+    std::lock_guard<std::mutex> lock(async_mutex);
+    if(address_resolved) {
+      address = server_address;
+      length = server_address_length;
+      return true;
+    }
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *result = nullptr;
+  int error = getaddrinfo(server_url.server.c_str(), std::to_string(server_url.port).c_str(), &hints, &result);
+  if(error || !result) {
+    LOG_ERROR("ERROR: could not resolve server " << server_url.server << ": " << gai_strerror(error));
+    return false;
+  }
+  memcpy(&address, result->ai_addr, result->ai_addrlen);
+  length = result->ai_addrlen;
+  freeaddrinfo(result);
+
+  std::lock_guard<std::mutex> lock(async_mutex);
+  server_address = address;
+  server_address_length = length;
+  address_resolved = true;
+  return true;
+}
+
+// TLS context for all connections of post_async(), created on first use
+SSL_CTX *HttpTransport::tls_context() {
+  std::lock_guard<std::mutex> lock(async_mutex);
+  if(ssl_ctx) return ssl_ctx;
+
+  ssl_ctx = SSL_CTX_new(TLS_client_method());
+  if(!ssl_ctx) return nullptr;
+  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, nullptr);
+  SSL_CTX_set_default_verify_paths(ssl_ctx);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // responses delimited by the end of the connection often end without close_notify
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  connection_pool.attach_tls_sessions(ssl_ctx, ConnectionPool::origin_of(server_url));
+  return ssl_ctx;
+}
+
+// runs on the loop thread. fresh: don't use the kept-alive connection
+void HttpTransport::start_async(std::shared_ptr<AsyncPost> post, bool fresh) {
+  std::shared_ptr<HttpConnection> connection;
+  if(!fresh) {
+    std::lock_guard<std::mutex> lock(async_mutex);
+    connection.swap(idle_connection);
+  }
+  // a connection belongs to the loop it was made on
+  if(connection && (&connection->event_loop() != &post->loop || !connection->idle())) connection.reset();
+
+  post->reused = bool(connection);
+  if(!connection) {
+    connection = std::make_shared<HttpConnection>(post->loop, server_url, post->address, post->address_length, post->ssl_ctx);
+  }
+  post->connection = connection;
+  connection->send(post->http_request, [this, post](bool ok) {
+    finish_async(post, ok);
+  });
+}
+
+// runs on the loop thread, when the connection is done with the package
+void HttpTransport::finish_async(std::shared_ptr<AsyncPost> post, bool ok) {
+  std::shared_ptr<HttpConnection> connection = std::move(post->connection);
+
+  if(!ok && post->reused && !connection->received_response()) {
+    LOG_DEBUG("Kept-alive connection to " << server_url.server << " failed (" << connection->last_error() << "), retrying on a new one");
+    return start_async(post, true);
+  }
+
+  if(ok) {
+    LOG_DEBUG("http result is: " << post->response.status);
+    if(connection->idle()) {
+      std::lock_guard<std::mutex> lock(async_mutex);
+      idle_connection = connection;
+    }
+  } else {
+    LOG_ERROR("ERROR: connection to server " << server_url.server << " failed: " << connection->last_error());
+    if(connection->connect_failed()) {
+      // the server may have moved
+      std::lock_guard<std::mutex> lock(async_mutex);
+      address_resolved = false;
+    }
+  }
+
+  ok = ok && post->reader.finish(server_url.server);
+  post->done(ok);
+}
+
+} // namespace
@@ -0,0 +1,212 @@
+/**
+ * Logging for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See description in header file
+ *
+ */
+#include "Log.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace Grandma {
+
+namespace Log {
+
+std::atomic<int> threshold(static_cast<int>(Level::Info));
+
+namespace {
+
+  const size_t ring_size = 4096;    // must be a power of two
+  const std::chrono::milliseconds idle_wait(10);
+
+  void console_sink(Level level, const std::string &message) {
+    (level >= Level::Warning ? std::cerr : std::cout) << message << '\n';
+  }
+
+  /**
+   * Bounded multi producer / single consumer ring of messages. Each slot's sequence tells
+   * whose turn it is: position when it is free for the producer of that position,
+   * position + 1 when it holds that position's message for the consumer.
+   */
+  class Logger {
+    struct Slot {
+      std::atomic<size_t> sequence;
+      Level level;
+      std::string message;
+    };
+
+    std::unique_ptr<Slot[]> ring;
+    std::atomic<size_t> head;     // next position to write to
+    size_t tail;                  // next position to read from, only used by the writer thread
+    std::atomic<size_t> written;  // messages passed to the sink
+    std::atomic<unsigned long long> dropped;
+    std::atomic<bool> idle;       // the writer thread is waiting for messages
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    Sink sink;
+    std::thread::id writer_id;
+
+  public:
+    Logger() : ring(new Slot[ring_size]), head(0), tail(0), written(0), dropped(0), idle(false), sink(console_sink) {
+      for(size_t i = 0; i < ring_size; ++i) ring[i].sequence.store(i, std::memory_order_relaxed);
+      // never joined, the thread lives as long as the process. Whatever is still queued
+      // at exit is written by flush()
+      std::thread writer([this]{ run(); });
+      writer_id = writer.get_id();
+      writer.detach();
+      std::atexit([]{ Log::flush(); });
+    }
+
+    /**
+     * @return false if the ring is full
+     */
+    bool push(Level level, std::string &message) {
+      size_t position = head.load(std::memory_order_relaxed);
+      Slot *slot;
+      for(;;) {
+        slot = &ring[position & (ring_size - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        if(sequence == position) {
+          if(head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+        } else if(sequence < position) {
+          return false;
+        } else {
+          position = head.load(std::memory_order_relaxed);
+        }
+      }
+      slot->level = level;
+      slot->message = std::move(message);
+      slot->sequence.store(position + 1, std::memory_order_release);
+      if(idle.load(std::memory_order_relaxed)) wake.notify_one();
+      return true;
+    }
+
+    void drop() {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // wait until everything queued so far was passed to the sink
+    void flush() {
+      if(std::this_thread::get_id() == writer_id) return;
+      size_t target = head.load(std::memory_order_acquire);
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.notify_one();
+      drained.wait(lock, [this, target]{ return written.load() >= target; });
+    }
+
+    void set_sink(Sink new_sink) {
+      std::lock_guard<std::mutex> lock(mutex);
+      sink = new_sink ? new_sink : console_sink;
+    }
+
+  private:
+    bool pop(Level &level, std::string &message) {
+      Slot &slot = ring[tail & (ring_size - 1)];
+      if(slot.sequence.load(std::memory_order_acquire) != tail + 1) return false;
+      level = slot.level;
+      message = std::move(slot.message);
+      slot.message.clear();
+      slot.sequence.store(tail + ring_size, std::memory_order_release);
+      ++tail;
+      return true;
+    }
+
+    void run() {
+      Level level;
+      std::string message;
+      for(;;) {
+        Sink current;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          current = sink;
+        }
+
+        bool any = false;
+        while(pop(level, message)) {
+          current(level, message);
+          any = true;
+        }
+        unsigned long long lost = dropped.exchange(0);
+        if(lost) {
+          current(Level::Warning, "Warning: Log - " + std::to_string(lost) + " messages dropped, the log ring buffer was full");
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if(any || lost) {
+          std::cout.flush();
+          written.store(tail);
+          drained.notify_all();
+          continue;
+        }
+        // a producer may miss that we are going idle, so don't wait for it too long
+        idle.store(true);
+        wake.wait_for(lock, idle_wait);
+        idle.store(false);
+      }
+    }
+  };
+
+  Logger &logger() {
+    // never destroyed, messages may still be logged while other static objects are destroyed
+    static Logger *instance = new Logger();
+    return *instance;
+  }
+
+}
+
+/**
+ * @brief Set the lowest level that is logged, Off disables logging
+ *
+ * Levels below GRANDMA_LOG_LEVEL are never logged, no matter what is set here.
+ */
+void set_level(Level level) {
+  threshold.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+Level get_level() {
+  return static_cast<Level>(threshold.load(std::memory_order_relaxed));
+}
+
+/**
+ * @brief Send log messages to the given function instead of the console
+ *
+ * The sink is called from the log's background thread, one message at a time. It must
+ * not log itself. nullptr restores the console.
+ */
+void set_sink(Sink sink) {
+  logger().set_sink(sink);
+}
+
+/**
+ * @brief Wait until all messages logged so far were passed to the sink
+ */
+void flush() {
+  logger().flush();
+}
+
+/**
+ * @brief Queue a formatted message for writing, use the LOG_... macros instead
+ */
+void write(Level level, std::string message) {
+  Logger &log = logger();
+  if(level < Level::Warning) {
+    if(!log.push(level, message)) log.drop();
+    return;
+  }
+  while(!log.push(level, message)) std::this_thread::yield();
+  if(level >= Level::Error) log.flush();
+}
+
+} // namespace Log
+
+} // namespace
@@ -0,0 +1,41 @@
+/**
+ * In-process loopback transport for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "LoopbackTransport.h"
+
+namespace Grandma {
+
+LoopbackTransport::LoopbackTransport(Handler handler) : handler(handler) {}
+
+bool LoopbackTransport::post(const Request &request, Response &response) {
+  if(!handler) return false;
+  response = Response();
+
+  bool ok;
+  if(request.body_writer) {
+    // the server callback always gets the complete body
+    Request collected = request;
+    collected.body_writer = nullptr;
+    ok = request.body_writer([&collected](const char *data, size_t length) {
+      collected.body.append(data, length);
+      return true;
+    });
+    ok = ok && handler(collected, response);
+  } else {
+    ok = handler(request, response);
+  }
+
+  if(ok && request.response_sink) {
+    std::string body = std::move(response.body);
+    response.body.clear();
+    request.response_sink(response, body.data(), body.size());
+  }
+  return ok;
+}
+
+} // namespace
@@ -1,7 +1,10 @@
 #include "MOHandler.h"
-#include "Helper.h"
 
-#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include "Helper.h"
+#include "Log.h"
 
 namespace Grandma {
 
@@ -18,48 +21,246 @@ MOHandler::MOHandler(std::string urn, std::string url) : urn(urn), ddf_url(url),
  
 }
 
-// TODO: Not yet doing anything, just an empty method shell to make the linker happy
-// and allow building
-bool MOHandler::node_set(const std::string uri, const json modata) {
-    std::cout << "MOHandler::node_set, uri = " << uri << ", modata:" << std::endl;
-    std::cout << modata.dump(2) << std::endl;
-    auto delim = uri.find("/");
-    std::string miid = uri.substr(0, delim);
-  
-    auto mi = instance.find(miid);
-    if(mi == instance.end()) {
-      std::cout << "Warning: MOHandler::node_set() - MMO Type " << urn << " has no miid " << miid << std::endl;
+/**
+ * @brief Resolve the MO instance and DDF node addressed by a URI
+ *
+ * Works on the URI in place, looking up the miid and the path segments without
+ * copying them (see find_node()).
+ *
+ * @param[in] uri - "...<miid>/<path>"
+ * @param[in] start - position of the miid in uri
+ * @param[out] target - the MO instance and node. The node is nullptr if the DDF has no 
+ *    node at the path, which is not an error here as not all commands need it.
+ * @return false if this MO type has no instance with the miid
+ */
+bool MOHandler::resolve(const std::string &uri, size_t start, Target &target)
+const {
+  size_t delim = uri.find('/', start);
+  if(delim == std::string::npos) delim = uri.size();
+  auto mi = instance.find(Substring{uri.data() + start, delim - start});
+  if(mi == instance.end()) return false;
+  target.mo = mi->second;
+  target.node = find_node(uri, delim);
+  target.path = delim;
+  return true;
+}
+
+/**
+ * @brief Set a node, or all leaves of a subtree, in an MO instance
+ *
+ * modata is either the value of a leaf node, or MO data as write_node() writes it (an
+ * object with the node's name as only key), or the object of an interior node: its keys
+ * are the names of the node's children, with their values or objects. Keys that are not
+ * children of the node in the DDF are ignored. All leaves are set with one call of 
+ * MO::Interface::set_vals().
+ *
+ * @param[in] target - the node, as resolved from uri
+ * @param[in] uri - the node's URI, as passed to resolve()
+ * @param[in] modata - the value(s) to set
+ * @return false if modata doesn't fit the node, or the MO instance couldn't set all leaves
+ */
+bool MOHandler::node_set(const Target &target, const std::string &uri, const json modata) {
+  LOG_DEBUG("MOHandler::node_set, uri = " << uri << ", modata:");
+  LOG_TRACE(modata.dump(2));
+
+  // TODO - check type, access right, etc...
+
+  const json *data = &modata;
+  if(modata.is_object() && modata.size() == 1 && modata.begin().key() == target.node->uri) {
+    data = &modata.begin().value();
+  }
+
+  std::string path = uri.substr(target.path);
+  while(!path.empty() && path.back() == '/') path.pop_back();
+  std::vector<std::string> paths;
+  std::vector<std::string> values;
+  if(!collect_values(*target.node, *data, path, paths, values)) return false;
+  return target.mo->set_vals(paths, values);
+}
+
+/**
+ * @brief Recursively collect the leaves to set for node_set()
+ *
+ * @param[in] node - DDF node the data is for
+ * @param[in] data - value of a leaf node, or object of an interior node
+ * @param[in,out] path - full path of node, used as buffer like in walk()
+ * @param[out] paths, values - receive the path and value of each leaf
+ * @return false if data doesn't fit the node
+ */
+bool MOHandler::collect_values(const Node &node, const json &data, std::string &path, std::vector<std::string> &paths, std::vector<std::string> &values)
+const {
+  if(node.is_leaf) {
+    if(data.is_structured()) {
+      LOG_WARNING("Warning: MOHandler::node_set() - can't set leaf node " << path << " in MO type " << urn << " from an object or array");
       return false;
     }
+    paths.push_back(path);
+    values.push_back(data.is_string() ? data.get<std::string>() : data.is_null() ? "" : data.dump());
+    return true;
+  }
 
-    Node *node = find_node(Helper::vectorize_path(uri.substr(delim)));
-    if(!node) {
-      std::cout << "Warning: MOHandler::node_set - Node " << uri.substr(delim) << " does not exist in MO type " << urn << std::endl;
+  if(!data.is_object()) {
+    LOG_WARNING("Warning: MOHandler::node_set() - interior node " << path << " in MO type " << urn << " can only be set from an object");
+    return false;
+  }
+  const size_t length = path.size();
+  for(auto &item : data.items()) {
+    const Node *child = find_child(node, item.key().data(), item.key().size());
+    if(!child) {
+      LOG_WARNING("Warning: MOHandler::node_set() - node " << path << " in MO type " << urn << " has no child " << item.key() << ", ignored");
+      continue;
     }
+    path += "/";
+    path += item.key();
+    bool ok = collect_values(*child, item.value(), path, paths, values);
+    path.resize(length);
+    if(!ok) return false;
+  }
+  return true;
+}
 
-    // TODO - check type, access right, etc...
-    
-    (void)modata;
-    
-      
+/**
+ * @brief Ask the MO instance for a writer to stream a node value into
+ *
+ * @param[in] target - the node, as resolved from uri
+ * @param[in] uri - the node's URI, as passed to resolve()
+ * @param[in] content_type - content type of the data that will be written
+ * @return writer provided by the MO instance, nullptr if there is none (see MO::Interface::open_node_writer())
+ */
+std::unique_ptr<MO::Interface::NodeWriter> MOHandler::node_writer(const Target &target, const std::string &uri, const std::string content_type) {
+  return target.mo->open_node_writer(uri.substr(target.path), content_type);
+}
+
+/**
+ * @param[in] uri - "<miid>/<path>"
+ * @return true if the MO instance exists and its type has a node at path
+ */
+bool MOHandler::node_exists(const std::string uri) {
+  Target target;
+  return resolve(uri, 0, target) && target.node;
+}
+
+/**
+ * Write a node and its subtree as MO data object
+ *
+ * The object has the node's name as only key, like the MOData of the serialization
+ * objects in P1 has the root node's name. The value is the node's value for leaf nodes, 
+ * or an object (see write_children()) for interior nodes. Used for HPUT and HPOST.
+ *
+ * @param[in] target - the node, as resolved from uri
+ * @param[in] uri - the node's URI, as passed to resolve()
+ * @return false if the node doesn't exist or writing failed (the transfer was aborted)
+ */
+bool MOHandler::write_node(PackageWriter &writer, const Target &target, const std::string &uri) {
+  const Node *node = target.node;
+  if(!node) return false;
+  std::string path = uri.substr(target.path);
+  while(!path.empty() && path.back() == '/') path.pop_back();
+
+  writer.begin_object();
+  writer.key(node->uri);
+  if(node->is_leaf) {
+    bool exists = true; bool valid = true;
+    std::string value = target.mo->get_val(path, exists, valid);
+    if(!exists || !valid) {
+      writer.value(nullptr);
+    } else if(!writer.string_value(value)) {
+      return false;
+    }
+  } else if(!write_children(writer, *target.mo, *node, path)) {
     return false;
-    
+  }
+  return writer.end_object();
 }
 
-MOHandler::Node *MOHandler::find_node(std::vector<std::string> path, Node *node) {
-  if(!node) node = &root;
-  for(auto segment : path) {
-    auto it = find_if(node->children.begin(), node->children.end(),
-          [&segment](const Node &child){return child.uri == segment;});
-    if(it == node->children.end()) {
-      std::cout << "Warning: MOHandler_find_node - node " << node->uri << " has no child " << segment << std::endl;
+/**
+ * @brief Find the node at a path in the DDF derived node tree
+ *
+ * Each segment of the path is looked up once in the sorted names of all nodes to get
+ * its id, then by that id in the child index of the node on that level. This neither
+ * allocates nor scans the children, see index_tree().
+ *
+ * @param[in] path - for example "/Foo/Bar". A leading and a trailing '/' are ignored.
+ * @param[in] start - position in path where the path to look up begins
+ * @return the node, nullptr if there is none at this path
+ */
+const MOHandler::Node *MOHandler::find_node(const std::string &path, size_t start)
+const {
+  const Node *node = &root;
+  if(start < path.size() && path[start] == '/') ++start;
+  while(start < path.size()) {
+    size_t end = path.find('/', start);
+    if(end == std::string::npos) end = path.size();
+    const Node *child = find_child(*node, path.data() + start, end - start);
+    if(!child) {
+      LOG_WARNING("Warning: MOHandler_find_node - node " << node->uri << " has no child " << path.substr(start, end - start));
       return nullptr;
     }
-    node = &*it;
+    node = child;
+    start = end + 1;
   }
   return node;
 }
 
+/**
+ * @param[in] name, length - name of the child, not necessarily null terminated
+ * @return the child of node with that name, nullptr if there is none
+ */
+const MOHandler::Node *MOHandler::find_child(const Node &node, const char *name, size_t length)
+const {
+  unsigned id = 0;
+  if(!segment_id(name, length, id)) return nullptr;
+  auto entry = std::lower_bound(node.child_index.begin(), node.child_index.end(), std::make_pair(id, 0u));
+  if(entry == node.child_index.end() || entry->first != id) return nullptr;
+  return &node.children[entry->second];
+}
+
+/**
+ * @brief Look up the id of a node name
+ *
+ * @param[in] segment, length - the name, not necessarily null terminated
+ * @param[out] id - position of the name in segments
+ * @return false if no node in the tree has this name
+ */
+bool MOHandler::segment_id(const char *segment, size_t length, unsigned &id)
+const {
+  auto it = std::lower_bound(segments.begin(), segments.end(), segment,
+        [length](const std::string &name, const char *s){ return name.compare(0, std::string::npos, s, length) < 0; });
+  if(it == segments.end() || it->compare(0, std::string::npos, segment, length) != 0) return false;
+  id = it - segments.begin();
+  return true;
+}
+
+/**
+ * @brief Build the index find_node() uses to look up nodes
+ *
+ * Interns the names of all nodes (their id is the position of the name in the sorted 
+ * segments), and gives each interior node a table of its children sorted by id. Children
+ * with the same name are found in DDF order. Must be called whenever the node tree changed.
+ */
+void MOHandler::index_tree() {
+  std::vector<Node *> nodes{&root};
+  for(size_t i = 0; i < nodes.size(); ++i) {
+    for(Node &child : nodes[i]->children) nodes.push_back(&child);
+  }
+
+  segments.clear();
+  for(Node *node : nodes) segments.push_back(node->uri);
+  std::sort(segments.begin(), segments.end());
+  segments.erase(std::unique(segments.begin(), segments.end()), segments.end());
+
+  for(Node *node : nodes) {
+    node->id = std::lower_bound(segments.begin(), segments.end(), node->uri) - segments.begin();
+  }
+  for(Node *node : nodes) {
+    node->child_index.clear();
+    for(unsigned i = 0; i < node->children.size(); ++i) {
+      node->child_index.emplace_back(node->children[i].id, i);
+    }
+    std::sort(node->child_index.begin(), node->child_index.end());
+  }
+}
+
 /**
  * Provide MOS json object for for package P1 (structure)
  *
@@ -93,7 +294,7 @@ const {
   for(auto mi : instance) {
     json mo; json modata;
     
-    modata[root.uri] = serialize_children(mi.second, root.children, "");
+    modata[root.uri] = serialize_children(*mi.second, root);
     mo["MOData"] = modata;
     mos.push_back(mo);
   }
@@ -101,33 +302,338 @@ const {
 }
 
 /**
- * Provide (recursively) serialization of an MO node (and its child nodes)
+ * Write the serialization of MO instances in this MO type into a package
  *
- * @param[in] mo - MO::interface object representing an actual instance of an MO implemented by the local application
- * @param[in] children
- * @param[in] uri-prefix - used to carry the full path to the current node through the recursion
+ * Streaming variant of serialize_MIs(): writes one serialization object per MO instance
+ * as elements of the array the writer is currently in, walking the node tree without 
+ * building it as json first. Unlike serialize_MIs(), interior nodes without readable
+ * leaves are written as empty objects instead of being left out, as this is only known
+ * after they have been written.
  *
- * FIXME: clean up, decide const-ness of parameters, complete documentation
+ * @return false if writing failed (the transfer was aborted)
  */
-json MOHandler::serialize_children(std::shared_ptr<MO::Interface> mo, std::vector<Node> children, std::string uri_prefix)
+bool MOHandler::write_MIs(PackageWriter &writer)
 const {
-  json json_object;
+  std::string uri_prefix;
+  for(auto &mi : instance) {
+    writer.begin_object();
+    writer.key("MOData");
+    writer.begin_object();
+    writer.key(root.uri);
+    if(!write_children(writer, *mi.second, root, uri_prefix)) return false;
+    writer.end_object();
+    if(!writer.end_object()) return false;
+  }
+  return true;
+}
 
-  for(Node &child : children) {
-    if(child.is_leaf) {
-      bool exists = true; bool valid = true;
-      std::string value = mo->get_val(uri_prefix + "/" + child.uri, exists, valid);
-      if(exists && valid) {
-	json_object[child.uri] = value;
+/**
+ * Write the changes of MO instances in this MO type since the server last saw them
+ *
+ * Like write_MIs(), but each serialization object also has "MOID" and "MIID" members 
+ * to identify the MO instance, and instances that did not change since the acknowledged
+ * version are left out. Instances with changes that can be tracked (see MO::Interface change 
+ * tracking) only carry the changed leaf nodes in their "MOData", and the paths of removed 
+ * nodes in "Deleted". These are marked with "Delta": true. All other instances are serialized
+ * completely, e.g. if they don't support change tracking, were added after the acknowledged 
+ * version or lost their change history (different epoch).
+ *
+ * @param[in] writer - the serialization objects are written as elements of the array the writer is in
+ * @param[in] acknowledged - versions of MO instances the server has seen, see TreeSyncState
+ * @param[out] current - receives the versions of the MO instances as serialized now
+ * @return false if writing failed (the transfer was aborted)
+ */
+bool MOHandler::write_MI_changes(PackageWriter &writer, const TreeSyncState::Versions &acknowledged, TreeSyncState::Versions &current)
+const {
+  std::string uri_prefix;
+  for(auto &mi : instance) {
+    const std::string key = urn + "/" + mi.first;
+
+    // read the version first: changes made while we serialize will be sent again next time
+    TreeSyncState::Version version{mi.second->change_epoch(), mi.second->change_version()};
+    auto seen = acknowledged.find(key);
+    bool tracked = version.epoch != "";
+    if(tracked) current[key] = version;
+
+    if(tracked && seen != acknowledged.end() && seen->second.epoch == version.epoch) {
+      if(seen->second.version == version.version) continue;  // unchanged
+      json mo;
+      mo["MOID"] = urn;
+      mo["MIID"] = mi.first;
+      // changes are usually few, so they are collected as json first
+      if(seen->second.version < version.version && serialize_changes(mi.second, seen->second.version, mo)) {
+        if(!writer.value(mo)) return false;
+        continue;
       }
+    }
+
+    writer.begin_object();
+    writer.key("MOID");
+    writer.string_value(urn);
+    writer.key("MIID");
+    writer.string_value(mi.first);
+    writer.key("MOData");
+    writer.begin_object();
+    writer.key(root.uri);
+    if(!write_children(writer, *mi.second, root, uri_prefix)) return false;
+    writer.end_object();
+    if(!writer.end_object()) return false;
+  }
+  return true;
+}
+
+/**
+ * Serialize only the nodes of an MO instance changed after the given version
+ *
+ * @param[in] mo - MO instance, must support change tracking
+ * @param[in] since - the version the server has seen
+ * @param[in,out] mo_json - serialization object to add "MOData", "Deleted" and "Delta" to
+ * @return false if the MO instance can't tell its changes. It must be serialized completely then.
+ */
+bool MOHandler::serialize_changes(std::shared_ptr<MO::Interface> mo, unsigned long since, json &mo_json)
+const {
+  std::vector<std::string> changed;
+  std::vector<std::string> removed;
+  if(!mo->changed_nodes(since, changed, removed)) return false;
+
+  json modata = json::object();
+  json deleted = json::array();
+  for(auto &path : removed) {
+    deleted.push_back(path);
+  }
+  std::vector<MO::Interface::Value> values;
+  mo->get_vals(changed, values);
+  for(size_t i = 0; i < changed.size(); ++i) {
+    const std::string &path = changed[i];
+    if(i >= values.size() || !values[i].node_exists) {
+      deleted.push_back(path);
+    } else if(values[i].valid_data) {
+      json *node = &modata;
+      for(auto &segment : Helper::vectorize_path(path)) {
+        node = &(*node)[segment];
+      }
+      *node = values[i].data;
+    }
+  }
+
+  mo_json["Delta"] = true;
+  mo_json["MOData"][root.uri] = modata;
+  mo_json["Deleted"] = deleted;
+  return true;
+}
+
+/**
+ * @brief Walk the subtree below a node, see TreeVisitor
+ *
+ * @param[in] node - the node whose children (and their children...) are visited
+ * @param[in,out] path - full path of node. Used as buffer for the paths of the
+ *    visited nodes, so it is unchanged when this returns.
+ * @return false if the visitor stopped the walk
+ */
+bool MOHandler::walk(const Node &node, std::string &path, TreeVisitor &visitor)
+const {
+  const size_t length = path.size();
+  for(const Node &child : node.children) {
+    path += "/";
+    path += child.uri;
+    bool ok;
+    if(child.is_leaf) {
+      ok = visitor.leaf(path, child.uri, nullptr);
     } else {
-      json node = serialize_children(mo, child.children, uri_prefix + "/" + child.uri);
+      ok = visitor.enter(path, child.uri) && walk(child, path, visitor) && visitor.leave(path, child.uri);
+    }
+    path.resize(length);
+    if(!ok) return false;
+  }
+  return true;
+}
+
+namespace {
+
+  const size_t value_batch_size = 256;  // leaves read at once while streaming, see LeafValues
+
+  // appends the paths of up to count (0 = all) further leaves to paths, returns how many it appended
+  using LeafPaths = std::function<size_t(size_t count, std::vector<std::string> &paths)>;
+
+  /**
+   * Values of leaves, read from an MO instance with get_vals() in batches of batch_size
+   * leaves (0 = all at once), and handed out one by one in walk order. The paths of a
+   * batch are only collected when the batch is read.
+   */
+  class LeafValues {
+    MO::Interface &mo;
+    LeafPaths leaf_paths;
+    size_t batch_size;
+    std::vector<std::string> batch_paths;
+    std::vector<MO::Interface::Value> batch;
+    size_t next_value;  // position of the next value in batch
+
+  public:
+    LeafValues(MO::Interface &mo, LeafPaths leaf_paths, size_t batch_size) 
+      : mo(mo), leaf_paths(std::move(leaf_paths)), batch_size(batch_size), next_value(0) {}
+
+    const MO::Interface::Value &next() {
+      if(next_value == batch.size()) {
+        batch_paths.clear();
+        size_t count = leaf_paths(batch_size, batch_paths);
+
+        batch.clear();
+        mo.get_vals(batch_paths, batch);
+        MO::Interface::Value missing;
+        missing.node_exists = false;
+        batch.resize(count, missing);
+        next_value = 0;
+      }
+      return batch[next_value++];
+    }
+  };
+
+  // builds the serialization object of an MO instance, see serialize_children()
+  class JsonSerializer : public TreeVisitor {
+    LeafValues &values;
+    std::vector<json> objects;  // objects of the interior nodes entered, the node walked from first
+
+  public:
+    JsonSerializer(LeafValues &values) : values(values), objects(1) {}
+
+    json &result() { return objects.front(); }
+
+    bool enter(const std::string &, const std::string &) {
+      objects.emplace_back();
+      return true;
+    }
+
+    bool leave(const std::string &, const std::string &name) {
+      json node = std::move(objects.back());
+      objects.pop_back();
       if(node != nullptr) {
-	json_object[child.uri] = node;
+        objects.back()[name] = std::move(node);
+      }
+      return true;
+    }
+
+    bool leaf(const std::string &, const std::string &name, const std::string *) {
+      const MO::Interface::Value &value = values.next();
+      if(value.node_exists && value.valid_data) {
+        objects.back()[name] = value.data;
       }
+      return true;
+    }
+  };
+
+  // writes the serialization object of an MO instance into a package, see write_children()
+  class PackageSerializer : public TreeVisitor {
+    PackageWriter &writer;
+    LeafValues &values;
+
+  public:
+    PackageSerializer(PackageWriter &writer, LeafValues &values) : writer(writer), values(values) {}
+
+    bool enter(const std::string &, const std::string &name) {
+      writer.key(name);
+      return writer.begin_object();
+    }
+
+    bool leave(const std::string &, const std::string &) {
+      return writer.end_object();
+    }
+
+    bool leaf(const std::string &, const std::string &name, const std::string *) {
+      const MO::Interface::Value &value = values.next();
+      if(!value.node_exists || !value.valid_data) return true;
+      writer.key(name);
+      return writer.string_value(value.data);
+    }
+  };
+
+}
+
+MOHandler::LeafCursor::LeafCursor(const Node &node, const std::string &path) : path(path) {
+  stack.push_back(Level{&node, 0, path.size()});
+}
+
+/**
+ * @brief Paths of the next leaves below a node, in walk order
+ *
+ * Continues where the previous call for the cursor stopped, so the leaves of a large
+ * subtree can be collected a few at a time.
+ *
+ * @param[in,out] cursor - position in the subtree
+ * @param[in] count - leaves to collect at most, 0 for all that are left
+ * @param[out] paths - the full paths of the leaves are appended here
+ * @return number of paths appended, 0 if all leaves were collected
+ */
+size_t MOHandler::next_leaf_paths(LeafCursor &cursor, size_t count, std::vector<std::string> &paths)
+const {
+  size_t found = 0;
+  while(!cursor.stack.empty() && (!count || found < count)) {
+    LeafCursor::Level &level = cursor.stack.back();
+    if(level.next == level.node->children.size()) {
+      cursor.path.resize(level.length);
+      cursor.stack.pop_back();
+      continue;
+    }
+    const Node &child = level.node->children[level.next++];
+    const size_t length = cursor.path.size();
+    cursor.path += "/";
+    cursor.path += child.uri;
+    if(child.is_leaf) {
+      paths.push_back(cursor.path);
+      cursor.path.resize(length);
+      ++found;
+    } else {
+      cursor.stack.push_back(LeafCursor::Level{&child, 0, length});
     }
   }
-  return json_object;
+  return found;
+}
+
+/**
+ * Provide serialization of the subtree below an MO node
+ *
+ * Leaves that don't exist or have no valid data in the MO instance, and interior nodes
+ * without any readable leaves, are left out. All leaves are read with one call of 
+ * MO::Interface::get_vals().
+ *
+ * @param[in] mo - MO::interface object representing an actual instance of an MO implemented by the local application
+ * @param[in] node - node whose children are serialized, usually the root
+ * @return object with the children of node as keys, null if there are none
+ */
+json MOHandler::serialize_children(MO::Interface &mo, const Node &node)
+const {
+  std::string path;
+  LeafCursor cursor(node, path);
+  LeafValues values(mo, [this, &cursor](size_t count, std::vector<std::string> &paths) {
+    return next_leaf_paths(cursor, count, paths);
+  }, 0);
+  JsonSerializer serializer(values);
+  walk(node, path, serializer);
+  return std::move(serializer.result());
+}
+
+/**
+ * Write the subtree below an MO node as object
+ *
+ * Streaming variant of serialize_children(). The leaves are read with MO::Interface::get_vals()
+ * in batches, their paths are collected batch by batch as well (see next_leaf_paths()), so
+ * neither all values nor all paths are in memory at once.
+ *
+ * @param[in] writer - the object is written at the writer's current position
+ * @param[in] mo - MO::interface object representing an actual instance of an MO implemented by the local application
+ * @param[in] node - node whose children are written
+ * @param[in,out] path - full path to node. Used as buffer for the paths of the 
+ *    children, so it is unchanged when this returns.
+ * @return false if writing failed (the transfer was aborted)
+ */
+bool MOHandler::write_children(PackageWriter &writer, MO::Interface &mo, const Node &node, std::string &path)
+const {
+  if(!writer.begin_object()) return false;
+  LeafCursor cursor(node, path);
+  LeafValues values(mo, [this, &cursor](size_t count, std::vector<std::string> &paths) {
+    return next_leaf_paths(cursor, count, paths);
+  }, value_batch_size);
+  PackageSerializer serializer(writer, values);
+  return walk(node, path, serializer) && writer.end_object();
 }
 
 /** 
@@ -145,7 +651,7 @@ bool MOHandler::add_instance(std::shared_ptr<MO::Interface> mo, std::string miid
     instance[miid] = mo;
     return true;
   } else {
-    std::cout << "ERROR: MO object declares not compatible with urn " << urn << std::endl;
+    LOG_ERROR("ERROR: MO object declares not compatible with urn " << urn);
     return false;
   }
 }
@@ -156,7 +662,7 @@ bool MOHandler::add_instance(std::shared_ptr<MO::Interface> mo, std::string miid
  * This method will try to parse the given ddf file and will generate a structure
  * of Nodes starting at this class' root attribute. 
  * Most of the actual works is done in the recursive generate_node_from_ddf function
- * which is called from here.
+ * which is called from here. Afterwards the tree is indexed for lookups, see index_tree().
  *
  * If the file can't be opened or can't be parsed (because of wrong content), it will
  * print a log message and exit without side effects.
@@ -167,14 +673,14 @@ bool MOHandler::generate_tree_from_ddf(const std::string filename) {
   XMLDocument ddf_file;
 
   if(ddf_file.LoadFile(filename.c_str()) != XML_SUCCESS) {
-    std::cout << "ERROR: BaseCached: Failed opening ddf file." << std::endl;
+    LOG_ERROR("ERROR: BaseCached: Failed opening ddf file.");
     return false;
   }
 
   const XMLElement * xmlnode = ddf_file.FirstChildElement("MgmtTree");
   const std::string segment = xml_descend_safely(xmlnode, {"Node"});
   if(!xmlnode) {
-    std::cout << "ERROR: BaseCached: Error parsing ddf file <MgmtTree><Node>..." << std::endl;
+    LOG_ERROR("ERROR: BaseCached: Error parsing ddf file <MgmtTree><Node>...");
     return false;
   }
 
@@ -195,6 +701,7 @@ bool MOHandler::generate_tree_from_ddf(const std::string filename) {
     root.is_leaf = false;
     root.children.push_back(generate_node_from_ddf(child));
   }
+  index_tree();
   return true;
 }
 
@@ -7,9 +7,10 @@
  *
  */
 #include "MOTree.h"
-#include <iostream>
 #include <utility>
 
+#include "Log.h"
+
 namespace Grandma {
 
 using namespace nlohmann;
@@ -17,9 +18,9 @@ using namespace nlohmann;
   /**
    * Set a node in a MO instance
    *
-   * The actual work is done in the MOHandler, this will just select the correct
-   * handler instance for the given urn (see uri parameter) and pass on miid/path
-   * to the node_set method of the MOHandler
+   * The actual work is done in the MOHandler, this will just resolve the uri to the
+   * handler of the MO type, the MO instance and the node (see resolve()) and pass them
+   * on to the node_set method of the MOHandler
    *
    * @param[in] uri - "<urn>/<miid>/<path>"
    * @param[in] modata - json object with mo data serialization according to protocol standard
@@ -30,16 +31,90 @@ using namespace nlohmann;
    * codes for different error cases
    **/
   bool MOTree::node_set(const std::string uri, const json modata) {
-    auto delim = uri.find("/");
-    std::string urn = uri.substr(0, delim);
-    std::string path = uri.substr(delim+1);
+    Route route;
+    if(!resolve(uri, route)) {
+      LOG_WARNING("Warning: MOTree::node_set() - no MO instance for " << uri);
+      return false;
+    }
+    if(!route.target.node) {
+      LOG_WARNING("Warning: MOTree::node_set() - Node " << uri << " does not exist in its MO type");
+      return false;
+    }
+    return route.handler->node_set(route.target, uri, modata);
+  }
+
+  /**
+   * Get a writer to stream the value of a node into, if the MO instance provides one.
+   * See MO::Interface::open_node_writer()
+   *
+   * @param[in] uri - "<urn>/<miid>/<path>"
+   * @param[in] content_type - content type of the data that will be written
+   * @return writer or nullptr
+   */
+  std::unique_ptr<MO::Interface::NodeWriter> MOTree::node_writer(const std::string uri, const std::string content_type) {
+    Route route;
+    if(!resolve(uri, route)) {
+      return nullptr;
+    }
+    return route.handler->node_writer(route.target, uri, content_type);
+  }
 
-    auto mo = MOs.find(urn);
-    if(mo == MOs.end()) {
-      std::cout << "Warning: MOTree::node_set() - MO Type " << urn << " not registered" << std::endl;
+  /**
+   * @param[in] uri - "<urn>/<miid>/<path>"
+   * @return true if the node exists in the tree
+   */
+  bool MOTree::node_exists(const std::string uri) {
+    Route route;
+    return resolve(uri, route) && route.target.node;
+  }
+
+  /**
+   * Write a node and its subtree as MO data object, see MOHandler::write_node()
+   *
+   * @param[in] uri - "<urn>/<miid>/<path>"
+   * @return false if the node doesn't exist or writing failed (the transfer was aborted)
+   */
+  bool MOTree::write_node(PackageWriter &writer, const std::string uri) {
+    Route route;
+    if(!resolve(uri, route)) {
+      LOG_WARNING("Warning: MOTree::write_node() - no MO instance for " << uri);
       return false;
     }
-    return mo->second.node_set(path, modata);
+    return route.handler->write_node(writer, route.target, uri);
+  }
+
+  /**
+   * Resolve the MO type, MO instance and DDF node addressed by a URI
+   *
+   * The urn, miid and path segments are looked up in place, without copying them. URIs
+   * resolved once are cached, as servers tend to address the same nodes over and over,
+   * so resolving them again is a single hash lookup. MO types and instances are only
+   * ever added, which doesn't change the result for URIs that could be resolved before,
+   * so the cache never needs to be invalidated. If it is full it is simply emptied.
+   *
+   * Like all other methods this must not be called concurrently, callers serialize
+   * access to the tree.
+   *
+   * @param[in] uri - "<urn>/<miid>/<path>"
+   * @param[out] route - the resolved node, see MOHandler::resolve()
+   * @return false if the MO type or instance doesn't exist
+   */
+  bool MOTree::resolve(const std::string &uri, Route &route) {
+    auto cached = routes.find(uri);
+    if(cached != routes.end()) {
+      route = cached->second;
+      return true;
+    }
+
+    auto delim = uri.find('/');
+    if(delim == std::string::npos) return false;
+    auto mo = MOs.find(Substring{uri.data(), delim});
+    if(mo == MOs.end() || !mo->second.resolve(uri, delim + 1, route.target)) return false;
+    route.handler = &mo->second;
+
+    if(routes.size() >= route_cache_size) routes.clear();
+    routes.emplace(uri, route);
+    return true;
   }
 
   /**
@@ -61,14 +136,14 @@ using namespace nlohmann;
   bool MOTree::register_DDF(const std::string urn, const std::string filename, const std::string ddf_url) 
   {
     if(MOs.find(urn) == MOs.end()) {
-      std::cout << "Registering DDF File " << filename << " for " << urn << std::endl;
+      LOG_INFO("Registering DDF File " << filename << " for " << urn);
 
       // TODO reconsider/discuss use of exceptions and proper RAII...
       MOHandler handler(urn, ddf_url);
       if(handler.generate_tree_from_ddf(filename)) {
 	      MOs.insert(std::make_pair(urn, handler));
       } else {
-      	std::cout << "ERROR: DDF file couldn't be parsed - not registering " << urn << std::endl;
+      	LOG_ERROR("ERROR: DDF file couldn't be parsed - not registering " << urn);
 	      return false;
       }
     } 
@@ -93,7 +168,7 @@ using namespace nlohmann;
   {
     auto handler = MOs.find(urn);
     if(handler == MOs.end()) {
-      std::cout << "Error: No DDF registered for " << urn << std::endl;
+      LOG_ERROR("Error: No DDF registered for " << urn);
       return false;
     } else {
       return handler->second.add_instance(mo, miid);
@@ -136,4 +211,41 @@ using namespace nlohmann;
     return mos;
   }
 
+  /**
+   * Write full serialization of MO tree (contents) into a package
+   *
+   * Streaming variant of dump_serialized_MOS(), writes the array at the writer's current 
+   * position without building the serialization in memory first. See MOHandler::write_MIs()
+   *
+   * @return false if writing failed (the transfer was aborted)
+   */
+  bool MOTree::write_serialized_MOS(PackageWriter &writer)
+  const {
+    writer.begin_array();
+    for(auto &MO : MOs) {
+      if(!MO.second.write_MIs(writer)) return false;
+    }
+    return writer.end_array();
+  }
+
+  /**
+   * Write serialization of the changes in the MO tree since the server last saw it
+   *
+   * Like write_serialized_MOS(), but leaves out unchanged MO instances and only serializes
+   * the changed nodes of MO instances that support change tracking. See MOHandler::write_MI_changes()
+   * for the format.
+   *
+   * @param[in] acknowledged - versions of MO instances the server has seen, see TreeSyncState
+   * @param[out] current - receives the versions of all MO instances as serialized now
+   * @return false if writing failed (the transfer was aborted)
+   */
+  bool MOTree::write_changed_MOS(PackageWriter &writer, const TreeSyncState::Versions &acknowledged, TreeSyncState::Versions &current)
+  const {
+    writer.begin_array();
+    for(auto &MO : MOs) {
+      if(!MO.second.write_MI_changes(writer, acknowledged, current)) return false;
+    }
+    return writer.end_array();
+  }
+
 } // namespace
@@ -0,0 +1,498 @@
+/**
+ * Incremental package P2 parser for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "P2Parser.h"
+
+#include <unordered_map>
+
+#include <nlohmann/json.hpp>
+
+#include "Log.h"
+
+namespace Grandma {
+
+using namespace nlohmann;
+
+namespace {
+
+  // nesting limit for skipped CBOR values, so malformed packages can't exhaust the stack
+  const int cbor_max_depth = 64;
+
+  const char *json_skip_whitespace(const char *p, const char *end) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+    return p;
+  }
+
+  // position after the closing quote of the JSON string starting at p, nullptr if not complete yet
+  const char *json_string_end(const char *p, const char *end) {
+    for(++p; p < end; ++p) {
+      if(*p == '\\') {
+        ++p;
+      } else if(*p == '"') {
+        return p + 1;
+      }
+    }
+    return nullptr;
+  }
+
+  bool json_is_delimiter(char c) {
+    return c == ',' || c == ']' || c == '}' || c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  /**
+   * Length of the JSON value starting at p, 0 if it is not complete yet
+   *
+   * This only finds the end of the value, it doesn't check if the value is valid.
+   */
+  size_t json_value_length(const char *p, const char *end) {
+    const char *q = p;
+    if(q >= end) return 0;
+
+    if(*q == '"') {
+      q = json_string_end(q, end);
+      return q ? q - p : 0;
+    }
+    if(*q == '{' || *q == '[') {
+      int depth = 0;
+      while(q < end) {
+        if(*q == '"') {
+          q = json_string_end(q, end);
+          if(!q) return 0;
+          continue;
+        }
+        if(*q == '{' || *q == '[') {
+          ++depth;
+        } else if(*q == '}' || *q == ']') {
+          if(--depth == 0) return q + 1 - p;
+        }
+        ++q;
+      }
+      return 0;
+    }
+    // number or literal, ends at the next delimiter (which can't be missing inside the package object)
+    while(q < end && !json_is_delimiter(*q)) ++q;
+    return q < end ? q - p : 0;
+  }
+
+  /**
+   * Decode the initial byte(s) of the CBOR item at p
+   *
+   * @param[out] major - major type
+   * @param[out] arg - argument (value, length or number of items)
+   * @param[out] indefinite - true for indefinite length items (and the break code)
+   * @param[out] length - length of the header, 0 if not complete yet
+   * @return false if malformed
+   */
+  bool cbor_header(const uint8_t *p, size_t avail, unsigned &major, uint64_t &arg, bool &indefinite, size_t &length) {
+    length = 0;
+    if(avail < 1) return true;
+
+    major = p[0] >> 5;
+    unsigned info = p[0] & 0x1f;
+    indefinite = false;
+    arg = 0;
+    if(info < 24) {
+      arg = info;
+      length = 1;
+      return true;
+    }
+    if(info >= 28 && info <= 30) return false;
+    if(info == 31) {
+      if(major == 0 || major == 1 || major == 6) return false;
+      indefinite = true;
+      length = 1;
+      return true;
+    }
+    size_t n = size_t(1) << (info - 24);  // 1, 2, 4 or 8 bytes
+    if(avail < 1 + n) return true;
+    for(size_t i = 1; i <= n; ++i) {
+      arg = (arg << 8) | p[i];
+    }
+    length = 1 + n;
+    return true;
+  }
+
+  /**
+   * Length of the complete CBOR item at p
+   *
+   * @param[out] length - 0 if the item is not complete yet
+   * @return false if malformed
+   */
+  bool cbor_item_length(const uint8_t *p, size_t avail, size_t &length, int depth = 0) {
+    length = 0;
+    if(depth > cbor_max_depth) return false;
+
+    unsigned major; uint64_t arg; bool indefinite; size_t total;
+    if(!cbor_header(p, avail, major, arg, indefinite, total)) return false;
+    if(!total) return true;
+    if(major == 7 && indefinite) return false;  // break code outside of an indefinite length item
+
+    if((major == 2 || major == 3) && !indefinite) {
+      if(arg > avail - total) return true;
+      total += arg;
+    } else if(major >= 2 && major <= 6) {
+      // containers, tags and indefinite length strings (which consist of definite length chunks)
+      uint64_t items = (major == 5) ? 2 * arg : (major == 6) ? 1 : arg;
+      for(;;) {
+        if(indefinite) {
+          if(total >= avail) return true;
+          if(p[total] == 0xff) {
+            ++total;
+            break;
+          }
+        } else {
+          if(items == 0) break;
+          --items;
+        }
+        size_t item;
+        if(!cbor_item_length(p + total, avail - total, item, depth + 1)) return false;
+        if(!item) return true;
+        total += item;
+      }
+    }
+    length = total;
+    return true;
+  }
+
+  /**
+   * SAX handler building a CommandQueue::Command from one ["<name>", "<parameter>", ...] array
+   *
+   * Parameters that are not strings are kept in their JSON text form. Nested parameters
+   * are not valid in any command, they make the whole command invalid.
+   */
+  class CommandBuilder : public json_sax<json> {
+    int depth;
+
+  public:
+    bool valid;
+    bool named;
+    std::string name;
+    CommandQueue::Command command;
+
+    CommandBuilder() : depth(0), valid(true), named(false) {}
+
+    bool null() override { return scalar("null"); }
+    bool boolean(bool val) override { return scalar(val ? "true" : "false"); }
+    bool number_integer(number_integer_t val) override { return scalar(std::to_string(val)); }
+    bool number_unsigned(number_unsigned_t val) override { return scalar(std::to_string(val)); }
+    bool number_float(number_float_t val, const string_t &s) override {
+      return scalar(s != "" ? s : json(val).dump());
+    }
+    bool binary(binary_t &val) override { (void)val; valid = false; return true; }
+
+    bool string(string_t &val) override {
+      if(depth != 1) return true;
+      if(!named) {
+        name = std::move(val);
+        named = true;
+      } else {
+        command.parameter.push_back(std::move(val));
+      }
+      return true;
+    }
+
+    bool start_object(std::size_t elements) override { (void)elements; valid = false; ++depth; return true; }
+    bool key(string_t &val) override { (void)val; return true; }
+    bool end_object() override { --depth; return true; }
+
+    bool start_array(std::size_t elements) override {
+      (void)elements;
+      if(depth != 0) valid = false;
+      ++depth;
+      return true;
+    }
+    bool end_array() override { --depth; return true; }
+
+    bool parse_error(std::size_t position, const std::string &last_token, const detail::exception &ex) override {
+      (void)position; (void)last_token; (void)ex;
+      return false;
+    }
+
+  private:
+    bool scalar(std::string text) {
+      if(depth != 1) return true;
+      if(!named) {
+        valid = false;  // command name must be a string
+      } else {
+        command.parameter.push_back(std::move(text));
+      }
+      return true;
+    }
+  };
+
+} // namespace
+
+/**
+ * @param[in] format - encoding of the package, see Codec::format_of()
+ * @param[in] on_command - called for each command (including CONT and END) as soon as it is complete
+ */
+P2Parser::P2Parser(Codec::Format format, CommandHandler on_command)
+  : format(format), on_command(on_command), pos(0), state(State::Start),
+    first_in_container(true), remaining_members(0), remaining_commands(0) {}
+
+/**
+ * @brief Find the command type for a command name
+ *
+ * @return false if the command is not known
+ */
+bool P2Parser::lookup(const std::string &name, CommandQueue::CommandType &type) {
+  static const std::unordered_map<std::string, CommandQueue::CommandType> types = {
+    {"END",     CommandQueue::CommandType::END},
+    {"CONT",    CommandQueue::CommandType::CONT},
+    {"HGET",    CommandQueue::CommandType::HGET},
+    {"HPUT",    CommandQueue::CommandType::HPUT},
+    {"HPOST",   CommandQueue::CommandType::HPOST},
+    {"DELETE",  CommandQueue::CommandType::DELETE},
+    {"EXEC",    CommandQueue::CommandType::EXEC},
+    {"GET",     CommandQueue::CommandType::GET},
+    {"SHOW",    CommandQueue::CommandType::SHOW},
+    {"DEFAULT", CommandQueue::CommandType::DEFAULT},
+    {"SUB",     CommandQueue::CommandType::SUB},
+    {"UNSUB",   CommandQueue::CommandType::UNSUB}
+  };
+  auto it = types.find(name);
+  if(it == types.end()) return false;
+  type = it->second;
+  return true;
+}
+
+/**
+ * @brief Parse the next piece of the package
+ *
+ * Every command completed by this piece is passed to the command handler before
+ * this returns.
+ *
+ * @return false if the package is invalid. Further data is ignored then.
+ */
+bool P2Parser::feed(const char *data, size_t length) {
+  if(state == State::Error) return false;
+  if(state == State::Done) return true;  // anything after the package object is ignored
+
+  buffer.append(data, length);
+  Step result;
+  do {
+    result = step();
+  } while(result == Step::Progress && state != State::Done);
+
+  if(result == Step::Fail) {
+    state = State::Error;
+    buffer.clear();
+    pos = 0;
+    return false;
+  }
+  // only the incomplete rest is kept
+  buffer.erase(0, pos);
+  pos = 0;
+  return true;
+}
+
+/**
+ * @brief Signal the end of the package
+ *
+ * @return false if the package was invalid or incomplete
+ */
+bool P2Parser::finish() {
+  return state == State::Done;
+}
+
+/**
+ * @brief Parse a complete package at once
+ *
+ * @return false if the package is invalid or incomplete
+ */
+bool P2Parser::parse(const std::string &package) {
+  return feed(package.data(), package.size()) && finish();
+}
+
+P2Parser::Step P2Parser::step() {
+  return format == Codec::Format::CBOR ? step_cbor() : step_json();
+}
+
+P2Parser::Step P2Parser::step_json() {
+  const char *data = buffer.data();
+  const char *end = data + buffer.size();
+  const char *p = json_skip_whitespace(data + pos, end);
+  if(p == end) return Step::NeedMore;
+
+  switch(state) {
+    case State::Start:
+      if(*p != '{') return Step::Fail;
+      pos = p + 1 - data;
+      first_in_container = true;
+      state = State::Members;
+      return Step::Progress;
+
+    case State::Members: {
+      if(*p == '}') {
+        pos = p + 1 - data;
+        state = State::Done;
+        return Step::Progress;
+      }
+      if(!first_in_container) {
+        if(*p != ',') return Step::Fail;
+        p = json_skip_whitespace(p + 1, end);
+        if(p == end) return Step::NeedMore;
+      }
+      if(*p != '"') return Step::Fail;
+      const char *key_end = json_string_end(p, end);
+      if(!key_end) return Step::NeedMore;
+      const char *colon = json_skip_whitespace(key_end, end);
+      if(colon == end) return Step::NeedMore;
+      if(*colon != ':') return Step::Fail;
+
+      bool is_cmd = std::string(p + 1, key_end - 1) == "CMD";
+      pos = colon + 1 - data;
+      first_in_container = false;
+      state = is_cmd ? State::CommandsStart : State::SkipValue;
+      return Step::Progress;
+    }
+
+    case State::SkipValue: {
+      size_t length = json_value_length(p, end);
+      if(!length) return Step::NeedMore;
+      pos = p + length - data;
+      state = State::Members;
+      return Step::Progress;
+    }
+
+    case State::CommandsStart:
+      if(*p != '[') return Step::Fail;
+      pos = p + 1 - data;
+      first_in_container = true;
+      state = State::Commands;
+      return Step::Progress;
+
+    case State::Commands: {
+      if(*p == ']') {
+        pos = p + 1 - data;
+        first_in_container = false;  // back in the package object, after the "CMD" member
+        state = State::Members;
+        return Step::Progress;
+      }
+      if(!first_in_container) {
+        if(*p != ',') return Step::Fail;
+        p = json_skip_whitespace(p + 1, end);
+        if(p == end) return Step::NeedMore;
+      }
+      size_t length = json_value_length(p, end);
+      if(!length) return Step::NeedMore;
+      pos = p + length - data;
+      first_in_container = false;
+      return dispatch(p, p + length) ? Step::Progress : Step::Fail;
+    }
+
+    default:
+      return Step::Fail;
+  }
+}
+
+P2Parser::Step P2Parser::step_cbor() {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(buffer.data()) + pos;
+  const size_t avail = buffer.size() - pos;
+
+  // containers may be complete without any further data
+  if(state == State::Members && remaining_members == 0) {
+    state = State::Done;
+    return Step::Progress;
+  }
+  if(state == State::Commands && remaining_commands == 0) {
+    state = State::Members;
+    return Step::Progress;
+  }
+  if(avail == 0) return Step::NeedMore;
+
+  unsigned major; uint64_t arg; bool indefinite; size_t length;
+  switch(state) {
+    case State::Start:
+    case State::CommandsStart: {
+      if(!cbor_header(p, avail, major, arg, indefinite, length)) return Step::Fail;
+      if(!length) return Step::NeedMore;
+      long count = indefinite ? -1 : static_cast<long>(arg);
+      if(state == State::Start) {
+        if(major != 5) return Step::Fail;
+        remaining_members = count;
+        state = State::Members;
+      } else {
+        if(major != 4) return Step::Fail;
+        remaining_commands = count;
+        state = State::Commands;
+      }
+      pos += length;
+      return Step::Progress;
+    }
+
+    case State::Members: {
+      if(remaining_members < 0 && p[0] == 0xff) {
+        pos += 1;
+        state = State::Done;
+        return Step::Progress;
+      }
+      if(!cbor_item_length(p, avail, length)) return Step::Fail;
+      if(!length) return Step::NeedMore;
+      // only definite length text strings can be "CMD", anything else is skipped with its value
+      size_t header;
+      cbor_header(p, avail, major, arg, indefinite, header);
+      bool is_cmd = major == 3 && !indefinite && std::string(reinterpret_cast<const char *>(p + header), arg) == "CMD";
+      pos += length;
+      if(remaining_members > 0) --remaining_members;
+      state = is_cmd ? State::CommandsStart : State::SkipValue;
+      return Step::Progress;
+    }
+
+    case State::SkipValue:
+      if(!cbor_item_length(p, avail, length)) return Step::Fail;
+      if(!length) return Step::NeedMore;
+      pos += length;
+      state = State::Members;
+      return Step::Progress;
+
+    case State::Commands: {
+      if(remaining_commands < 0 && p[0] == 0xff) {
+        pos += 1;
+        state = State::Members;
+        return Step::Progress;
+      }
+      if(!cbor_item_length(p, avail, length)) return Step::Fail;
+      if(!length) return Step::NeedMore;
+      pos += length;
+      if(remaining_commands > 0) --remaining_commands;
+      const char *begin = reinterpret_cast<const char *>(p);
+      return dispatch(begin, begin + length) ? Step::Progress : Step::Fail;
+    }
+
+    default:
+      return Step::Fail;
+  }
+}
+
+/**
+ * @brief Parse one complete command and pass it to the command handler
+ *
+ * Unknown or malformed commands are skipped with a warning.
+ *
+ * @return false if the data can't be parsed at all
+ */
+bool P2Parser::dispatch(const char *begin, const char *end) {
+  CommandBuilder builder;
+  if(!json::sax_parse(begin, end, &builder, format == Codec::Format::CBOR ? json::input_format_t::cbor : json::input_format_t::json)) {
+    return false;
+  }
+  if(!builder.valid || !builder.named) {
+    LOG_WARNING("WARNING: Received malformed command. Ignoring.");
+    return true;
+  }
+  if(!lookup(builder.name, builder.command.type)) {
+    LOG_WARNING("WARNING: Received unknown command " << builder.name << ". Ignoring.");
+    return true;
+  }
+  LOG_DEBUG("Next Command is " << builder.name);
+  on_command(builder.command);
+  return true;
+}
+
+} // namespace
@@ -1,16 +1,10 @@
 #include "Session.h"
 
-#include <iostream>
 // #include <nlohmann/json.hpp>
 
-#define CPPHTTPLIB_OPENSSL_SUPPORT
-
-#include <httplib.h>
-// httplib includes some arpa stuff, which defines DELETE as a macro, but we use it as a enum value for OMADM commands
-#undef DELETE
-
-
 #include "CommandQueue.h"
+#include "HttpTransport.h"
+#include "Log.h"
 
 #include "base64.h"
 
@@ -18,123 +12,334 @@ namespace Grandma {
   
   using namespace nlohmann;
 
-  // httplib::Client http_client("10.223.27.113", 9988);
-  // httplib::SSLClient http_client("10.223.27.113", 9988);
-  httplib::Client http_client("localhost", 9988);
+  Session::Session(MOTree &motree, CommandQueue &command_queue, ConnectionPool &connection_pool, SessionMetrics &metrics) 
+    : state(SessionState::Idle), motree(motree), command_queue(command_queue), connection_pool(connection_pool), metrics(metrics), end_received(false),
+      continue_session(false), package_format(Codec::Format::JSON), compression_mode(Compression::Mode::Auto) {
+    set_server_url("http://localhost:9988/path");
+  }
+
+  /**
+   * Choose the encoding of the packages sent to the server. The default is JSON.
+   *
+   * With CBOR, the server is also asked to answer in CBOR, but JSON answers are
+   * still accepted. Received packages are always decoded according to their content type.
+   */
+  void Session::set_package_format(Codec::Format format) {
+    package_format = format;
+  }
 
-  Session::Session(MOTree &motree, CommandQueue &command_queue) : motree(motree), command_queue(command_queue) {}
+  Codec::Format Session::get_package_format()
+  const {
+    return package_format;
+  }
 
-  std::string Session::send_P1(std::string p1_json) {
-    // http(s) send P1
-    httplib::Headers headers = {
-      {"OMADM-DevID", "PlanB"},
-      {"Accept", "application/vnd.oma.dm.request+json"}
-    };
-    
-    auto res = http_client.Post("/path", headers, p1_json, "application/vnd.oma.dm.initiation+json");
-    
-    if(res) {
-      std::cerr << "http result is: " << res->status << std::endl;
-      std::string p2_body = res->body;
-      std::cout << "Server response is:" << std::endl << p2_body << std::endl;
-      return p2_body;
-    } else {
-      std::cerr << "ERROR: connection to server failed when trying to send P1" << std::endl;
-      return "";
+  /**
+   * Choose if and when package bodies are sent compressed. The default is Auto,
+   * see Compression::Mode
+   */
+  void Session::set_compression(Compression::Mode mode) {
+    compression_mode = mode;
+  }
+
+  /**
+   * @brief Compression totals over all packages of all sessions so far
+   *
+   * @param[in] received - false: packages sent to the server, true: packages received from the server
+   */
+  Compression::Stats Session::get_compression_stats(bool received)
+  const {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return received ? compression_received : compression_sent;
+  }
+
+  /**
+   * @brief Mark the start of a new session
+   *
+   * @return false if another session is still running. Otherwise the state is now P1.
+   */
+  bool Session::begin() {
+    SessionState idle = SessionState::Idle;
+    if(!state.compare_exchange_strong(idle, SessionState::P1)) return false;
+    end_received = false;
+    return true;
+  }
+
+  void Session::set_state(SessionState new_state) {
+    state = new_state;
+  }
+
+  Session::SessionState Session::get_state()
+  const {
+    return state;
+  }
+
+  /**
+   * @return true if the server ended the current (or last) session with an END command
+   */
+  bool Session::ended_by_server()
+  const {
+    return end_received;
+  }
+
+  /**
+   * Send packages to the DM server at the given URL, using an HttpTransport.
+   * Replaces any transport set before.
+   *
+   * @return false if the url can't be parsed. The transport is unchanged in this case.
+   */
+  bool Session::set_server_url(const std::string url) {
+    Helper::URL parsed_url;
+    if(!parsed_url.parse_from_string(url)) {
+      LOG_ERROR("ERROR: could not parse server URL " << url);
+      return false;
     }
+    transport = std::make_shared<HttpTransport>(connection_pool, parsed_url);
+    server_url = url;
+    return true;
+  }
+
+  std::string Session::get_server_url()
+  const {
+    return server_url;
+  }
 
-    // receive P2?
-    // std::string p2_body = base64_decode(res->body);
+  /**
+   * Device ID sent to the server with every package (OMADM-DevID header)
+   */
+  void Session::set_device_id(const std::string id) {
+    device_id = id;
+  }
 
+  /**
+   * Replace the transport used to deliver packages to the server. The default is
+   * an HttpTransport to the DM server.
+   */
+  void Session::set_transport(std::shared_ptr<Transport> transport) {
+    this->transport = transport;
   }
 
-  bool Session::parse_P2(std::string p2_json) {
-    bool session_continue = true;
+  /**
+   * @brief Prepare sending a package, and parsing the P2 package the server answers with
+   *
+   * The P2 is parsed while it is received, and each command is queued as soon as it was
+   * parsed. Nothing executes before the exchange is complete though, and if the P2 turns
+   * out to be truncated or corrupt, its commands are dropped again (see end_exchange()).
+   *
+   * The time spent building the package, parsing the P2 and the rest of the exchange
+   * (network and server) are recorded separately in the session metrics. Time the
+   * package writer spends waiting doesn't count for any of them.
+   *
+   * @param[in] content_type - of the package, without the format suffix
+   * @param[in] writer - produces the serialized package, in the format set with set_package_format()
+   * @param[in] package - P1 or P3, which package is sent
+   * @return the exchange, to be sent with exchange() or exchange_async()
+   */
+  std::shared_ptr<Session::Exchange> Session::begin_exchange(const std::string &content_type, Transport::BodyWriter writer, SessionMetrics::Package package) {
+    auto exchange = std::make_shared<Exchange>();
+    Exchange *e = exchange.get();   // the callbacks are owned by the exchange
+    e->package = package;
+    e->transport = transport;
+    e->started = SessionMetrics::Clock::now();
+    e->build_time = e->wait_time = e->parse_time = SessionMetrics::Clock::duration(0);
+    e->sent_bytes = e->received_bytes = 0;
 
-    std::cout << "Parsing package 2:" << std::endl;
-    json jcommands;
-    try {
-      jcommands = json::parse(p2_json)["CMD"];
-    } catch (const nlohmann::detail::parse_error &err) {
-      std::cout << "ERROR parsing P2 received from server. Ending session." << std::endl;
-      session_continue = false;
+    Transport::Request &request = e->request;
+    request.content_type = Codec::content_type(content_type, package_format);
+    request.headers["OMADM-DevID"] = device_id;
+    request.accept = Codec::content_type("application/vnd.oma.dm.request", package_format);
+    if(package_format != Codec::Format::JSON) {
+      request.accept += ", application/vnd.oma.dm.request+json;q=0.5";
     }
-    for(auto &jcommand : jcommands) {
-      std::cout << "Next Command is " << jcommand[0] << std::endl;
-      if(jcommand[0] == "END") {
-	      std::cout << "Received END command." << std::endl;
-	      session_continue = false;
-	      continue;
-      }
+    request.compression = compression_mode;
 
-      CommandQueue::Command command; // TODO presize
-      for(size_t i = 1; i < jcommand.size(); ++i) {
-        std::cout << "Parameter " << i - 1 << " is: " << jcommand[i] << std::endl;
-        command.parameter.push_back(jcommand[i]);
-      }
-      if(jcommand[0] == "CONT") {
-        command.type = CommandQueue::CommandType::CONT;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "HGET") {
-        command.type = CommandQueue::CommandType::HGET;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "HPUT") {
-        command.type = CommandQueue::CommandType::HPUT;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "HPOST") {
-        command.type = CommandQueue::CommandType::HPOST;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "DELETE") {
-        command.type = CommandQueue::CommandType::DELETE;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "EXEC") {
-        command.type = CommandQueue::CommandType::EXEC;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "GET") {
-        command.type = CommandQueue::CommandType::GET;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "SHOW") {
-        command.type = CommandQueue::CommandType::SHOW;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "DEFAULT") {
-        command.type = CommandQueue::CommandType::DEFAULT;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "SUB") {
-        command.type = CommandQueue::CommandType::SUB;
-        command_queue.push_command(command);
-	      continue;
-      }
-      if(jcommand[0] == "UNSUB") {
-        command.type = CommandQueue::CommandType::UNSUB;
-        command_queue.push_command(command);
-	      continue;
+    request.body_writer = [e, writer](const Transport::BodySink &sink) {
+      // the writer's time is spent building, sending (in the sink) or waiting, e.g. 
+      // for commands to finish (see SessionMetrics::Stopwatch::Pause)
+      auto writer_started = SessionMetrics::Clock::now();
+      SessionMetrics::Clock::duration send_time(0);
+      SessionMetrics::Stopwatch stopwatch;
+      e->sent_bytes = 0;   // the transport may start over on a new connection
+      bool ok = writer([e, &sink, &send_time](const char *data, size_t length) {
+        auto send_started = SessionMetrics::Clock::now();
+        bool sent = sink(data, length);
+        e->sent_bytes += length;
+        send_time += SessionMetrics::Clock::now() - send_started;
+        return sent;
+      });
+      auto working_time = stopwatch.elapsed();
+      e->build_time += working_time - send_time;
+      e->wait_time += SessionMetrics::Clock::now() - writer_started - working_time;
+      return ok;
+    };
+
+    request.response_sink = [this, e](const Transport::Response &response, const char *data, size_t length) {
+      auto parse_started = SessionMetrics::Clock::now();
+      if(!e->parser) {
+        // the encoding is only known with the response
+        e->parser.reset(new P2Parser(Codec::format_of(response.content_type), [this](CommandQueue::Command &command) {
+          queue_command(command);
+        }));
       }
-      std::cout << "WARNING: Received unknown command " << jcommand[0] << ". Ignoring." << std::endl;
+      bool ok = e->parser->feed(data, length);
+      e->received_bytes += length;
+      e->parse_time += SessionMetrics::Clock::now() - parse_started;
+      return ok;
+    };
+
+    continue_session = true;
+    return exchange;
+  }
+
+  /**
+   * @brief Send the package of an exchange, and wait for the P2 to be received and parsed
+   *
+   * @return false if the package could not be delivered. See continues() for the outcome otherwise
+   */
+  bool Session::exchange(Exchange &exchange) {
+    return end_exchange(exchange, exchange.transport->post(exchange.request, exchange.response));
+  }
+
+  /**
+   * @brief Send the package of an exchange, the P2 is received and parsed on the event loop
+   *
+   * If the transport can't send asynchronously, the package is sent with a blocking post()
+   * on the calling thread instead, and done is called before this returns.
+   *
+   * @param[in] done - called with false if the package could not be delivered. See continues() for the outcome otherwise
+   */
+  void Session::exchange_async(std::shared_ptr<Exchange> exchange, EventLoop &loop, std::function<void(bool)> done) {
+    auto finish = [this, exchange, done](bool delivered) {
+      done(end_exchange(*exchange, delivered));
+    };
+    if(!exchange->transport->post_async(exchange->request, exchange->response, loop, finish)) {
+      finish(exchange->transport->post(exchange->request, exchange->response));
+    }
+  }
+
+  /**
+   * @brief Conclude an exchange, once its package was sent and the answer received (or not)
+   *
+   * @param[in] delivered - false if the package could not be delivered
+   * @return delivered
+   */
+  bool Session::end_exchange(Exchange &exchange, bool delivered) {
+    auto finish_started = SessionMetrics::Clock::now();
+    if(!delivered || !exchange.parser || !exchange.parser->finish()) {
+      if(delivered) LOG_ERROR("ERROR parsing P2 received from server. Ending session.");
+      command_queue.clear_commands();
+      end_received = false;
+      continue_session = false;
+      if(!delivered) return false;
     }
-    return session_continue;
+    exchange.parse_time += SessionMetrics::Clock::now() - finish_started;
+
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      compression_sent.add(exchange.response.request_compression);
+      compression_received.add(exchange.response.response_compression);
+    }
+
+    bool p1 = exchange.package == SessionMetrics::Package::P1;
+    metrics.record(p1 ? SessionMetrics::Phase::P1Build : SessionMetrics::Phase::P3Build, exchange.build_time);
+    metrics.record(p1 ? SessionMetrics::Phase::P1RoundTrip : SessionMetrics::Phase::P3RoundTrip,
+                   SessionMetrics::Clock::now() - exchange.started - exchange.build_time - exchange.wait_time - exchange.parse_time);
+    metrics.record(SessionMetrics::Phase::P2Parse, exchange.parse_time);
+    metrics.record(exchange.package, exchange.sent_bytes);
+    metrics.record(SessionMetrics::Package::P2, exchange.received_bytes);
+    return true;
+  }
+
+  // called for each command of a P2 that was parsed successfully
+  void Session::queue_command(CommandQueue::Command &command) {
+    switch(command.type) {
+      case CommandQueue::CommandType::END:
+        LOG_INFO("Received END command.");
+        end_received = true;
+        continue_session = false;
+        break;
+      case CommandQueue::CommandType::CONT:
+        // nothing to execute, the session simply continues with P3 after the other commands
+        break;
+      default:
+        command_queue.push_command(std::move(command));
+    }
+  }
+
+  /**
+   * @brief Send package P1 and receive the first package P2
+   *
+   * Like P3, the P1 package is streamed to the server while p1_writer produces it,
+   * so its size (mostly the MgmtTree) doesn't matter for memory use. The commands
+   * of the P2 received in return are queued in the command queue.
+   *
+   * @param[in] p1_writer - produces the serialized P1 package, in the format set with set_package_format()
+   * @return false if P1 could not be delivered
+   */
+  bool Session::send_P1(Transport::BodyWriter p1_writer) {
+    if(!exchange(*begin_exchange("application/vnd.oma.dm.initiation", p1_writer, SessionMetrics::Package::P1))) {
+      LOG_ERROR("ERROR: connection to server failed when trying to send P1");
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Send package P3 and receive the next package P2
+   *
+   * The P3 package is streamed to the server while p3_writer produces it, so the
+   * writer can send the status of each command as soon as it is known, while later
+   * commands of the same round are still executing. The commands of the P2 received
+   * in return are queued in the command queue.
+   *
+   * @param[in] p3_writer - produces the serialized P3 package, in the format set with set_package_format()
+   * @return false if P3 could not be delivered
+   */
+  bool Session::send_P3(Transport::BodyWriter p3_writer) {
+    if(!exchange(*begin_exchange("application/vnd.oma.dm.response", p3_writer, SessionMetrics::Package::P3))) {
+      LOG_ERROR("ERROR: connection to server failed when trying to send P3");
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Send package P1, the first package P2 is received on the event loop
+   *
+   * Like send_P1(), but only building the package happens on the calling thread (see
+   * Transport::post_async()). Waiting for and parsing the P2 doesn't hold a thread.
+   *
+   * @param[in] p1_writer - produces the serialized P1 package, in the format set with set_package_format()
+   * @param[in] loop - event loop that receives the P2
+   * @param[in] done - called when the P2 is received, with false if P1 could not be delivered.
+   *    Usually on the loop thread, but on the calling thread if the transport can only send blocking.
+   */
+  void Session::send_P1_async(Transport::BodyWriter p1_writer, EventLoop &loop, std::function<void(bool)> done) {
+    exchange_async(begin_exchange("application/vnd.oma.dm.initiation", p1_writer, SessionMetrics::Package::P1), loop, [done](bool delivered) {
+      if(!delivered) LOG_ERROR("ERROR: connection to server failed when trying to send P1");
+      done(delivered);
+    });
+  }
+
+  /**
+   * @brief Send package P3, the next package P2 is received on the event loop
+   *
+   * Like send_P3(), see send_P1_async(). The P3 is complete before it is sent though, so
+   * p3_writer should only be called when all commands of the round have executed.
+   */
+  void Session::send_P3_async(Transport::BodyWriter p3_writer, EventLoop &loop, std::function<void(bool)> done) {
+    exchange_async(begin_exchange("application/vnd.oma.dm.response", p3_writer, SessionMetrics::Package::P3), loop, [done](bool delivered) {
+      if(!delivered) LOG_ERROR("ERROR: connection to server failed when trying to send P3");
+      done(delivered);
+    });
   }
 
-  std::string Session::send_P3(std::string p3_json) {
-    (void)p3_json;
-    return "{\"CMD\": [ [ \"END\" ] ] }";
+  /**
+   * @return true if the last P2 received was valid and did not end the session, so
+   *    its commands need to be executed and answered with P3
+   */
+  bool Session::continues()
+  const {
+    return continue_session;
   }
 
 } // namespace
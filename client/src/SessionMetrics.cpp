@@ -0,0 +1,266 @@
+/**
+ * Session latency metrics for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "SessionMetrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Grandma {
+
+/**
+ * @{
+ * Histogram
+ */
+Histogram::Snapshot::Snapshot() : count(0), sum(0), max(0), buckets(bucket_count, 0) {}
+
+double Histogram::Snapshot::mean()
+const {
+  return count ? static_cast<double>(sum) / count : 0;
+}
+
+/**
+ * @brief Value below or at which p percent of the recorded values are
+ *
+ * This is the upper limit of the bucket the value falls into, but never more than the
+ * largest value recorded. 0 if nothing was recorded.
+ */
+uint64_t Histogram::Snapshot::percentile(double p)
+const {
+  if(count == 0) return 0;
+  uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100 * count));
+  if(rank < 1) rank = 1;
+
+  uint64_t seen = 0;
+  for(size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+    seen += buckets[bucket];
+    if(seen >= rank) return std::min(bucket_limit(bucket), max);
+  }
+  return max;
+}
+
+/**
+ * Add the values of another snapshot, e.g. to get the distribution over many clients
+ */
+void Histogram::Snapshot::merge(const Snapshot &other) {
+  count += other.count;
+  sum += other.sum;
+  max = std::max(max, other.max);
+  for(size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+    buckets[bucket] += other.buckets[bucket];
+  }
+}
+
+nlohmann::json Histogram::Snapshot::json()
+const {
+  return {
+    {"count", count},
+    {"mean", mean()},
+    {"p50", percentile(50)},
+    {"p90", percentile(90)},
+    {"p99", percentile(99)},
+    {"p999", percentile(99.9)},
+    {"max", max}
+  };
+}
+
+Histogram::Histogram() {
+  reset();
+}
+
+void Histogram::record(uint64_t value) {
+  buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+  uint64_t seen = max.load(std::memory_order_relaxed);
+  while(value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+  // last, so that a snapshot never has more in count than in the buckets
+  count.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * @brief Copy of the current values
+ *
+ * Values recorded while the snapshot is taken may be partially included, the snapshot
+ * is consistent enough for statistics but not exact.
+ */
+Histogram::Snapshot Histogram::snapshot()
+const {
+  Snapshot result;
+  result.count = count.load(std::memory_order_acquire);
+  result.sum = sum.load(std::memory_order_relaxed);
+  result.max = max.load(std::memory_order_relaxed);
+  for(size_t bucket = 0; bucket < bucket_count; ++bucket) {
+    result.buckets[bucket] = buckets[bucket].load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+void Histogram::reset() {
+  for(auto &bucket : buckets) bucket.store(0, std::memory_order_relaxed);
+  count.store(0, std::memory_order_relaxed);
+  sum.store(0, std::memory_order_relaxed);
+  max.store(0, std::memory_order_relaxed);
+}
+
+size_t Histogram::bucket_of(uint64_t value) {
+  const uint64_t linear = 1 << sub_bits;
+  if(value < linear) return value;
+
+  unsigned exponent = 63 - __builtin_clzll(value);
+  if(exponent > max_exponent) return bucket_count - 1;
+  unsigned shift = exponent - sub_bits;
+  return linear + shift * linear + ((value >> shift) & (linear - 1));
+}
+
+uint64_t Histogram::bucket_limit(size_t bucket) {
+  const uint64_t linear = 1 << sub_bits;
+  if(bucket < linear) return bucket;
+
+  unsigned shift = (bucket - linear) / linear;
+  uint64_t sub_bucket = (bucket - linear) % linear;
+  return ((linear + sub_bucket + 1) << shift) - 1;
+}
+/**
+ * @}
+ */
+
+/**
+ * @{
+ * SessionMetrics::Stopwatch
+ */
+thread_local SessionMetrics::Stopwatch *SessionMetrics::Stopwatch::current = nullptr;
+
+SessionMetrics::Stopwatch::Stopwatch() : started(Clock::now()), paused(0), outer(current) {
+  current = this;
+}
+
+SessionMetrics::Stopwatch::~Stopwatch() {
+  current = outer;
+}
+
+SessionMetrics::Clock::duration SessionMetrics::Stopwatch::elapsed()
+const {
+  return Clock::now() - started - paused;
+}
+
+SessionMetrics::Stopwatch::Pause::Pause() : started(Clock::now()), stopwatch(current) {}
+
+SessionMetrics::Stopwatch::Pause::~Pause() {
+  if(stopwatch) stopwatch->paused += Clock::now() - started;
+}
+/**
+ * @}
+ */
+
+void SessionMetrics::record(Phase phase, Clock::duration duration) {
+  phases[static_cast<size_t>(phase)].record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+void SessionMetrics::record(CommandQueue::CommandType type, Clock::duration duration) {
+  commands[static_cast<size_t>(type)].record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+void SessionMetrics::record(Package package, uint64_t bytes) {
+  packages[static_cast<size_t>(package)].record(bytes);
+}
+
+/**
+ * @brief Distribution of the duration of a session phase, in nanoseconds
+ *
+ * The count of Phase::Total is the number of sessions.
+ */
+Histogram::Snapshot SessionMetrics::latency(Phase phase)
+const {
+  return phases[static_cast<size_t>(phase)].snapshot();
+}
+
+/**
+ * @brief Distribution of the execution time of commands of the given type, in nanoseconds
+ */
+Histogram::Snapshot SessionMetrics::command_latency(CommandQueue::CommandType type)
+const {
+  return commands[static_cast<size_t>(type)].snapshot();
+}
+
+/**
+ * @brief Distribution of the size of a package, in bytes before compression
+ */
+Histogram::Snapshot SessionMetrics::package_size(Package package)
+const {
+  return packages[static_cast<size_t>(package)].snapshot();
+}
+
+/**
+ * @brief Summary of all metrics, e.g. for reporting them to a monitoring system
+ *
+ * Durations are in nanoseconds, sizes in bytes. Command types that were never executed
+ * are left out.
+ */
+nlohmann::json SessionMetrics::report()
+const {
+  nlohmann::json result;
+  for(size_t phase = 0; phase < phase_count; ++phase) {
+    result["latency"][name(static_cast<Phase>(phase))] = phases[phase].snapshot().json();
+  }
+  result["commands"] = nlohmann::json::object();
+  for(size_t type = 0; type < command_count; ++type) {
+    Histogram::Snapshot snapshot = commands[type].snapshot();
+    if(snapshot.count) result["commands"][name(static_cast<CommandQueue::CommandType>(type))] = snapshot.json();
+  }
+  for(size_t package = 0; package < package_count; ++package) {
+    result["bytes"][name(static_cast<Package>(package))] = packages[package].snapshot().json();
+  }
+  return result;
+}
+
+void SessionMetrics::reset() {
+  for(auto &histogram : phases) histogram.reset();
+  for(auto &histogram : commands) histogram.reset();
+  for(auto &histogram : packages) histogram.reset();
+}
+
+const char *SessionMetrics::name(Phase phase) {
+  switch(phase) {
+    case Phase::P1Build:      return "P1Build";
+    case Phase::P1RoundTrip:  return "P1RoundTrip";
+    case Phase::P2Parse:      return "P2Parse";
+    case Phase::P3Build:      return "P3Build";
+    case Phase::P3RoundTrip:  return "P3RoundTrip";
+    case Phase::Total:        return "Total";
+  }
+  return "";
+}
+
+const char *SessionMetrics::name(Package package) {
+  switch(package) {
+    case Package::P1: return "P1";
+    case Package::P2: return "P2";
+    case Package::P3: return "P3";
+  }
+  return "";
+}
+
+const char *SessionMetrics::name(CommandQueue::CommandType type) {
+  switch(type) {
+    case CommandQueue::CommandType::END:      return "END";
+    case CommandQueue::CommandType::CONT:     return "CONT";
+    case CommandQueue::CommandType::HGET:     return "HGET";
+    case CommandQueue::CommandType::HPUT:     return "HPUT";
+    case CommandQueue::CommandType::HPOST:    return "HPOST";
+    case CommandQueue::CommandType::DELETE:   return "DELETE";
+    case CommandQueue::CommandType::EXEC:     return "EXEC";
+    case CommandQueue::CommandType::GET:      return "GET";
+    case CommandQueue::CommandType::SHOW:     return "SHOW";
+    case CommandQueue::CommandType::DEFAULT:  return "DEFAULT";
+    case CommandQueue::CommandType::SUB:      return "SUB";
+    case CommandQueue::CommandType::UNSUB:    return "UNSUB";
+  }
+  return "";
+}
+
+} // namespace
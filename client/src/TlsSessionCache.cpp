@@ -0,0 +1,253 @@
+/**
+ * TLS session cache for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "TlsSessionCache.h"
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Log.h"
+
+namespace Grandma {
+
+namespace {
+
+  /**
+   * Write a file only the owner can read, whatever the umask. The data is written to a
+   * new temporary file that is renamed into place, so a file that already exists with
+   * wider permissions is replaced, and readers never see a partially written file.
+   */
+  bool write_private_file(const std::string &filename, const unsigned char *data, size_t length) {
+    const std::string temp = filename + ".tmp";
+    ::unlink(temp.c_str());
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd < 0) return false;
+    bool ok = true;
+    while(ok && length > 0) {
+      ssize_t written = ::write(fd, data, length);
+      ok = written > 0;
+      if(ok) {
+        data += written;
+        length -= written;
+      }
+    }
+    ok = (::close(fd) == 0) && ok;
+    if(!ok || std::rename(temp.c_str(), filename.c_str()) != 0) {
+      ::unlink(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // what gets attached to each SSL_CTX. Owned by the SSL_CTX (freed in binding_free)
+  struct Binding {
+    std::shared_ptr<TlsSessionCache> cache;
+    std::string origin;
+  };
+
+  void binding_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp) {
+    (void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+    delete static_cast<Binding *>(ptr);
+  }
+
+  int binding_index() {
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, binding_free);
+    return index;
+  }
+
+  Binding *binding_of(const SSL *ssl) {
+    return static_cast<Binding *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), binding_index()));
+  }
+
+  bool is_expired(const SSL_SESSION *session) {
+    return SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < static_cast<long>(std::time(nullptr));
+  }
+
+} // namespace
+
+double TlsSessionCache::Stats::resumption_ratio()
+const {
+  return handshakes ? static_cast<double>(resumed) / handshakes : 0.0;
+}
+
+TlsSessionCache::TlsSessionCache() : counters() {}
+
+TlsSessionCache::~TlsSessionCache() {
+  clear();
+}
+
+/**
+ * @brief Attach the cache to an SSL context
+ *
+ * After this, every connection made with the given context will offer a cached
+ * session for the given origin, and will store new sessions received from the
+ * server in the cache. Must be called before the first connection is made.
+ *
+ * @param[in] cache - the cache to attach. The context keeps it alive.
+ * @param[in] ctx - SSL context of an https client (e.g. httplib::Client::ssl_context())
+ * @param[in] origin - key to store sessions under, usually "https://<host>:<port>"
+ */
+void TlsSessionCache::attach(std::shared_ptr<TlsSessionCache> cache, SSL_CTX *ctx, const std::string &origin) {
+  if(!cache || !ctx) return;
+
+  // replaces (and frees) any previous binding of this context
+  SSL_CTX_set_ex_data(ctx, binding_index(), new Binding{cache, origin});
+
+  // we look up and set sessions ourselves, OpenSSL's internal client cache is not used
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, new_session_callback);
+  SSL_CTX_set_info_callback(ctx, info_callback);
+}
+
+/**
+ * @brief Persist sessions in the given directory
+ *
+ * Every session received from a server will also be written to a file in this
+ * directory, and sessions not found in memory will be looked up there. This way
+ * sessions survive restarts of the application. Pass an empty string to disable.
+ *
+ * Note that a persisted session contains the session's master secret, so the
+ * directory must not be readable by anyone else than the application. The files
+ * are created readable by their owner only (mode 0600).
+ */
+void TlsSessionCache::set_persist_dir(const std::string &dir) {
+  std::lock_guard<std::mutex> lock(mutex);
+  persist_dir = dir;
+}
+
+/**
+ * @brief Forget all sessions held in memory (persisted sessions are kept)
+ */
+void TlsSessionCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for(auto &session : sessions) {
+    SSL_SESSION_free(session.second);
+  }
+  sessions.clear();
+}
+
+TlsSessionCache::Stats TlsSessionCache::stats()
+const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+std::string TlsSessionCache::persist_filename(const std::string &origin)
+const {
+  std::string name;
+  for(char c : origin) {
+    name += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  return persist_dir + "/" + name + ".tls";
+}
+
+/**
+ * @brief Keep a new session received from the server. Takes over the caller's reference.
+ */
+void TlsSessionCache::store(const std::string &origin, SSL_SESSION *session) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = sessions.find(origin);
+  if(it != sessions.end()) {
+    SSL_SESSION_free(it->second);
+    it->second = session;
+  } else {
+    sessions[origin] = session;
+  }
+  ++counters.sessions_stored;
+
+  if(persist_dir != "") {
+    int len = i2d_SSL_SESSION(session, nullptr);
+    if(len > 0) {
+      std::vector<unsigned char> der(len);
+      unsigned char *p = der.data();
+      i2d_SSL_SESSION(session, &p);
+      if(!write_private_file(persist_filename(origin), der.data(), der.size())) {
+        LOG_WARNING("Warning: TlsSessionCache - could not persist TLS session for " << origin);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Find a resumable session for the origin
+ *
+ * Must be called with the mutex held. Returns nullptr if there is none. The returned
+ * session stays owned by the cache.
+ */
+SSL_SESSION *TlsSessionCache::lookup(const std::string &origin) {
+  auto it = sessions.find(origin);
+  if(it == sessions.end() && persist_dir != "") {
+    std::ifstream file(persist_filename(origin), std::ios::binary);
+    std::vector<unsigned char> der((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const unsigned char *p = der.data();
+    SSL_SESSION *session = der.empty() ? nullptr : d2i_SSL_SESSION(nullptr, &p, der.size());
+    if(session) {
+      it = sessions.insert(std::make_pair(origin, session)).first;
+    }
+  }
+  if(it == sessions.end()) return nullptr;
+
+  if(!SSL_SESSION_is_resumable(it->second) || is_expired(it->second)) {
+    SSL_SESSION_free(it->second);
+    sessions.erase(it);
+    return nullptr;
+  }
+  return it->second;
+}
+
+void TlsSessionCache::count_handshake(bool resumed) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++counters.handshakes;
+  if(resumed) ++counters.resumed;
+}
+
+/**
+ * OpenSSL callback, called for every session (TLS 1.3: every ticket) received from the server
+ *
+ * Returning 1 tells OpenSSL that we keep the reference to the session.
+ */
+int TlsSessionCache::new_session_callback(SSL *ssl, SSL_SESSION *session) {
+  Binding *binding = binding_of(ssl);
+  if(!binding) return 0;
+  binding->cache->store(binding->origin, session);
+  return 1;
+}
+
+/**
+ * OpenSSL callback, used to offer a cached session right before the ClientHello is
+ * built, and to count completed handshakes.
+ *
+ * httplib doesn't let us see the SSL object before it calls SSL_connect(), so the
+ * start-of-handshake notification is the earliest point where we can set the session.
+ */
+void TlsSessionCache::info_callback(const SSL *ssl, int where, int ret) {
+  (void)ret;
+  Binding *binding = binding_of(ssl);
+  if(!binding) return;
+
+  if(where & SSL_CB_HANDSHAKE_START) {
+    TlsSessionCache &cache = *binding->cache;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    SSL_SESSION *session = cache.lookup(binding->origin);
+    if(session) {
+      SSL_set_session(const_cast<SSL *>(ssl), session);
+    }
+  }
+  if(where & SSL_CB_HANDSHAKE_DONE) {
+    binding->cache->count_handshake(SSL_session_reused(const_cast<SSL *>(ssl)));
+  }
+}
+
+} // namespace
@@ -0,0 +1,107 @@
+/**
+ * MgmtTree synchronization state for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "TreeSyncState.h"
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+
+#include <nlohmann/json.hpp>
+
+#include "Log.h"
+
+namespace Grandma {
+
+using namespace nlohmann;
+
+/**
+ * @brief Persist acknowledged versions in the given directory
+ *
+ * Pass an empty string to keep them in memory only (the default).
+ */
+void TreeSyncState::set_persist_dir(const std::string &dir) {
+  std::lock_guard<std::mutex> lock(mutex);
+  persist_dir = dir;
+}
+
+std::string TreeSyncState::persist_filename(const std::string &server)
+const {
+  std::string name;
+  for(char c : server) {
+    name += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  return persist_dir + "/" + name + ".sync";
+}
+
+/**
+ * @brief Versions of the MO instances the server has last seen
+ *
+ * @param[in] server - identifies the server (and device), e.g. "<devid> <server url>"
+ * @return empty if the server has not acknowledged anything yet. All MO instances need to be sent completely then.
+ */
+TreeSyncState::Versions TreeSyncState::acknowledged_versions(const std::string &server) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = acknowledged.find(server);
+  if(it != acknowledged.end()) return it->second;
+  if(persist_dir == "") return Versions();
+
+  Versions versions;
+  std::ifstream file(persist_filename(server));
+  if(file) {
+    json jversions = json::parse(file, nullptr, false);
+    if(jversions.is_object()) {
+      for(auto &jversion : jversions.items()) {
+        const json &value = jversion.value();
+        if(value.is_object() && value["Epoch"].is_string() && value["Version"].is_number_unsigned()) {
+          versions[jversion.key()] = Version{value["Epoch"].get<std::string>(), value["Version"].get<unsigned long>()};
+        }
+      }
+    } else {
+      LOG_WARNING("Warning: TreeSyncState - ignoring unreadable " << persist_filename(server));
+    }
+  }
+  acknowledged[server] = versions;
+  return versions;
+}
+
+/**
+ * @brief Record that the server has seen the given versions
+ *
+ * Replaces everything acknowledged for this server before, so MO instances missing
+ * in versions will be sent completely next time.
+ */
+void TreeSyncState::acknowledge(const std::string &server, const Versions &versions) {
+  std::lock_guard<std::mutex> lock(mutex);
+  acknowledged[server] = versions;
+
+  if(persist_dir != "") {
+    json jversions = json::object();
+    for(auto &version : versions) {
+      jversions[version.first] = {{"Epoch", version.second.epoch}, {"Version", version.second.version}};
+    }
+    std::ofstream file(persist_filename(server), std::ios::trunc);
+    if(!(file << jversions.dump())) {
+      LOG_WARNING("Warning: TreeSyncState - could not persist MgmtTree versions for " << server);
+    }
+  }
+}
+
+/**
+ * @brief Forget what the server has seen, so the next P1 carries the full MgmtTree
+ */
+void TreeSyncState::forget(const std::string &server) {
+  std::lock_guard<std::mutex> lock(mutex);
+  acknowledged.erase(server);
+  if(persist_dir != "") {
+    std::remove(persist_filename(server).c_str());
+  }
+}
+
+} // namespace
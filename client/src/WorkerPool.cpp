@@ -0,0 +1,85 @@
+/**
+ * Worker thread pool for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * See class description in header file
+ *
+ */
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+namespace Grandma {
+
+/**
+ * @param[in] n_threads - number of worker threads. 0 chooses a default based on the number of CPUs.
+ */
+WorkerPool::WorkerPool(unsigned n_threads) : stopping(false) {
+  if(n_threads == 0) {
+    // commands are mostly waiting for the network, so use more threads than cores
+    n_threads = std::max(4u, 2 * std::thread::hardware_concurrency());
+  }
+  for(unsigned i = 0; i < n_threads; ++i) {
+    workers.emplace_back(&WorkerPool::work, this);
+  }
+}
+
+/**
+ * Finishes all tasks already submitted, then joins the worker threads
+ */
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  task_ready.notify_all();
+  for(auto &worker : workers) {
+    worker.join();
+  }
+}
+
+/**
+ * @brief Queue a task for execution by one of the workers
+ *
+ * @return future that becomes ready when the task has finished
+ */
+std::future<void> WorkerPool::submit(std::function<void()> task) {
+  auto packaged = std::make_shared<std::packaged_task<void()>>(task);
+  std::future<void> done = packaged->get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.emplace_back([packaged]{ (*packaged)(); });
+  }
+  task_ready.notify_one();
+  return done;
+}
+
+unsigned WorkerPool::size()
+const {
+  return workers.size();
+}
+
+/**
+ * @brief The process wide default pool, shared by all DMClient instances that weren't given their own
+ */
+std::shared_ptr<WorkerPool> WorkerPool::shared() {
+  static std::shared_ptr<WorkerPool> pool = std::make_shared<WorkerPool>();
+  return pool;
+}
+
+void WorkerPool::work() {
+  for(;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      task_ready.wait(lock, [this]{ return stopping || !tasks.empty(); });
+      if(tasks.empty()) return; // stopping, and nothing left to do
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+} // namespace
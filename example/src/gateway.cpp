@@ -0,0 +1,82 @@
+/**
+ * Example gateway application: many DMClient instances in one process
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Creates a number of independent clients (one per simulated downstream device),
+ * all sharing the same connection and worker pools, runs one session for each of
+ * them against an in-process loopback server, and reports the memory overhead per
+ * client instance.
+ *
+ * usage: dmgateway [number of clients] [ddf file]
+ */
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "DMClient.h"
+#include "LoopbackTransport.h"
+#include "MO_StaticData.h"
+
+using namespace Grandma;
+
+// resident set size of this process in bytes
+static long rss_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  long pages_total = 0, pages_resident = 0;
+  statm >> pages_total >> pages_resident;
+  return pages_resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned n_clients = argc > 1 ? std::stoul(argv[1]) : 1000;
+  std::string ddf = argc > 2 ? argv[2] : "../ddf/DevInfo.ddf";
+  if(n_clients == 0) {
+    std::cerr << "usage: dmgateway [number of clients (at least 1)] [ddf file]" << std::endl;
+    return 1;
+  }
+
+  auto connection_pool = std::make_shared<ConnectionPool>(16);
+  auto worker_pool = std::make_shared<WorkerPool>();
+
+  // a trivial server: every session ends right away
+  auto transport = std::make_shared<LoopbackTransport>(
+      [](const Transport::Request &, Transport::Response &response) {
+        response.status = 200;
+        response.body = "{\"CMD\": [ [ \"END\" ] ] }";
+        return true;
+      });
+
+  long rss_before = rss_bytes();
+
+  std::vector<std::unique_ptr<DMClient>> clients;
+  for(unsigned i = 0; i < n_clients; ++i) {
+    std::unique_ptr<DMClient> client(new DMClient(connection_pool, worker_pool));
+    client->set_device_id("gw-device-" + std::to_string(i));
+    client->set_transport(transport);
+    client->register_DDF("urn:oma:mo:oma-dm-devinfo:1.2", ddf);
+
+    auto devinfo = std::make_shared<MO::StaticData>("devinfo", ddf);
+    devinfo->local_set_node("DevID", "gw-device-" + std::to_string(i));
+    client->add_MO("urn:oma:mo:oma-dm-devinfo:1.2", devinfo);
+
+    clients.push_back(std::move(client));
+  }
+  long rss_created = rss_bytes();
+
+  for(auto &client : clients) {
+    client->start_session();
+  }
+  long rss_after = rss_bytes();
+
+  std::cerr << "clients:                     " << n_clients << std::endl;
+  std::cerr << "sizeof(DMClient):            " << sizeof(DMClient) << " bytes" << std::endl;
+  std::cerr << "memory per client (created): " << (rss_created - rss_before) / n_clients << " bytes" << std::endl;
+  std::cerr << "memory per client (session): " << (rss_after - rss_before) / n_clients << " bytes" << std::endl;
+
+  return 0;
+}
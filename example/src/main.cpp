@@ -1,6 +1,7 @@
 #include <memory>
 
 #include "DMClient.h"
+#include "Log.h"
 // #include "MO_DevInfo.h"
 #include "MO_StaticData.h"
 // #include <nlohmann/json.hpp>
@@ -10,6 +11,9 @@ using namespace Grandma;
 int main(int argc, char *argv[]) {
   (void)argc; (void)argv;
 
+  // show everything the client does
+  Log::set_level(Log::Level::Trace);
+
   DMClient client;
   client.set_device_id("PlanB");
   client.set_P1_dump_tree(true);
@@ -11,12 +11,17 @@
  *
  *  (1) callbacks called by the protocol client library as a direct result of protocol commands
  *  (2) callbacks called by the protocol client library as part of Session or MO management
+ *  (3) optional change tracking, so only changed nodes need to be sent to the server
+ *  (4) optional streaming of large node values (e.g. firmware packages) received with HGET
+ *  (5) optional batched access to node values, for MOs where accessing a node is expensive
  *
  */
 #ifndef GRANDMA_MO_INTERFACE_H
 #define GRANDMA_MO_INTERFACE_H
 
+#include <memory>
 #include <string>
+#include <vector>
 #include <nlohmann/json.hpp>
 
 namespace Grandma {
@@ -145,6 +150,146 @@ public:
   virtual void close_mo() = 0; // unclear
 
 
+  /**
+   *  @}
+   *  @{
+   *  (3) optional change tracking, so only changed nodes need to be sent to the server
+   *
+   *  The protocol client library uses these to include only the nodes changed since the
+   *  last session in the MgmtTree of package P1 (see DMClient::set_P1_dump_tree()). MO 
+   *  implementations that don't override them are always sent completely.
+   */
+
+  /**
+   * @brief identifies the history that the version numbers of change_version() belong to
+   *
+   * Version numbers are only compared if they belong to the same epoch. An MO that loses
+   * its change history (e.g. because the local application was restarted) must start a
+   * new epoch, so that the protocol client library falls back to sending the whole MO.
+   *
+   * @return epoch identifier, or an empty string if change tracking is not supported
+   */
+  virtual std::string change_epoch() const { return ""; }
+
+  /**
+   * @brief current version of the MO's data
+   *
+   * @return a number that increases with every change of the MO's nodes
+   */
+  virtual unsigned long change_version() const { return 0; }
+
+  /**
+   * @brief callback for listing the nodes changed since a given version
+   *
+   * @param[in] since - version as returned by change_version() earlier in the same epoch
+   * @param[out] changed - paths (relative to this MO's root) of leaf nodes changed or added after that version
+   * @param[out] removed - paths (relative to this MO's root) of nodes removed after that version
+   * @return Shall return false if the changes since that version can't be provided. The whole MO will be sent in this case.
+   */
+  virtual bool changed_nodes(unsigned long since, std::vector<std::string> &changed, std::vector<std::string> &removed) {
+    (void)since; (void)changed; (void)removed;
+    return false;
+  }
+
+  /**
+   * @}
+   * @{
+   * (4) optional streaming of large node values
+   *
+   * Without this, data received with HGET is collected in memory and handed to set_val() 
+   * as a whole. MOs that receive large values can instead provide a writer that gets the
+   * data piece by piece while it is downloaded.
+   */
+
+  /**
+   * @brief receives the value of a node piece by piece
+   */
+  class NodeWriter {
+  public:
+    virtual ~NodeWriter() {}
+
+    /**
+     * @brief called for each piece of data, in order
+     * @return Shall return false to abort the download
+     */
+    virtual bool write(const char *data, size_t length) = 0;
+
+    /**
+     * @brief called once after all data has been written
+     *
+     * @param[in] complete - false if the download failed or was aborted, the data written so far must be discarded then
+     * @return Shall return false if the node could not be updated with the data
+     */
+    virtual bool close(bool complete) = 0;
+  };
+
+  /**
+   * @brief callback for streaming a node value received with HGET
+   *
+   * Called from the thread executing the HGET command, the returned writer is used from 
+   * that thread only. Other calls into the MO may happen while the download is running.
+   *
+   * @param[in] node_path - path (relative to this MO's root) of the node to update
+   * @param[in] content_type - content type of the received data
+   * @return writer for the node value, or nullptr to receive the value with set_val() instead
+   */
+  virtual std::unique_ptr<NodeWriter> open_node_writer(const std::string node_path, const std::string content_type) {
+    (void)node_path; (void)content_type;
+    return nullptr;
+  }
+
+  /**
+   * @}
+   * @{
+   * (5) optional batched access to node values
+   *
+   * The protocol client library often reads or writes many nodes at once, e.g. all leaves
+   * of an MO instance for the MgmtTree of package P1, or a subtree for HPUT/HPOST and HGET
+   * of MO data. It then uses these methods instead of get_val() / set_val(). MOs whose 
+   * nodes are expensive to access one by one (e.g. kept in a database or another process)
+   * can override them to handle all nodes in one round trip. The defaults call get_val() 
+   * and set_val() for each node.
+   */
+
+  /**
+   * @brief result of reading one node, see get_val() for the meaning of the members
+   */
+  struct Value {
+    std::string data;
+    bool node_exists = true;
+    bool valid_data = true;
+  };
+
+  /**
+   * @brief callback for reading the values of several nodes
+   *
+   * @param[in] node_paths - paths (relative to this MO's root) of the nodes to read
+   * @param[out] values - must receive one Value per path, in the same order
+   */
+  virtual void get_vals(const std::vector<std::string> &node_paths, std::vector<Value> &values) {
+    values.resize(node_paths.size());
+    for(size_t i = 0; i < node_paths.size(); ++i) {
+      values[i].node_exists = true;
+      values[i].valid_data = true;
+      values[i].data = get_val(node_paths[i], values[i].node_exists, values[i].valid_data);
+    }
+  }
+
+  /**
+   * @brief callback for writing the values of several nodes
+   *
+   * @param[in] node_paths - paths (relative to this MO's root) of the nodes to update
+   * @param[in] data - the new value of each node, in the same order
+   * @return Shall return true if all nodes were successfully updated
+   */
+  virtual bool set_vals(const std::vector<std::string> &node_paths, const std::vector<std::string> &data) {
+    bool updated = node_paths.size() == data.size();
+    for(size_t i = 0; i < node_paths.size() && i < data.size(); ++i) {
+      if(!set_val(node_paths[i], data[i])) updated = false;
+    }
+    return updated;
+  }
+
   /**
    * @}
    */
@@ -0,0 +1,43 @@
+/** ***************************************************************************
+ * Visitor for node trees
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Node trees (the DDF derived trees of the MO types in the client library, the cached
+ * data of MO::BaseCached) are walked in pre-order and report each node to a TreeVisitor:
+ *
+ *   enter(path, name)        before the children of an interior node
+ *   leave(path, name)        after the children of an interior node
+ *   leaf(path, name, data)   for a leaf node
+ *
+ * path is the full path of the node ("/A/B/C", starting with the path the walk started
+ * at) and name its last segment ("C"). Both are buffers of the walk that are reused for
+ * every node, so they are only valid during the call. data is the value of the leaf if
+ * the tree holds one, nullptr otherwise.
+ *
+ * If a callback returns false the walk stops, and the method walking the tree returns
+ * false as well (e.g. when writing to a package failed).
+ *
+ * This is part of the interface, so local applications can walk the trees of their MOs
+ * as well, for example to dump or validate them.
+ */
+#ifndef GRANDMA_TREEVISITOR_H
+#define GRANDMA_TREEVISITOR_H
+
+#include <string>
+
+namespace Grandma {
+
+class TreeVisitor {
+
+public:
+  virtual ~TreeVisitor() {}
+
+  virtual bool enter(const std::string &path, const std::string &name) = 0;
+  virtual bool leave(const std::string &path, const std::string &name) = 0;
+  virtual bool leaf(const std::string &path, const std::string &name, const std::string *data) = 0;
+};
+
+} // namespace
+
+#endif
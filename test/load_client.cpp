@@ -0,0 +1,177 @@
+/**
+ * Load test client for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Runs sessions of many DMClient instances (one per simulated device, all sharing the
+ * same connection and worker pools) against a DM server, usually load_server, and
+ * reports sessions per second and the latency percentiles of the whole fleet, merged
+ * from the session metrics of all clients (see SessionMetrics).
+ *
+ * All clients run their sessions at the same time, each client runs the given number
+ * of sessions one after the other.
+ *
+ * usage: load_client [--url http://localhost:9988/path] [--clients n] [--sessions n]
+ *                    [--ddf ../ddf/Fumo.ddf] [--connections n] [--workers n] [--format json|cbor]
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "DMClient.h"
+#include "Log.h"
+#include "MO_StaticData.h"
+
+using namespace Grandma;
+
+namespace {
+
+  struct Options {
+    std::string url = "http://localhost:9988/path";
+    unsigned clients = 1000;
+    unsigned sessions = 10;
+    std::string ddf = "../ddf/Fumo.ddf";
+    unsigned connections = 64;
+    unsigned workers = 0;
+    Codec::Format format = Codec::Format::JSON;
+  };
+
+  bool parse_options(int argc, char *argv[], Options &options) {
+    for(int i = 1; i + 1 < argc; i += 2) {
+      std::string option = argv[i], value = argv[i + 1];
+      if(option == "--url") options.url = value;
+      else if(option == "--clients") options.clients = std::strtoul(value.c_str(), nullptr, 10);
+      else if(option == "--sessions") options.sessions = std::strtoul(value.c_str(), nullptr, 10);
+      else if(option == "--ddf") options.ddf = value;
+      else if(option == "--connections") options.connections = std::strtoul(value.c_str(), nullptr, 10);
+      else if(option == "--workers") options.workers = std::strtoul(value.c_str(), nullptr, 10);
+      else if(option == "--format" && (value == "json" || value == "cbor")) {
+        options.format = value == "cbor" ? Codec::Format::CBOR : Codec::Format::JSON;
+      }
+      else return false;
+    }
+    return argc % 2 == 1 && options.clients > 0;
+  }
+
+  // distribution in milliseconds
+  nlohmann::json milliseconds(const Histogram::Snapshot &snapshot) {
+    return {
+      {"count", snapshot.count},
+      {"mean_ms", snapshot.mean() / 1e6},
+      {"p50_ms", snapshot.percentile(50) / 1e6},
+      {"p90_ms", snapshot.percentile(90) / 1e6},
+      {"p99_ms", snapshot.percentile(99) / 1e6},
+      {"max_ms", snapshot.max / 1e6}
+    };
+  }
+
+  /**
+   * Runs the sessions of all clients and waits until all of them completed
+   */
+  class Fleet {
+    std::vector<std::unique_ptr<DMClient>> clients;
+    unsigned sessions_per_client;
+
+    std::mutex mutex;
+    std::condition_variable all_done;
+    unsigned running;
+    std::atomic<unsigned long long> failed;
+
+  public:
+    Fleet(const Options &options) : sessions_per_client(options.sessions), running(0), failed(0) {
+      auto connection_pool = std::make_shared<ConnectionPool>(options.connections);
+      auto worker_pool = std::make_shared<WorkerPool>(options.workers);
+
+      for(unsigned i = 0; i < options.clients; ++i) {
+        std::string device = "load-device-" + std::to_string(i);
+        std::unique_ptr<DMClient> client(new DMClient(connection_pool, worker_pool));
+        client->set_device_id(device);
+        client->set_server_url(options.url);
+        client->set_package_format(options.format);
+        client->register_DDF("urn:oma:mo:oma-fumo:1.0", options.ddf);
+        client->add_MO("urn:oma:mo:oma-fumo:1.0", std::make_shared<MO::StaticData>("fumo", options.ddf), "apps");
+        clients.push_back(std::move(client));
+      }
+    }
+
+    void run() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = clients.size();
+      }
+      for(auto &client : clients) next_session(*client, sessions_per_client);
+
+      std::unique_lock<std::mutex> lock(mutex);
+      all_done.wait(lock, [this]{ return running == 0; });
+    }
+
+    unsigned long long failures() const { return failed; }
+
+    // the distributions of all clients merged
+    nlohmann::json report() const {
+      const SessionMetrics::Phase phases[] = {
+        SessionMetrics::Phase::P1Build, SessionMetrics::Phase::P1RoundTrip, SessionMetrics::Phase::P2Parse,
+        SessionMetrics::Phase::P3Build, SessionMetrics::Phase::P3RoundTrip, SessionMetrics::Phase::Total
+      };
+      nlohmann::json result;
+      for(auto phase : phases) {
+        Histogram::Snapshot merged;
+        for(auto &client : clients) merged.merge(client->session_metrics().latency(phase));
+        result["latency"][SessionMetrics::name(phase)] = milliseconds(merged);
+      }
+      Histogram::Snapshot hget;
+      for(auto &client : clients) hget.merge(client->session_metrics().command_latency(CommandQueue::CommandType::HGET));
+      result["latency"]["HGET"] = milliseconds(hget);
+      return result;
+    }
+
+  private:
+    // starts the next session of the client when its previous one completed
+    void next_session(DMClient &client, unsigned remaining) {
+      if(remaining == 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(--running == 0) all_done.notify_all();
+        return;
+      }
+      client.start_session_async(false, [this, &client, remaining](bool success) {
+        if(!success) ++failed;
+        next_session(client, remaining - 1);
+      });
+    }
+  };
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if(!parse_options(argc, argv, options)) {
+    std::cerr << "usage: " << argv[0] << " [--url http://localhost:9988/path] [--clients n] [--sessions n]"
+              << " [--ddf ../ddf/Fumo.ddf] [--connections n] [--workers n] [--format json|cbor]" << std::endl;
+    return 1;
+  }
+
+  Log::set_level(Log::Level::Error);
+
+  Fleet fleet(options);
+  auto started = std::chrono::steady_clock::now();
+  fleet.run();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  unsigned long long sessions = static_cast<unsigned long long>(options.clients) * options.sessions;
+  nlohmann::json summary = fleet.report();
+  summary["clients"] = options.clients;
+  summary["sessions"] = sessions;
+  summary["failed_sessions"] = fleet.failures();
+  summary["duration_s"] = elapsed;
+  summary["sessions_per_s"] = sessions / elapsed;
+  std::cout << summary.dump(2) << std::endl;
+  return fleet.failures() ? 1 : 0;
+}
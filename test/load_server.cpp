@@ -0,0 +1,388 @@
+/**
+ * Load test server for Grandma OMA-DM client library
+ *
+ * (c)2020 Christian Bendele
+ *
+ * Answers every session with the same scripted sequence of P2 packages, for any number
+ * of clients at the same time. Sessions are told apart by the device id (OMADM-DevID
+ * header): P1 starts the script from the beginning, each P3 gets the next package.
+ * HGET payloads of any size are served from /payload/<bytes>.
+ *
+ * The script is a JSON file with one array of commands per round:
+ *
+ *   { "rounds": [
+ *       [ ["HGET", "${server}/payload/65536", "urn:oma:mo:oma-fumo:1.0/apps/PkgName"] ],
+ *       [ ["CONT"] ],
+ *       [ ["END"] ] ] }
+ *
+ * "${server}" is replaced with the URL of this server. An END round is added if the
+ * script doesn't end with one. Without a script, the example above is used, with the
+ * payload size given by --payload.
+ *
+ * Sessions per second and percentiles of the session duration and of the client's
+ * turnaround (from sending a P2 until the next package arrives) are reported
+ * periodically, and a JSON summary when the server stops (after --sessions sessions
+ * or --duration seconds). Run load_client against it to benchmark whole sessions.
+ *
+ * httplib serves each connection on one thread of its pool, for as long as the connection
+ * is kept alive, also while it is idle. So --threads limits the number of connections
+ * served at the same time, connections beyond that wait until a thread is free. It
+ * must be at least the number of connections the clients keep open: for load_client
+ * its --connections, for clients with a connection each the number of clients. Idle
+ * connections are closed after --keep-alive seconds (0 closes every connection after
+ * its request, so threads are never held by idle connections).
+ *
+ * usage: load_server [--port 9988] [--script file] [--payload bytes] [--threads n]
+ *                    [--keep-alive s] [--sessions n] [--duration s] [--report s]
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <httplib.h>
+#include <nlohmann/json.hpp>
+
+using namespace nlohmann;
+
+namespace {
+
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    std::string host = "localhost";
+    int port = 9988;
+    std::string script;
+    unsigned long payload = 1024;
+    unsigned threads = 1024;          // connections served at the same time, see above
+    unsigned keep_alive = 2;          // seconds, 0: no keep-alive
+    unsigned long long sessions = 0;  // stop after this many sessions, 0: never
+    double duration = 0;              // stop after this many seconds, 0: never
+    double report = 5;
+  };
+
+  bool is_cbor(const std::string &content_type) {
+    std::string type = content_type.substr(0, content_type.find(';'));
+    return type.size() >= 5 && type.compare(type.size() - 5, 5, "+cbor") == 0;
+  }
+
+  void replace_all(std::string &text, const std::string &from, const std::string &to) {
+    for(size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, pos + to.size())) {
+      text.replace(pos, from.size(), to);
+    }
+  }
+
+  /**
+   * The P2 packages of all rounds, encoded up front in both formats
+   */
+  class Script {
+    std::vector<std::string> json_rounds;
+    std::vector<std::string> cbor_rounds;
+
+  public:
+    bool load(const Options &options) {
+      json script;
+      if(options.script.empty()) {
+        script["rounds"] = {
+          {{"HGET", "${server}/payload/" + std::to_string(options.payload), "urn:oma:mo:oma-fumo:1.0/apps/PkgName"}},
+          {{"CONT"}},
+          {{"END"}}
+        };
+      } else {
+        std::ifstream file(options.script);
+        script = json::parse(file, nullptr, false);
+        if(script.is_discarded() || !script["rounds"].is_array()) {
+          std::cerr << "ERROR: could not read script " << options.script << std::endl;
+          return false;
+        }
+      }
+
+      json rounds = script["rounds"];
+      if(rounds.empty() || rounds.back() != json({{"END"}})) rounds.push_back({{"END"}});
+
+      std::string server = "http://" + options.host + ":" + std::to_string(options.port);
+      for(auto &commands : rounds) {
+        std::string encoded = json({{"CMD", commands}}).dump();
+        replace_all(encoded, "${server}", server);
+        json package = json::parse(encoded);
+        std::vector<uint8_t> cbor = json::to_cbor(package);
+        json_rounds.push_back(encoded);
+        cbor_rounds.push_back(std::string(cbor.begin(), cbor.end()));
+      }
+      return true;
+    }
+
+    size_t rounds() const { return json_rounds.size(); }
+
+    const std::string &package(size_t round, bool cbor) const {
+      round = std::min(round, json_rounds.size() - 1);
+      return cbor ? cbor_rounds[round] : json_rounds[round];
+    }
+  };
+
+  /**
+   * Sessions in progress, keyed by device id. Split into shards with their own lock,
+   * so that thousands of sessions don't all contend for one mutex.
+   */
+  class Sessions {
+  public:
+    struct Session {
+      size_t round;                       // index of the next P2 to send
+      Clock::time_point started;
+      Clock::time_point last_response;
+    };
+
+  private:
+    static const size_t shard_count = 64;
+    struct Shard {
+      std::mutex mutex;
+      std::unordered_map<std::string, Session> sessions;
+    };
+    Shard shards[shard_count];
+
+    Shard &shard(const std::string &device) {
+      return shards[std::hash<std::string>()(device) % shard_count];
+    }
+
+  public:
+    /**
+     * @brief Find out which round to answer a package with
+     *
+     * @param[in] initiation - the package is a P1, the session starts over
+     * @param[out] round - the round to send
+     * @param[out] turnaround - time since the last P2 of this session was sent, 0 for P1
+     * @param[out] duration - total duration if this is the last round
+     * @return true if the session ends with this round
+     */
+    bool next(const std::string &device, bool initiation, size_t rounds, size_t &round,
+              Clock::duration &turnaround, Clock::duration &duration) {
+      auto now = Clock::now();
+      Shard &s = shard(device);
+      std::lock_guard<std::mutex> lock(s.mutex);
+      auto inserted = s.sessions.emplace(device, Session {0, now, now});
+      auto it = inserted.first;
+      if(inserted.second || initiation) {
+        it->second = Session {0, now, now};
+        turnaround = Clock::duration(0);
+      } else {
+        turnaround = now - it->second.last_response;
+      }
+      round = it->second.round++;
+      it->second.last_response = now;
+      if(round + 1 < rounds) return false;
+
+      duration = now - it->second.started;
+      s.sessions.erase(it);
+      return true;
+    }
+
+    size_t active() {
+      size_t count = 0;
+      for(auto &s : shards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        count += s.sessions.size();
+      }
+      return count;
+    }
+  };
+
+  /**
+   * Counters and latency samples, per report interval and in total
+   */
+  class Stats {
+    std::mutex mutex;
+    std::vector<long long> session_us;       // durations of the sessions completed in this interval
+    std::vector<long long> turnaround_us;
+    std::vector<long long> all_session_us;
+    std::vector<long long> all_turnaround_us;
+
+  public:
+    std::atomic<unsigned long long> sessions {0};
+    std::atomic<unsigned long long> packages {0};
+    std::atomic<unsigned long long> payloads {0};
+    std::atomic<unsigned long long> payload_bytes {0};
+
+    void package(Clock::duration turnaround, bool ended, Clock::duration duration) {
+      ++packages;
+      if(ended) ++sessions;
+      std::lock_guard<std::mutex> lock(mutex);
+      if(turnaround.count()) turnaround_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(turnaround).count());
+      if(ended) session_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    }
+
+    // samples of the interval, which are moved to the totals
+    void take_interval(std::vector<long long> &sessions_out, std::vector<long long> &turnarounds_out) {
+      std::lock_guard<std::mutex> lock(mutex);
+      all_session_us.insert(all_session_us.end(), session_us.begin(), session_us.end());
+      all_turnaround_us.insert(all_turnaround_us.end(), turnaround_us.begin(), turnaround_us.end());
+      sessions_out.swap(session_us);
+      turnarounds_out.swap(turnaround_us);
+      session_us.clear();
+      turnaround_us.clear();
+    }
+
+    void take_totals(std::vector<long long> &sessions_out, std::vector<long long> &turnarounds_out) {
+      std::vector<long long> ignored_sessions, ignored_turnarounds;
+      take_interval(ignored_sessions, ignored_turnarounds);
+      std::lock_guard<std::mutex> lock(mutex);
+      sessions_out = all_session_us;
+      turnarounds_out = all_turnaround_us;
+    }
+  };
+
+  json percentiles(std::vector<long long> samples) {
+    json result;
+    result["count"] = samples.size();
+    if(samples.empty()) return result;
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples](double p) {
+      return samples[std::min(samples.size() - 1, static_cast<size_t>(p / 100 * samples.size()))];
+    };
+    result["p50_us"] = at(50);
+    result["p90_us"] = at(90);
+    result["p99_us"] = at(99);
+    result["p999_us"] = at(99.9);
+    result["max_us"] = samples.back();
+    return result;
+  }
+
+  std::string summary_line(const json &latency) {
+    if(!latency.contains("p50_us")) return "-";
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << latency["p50_us"].get<long long>() / 1000.0 << "/"
+         << latency["p99_us"].get<long long>() / 1000.0 << "/" << latency["max_us"].get<long long>() / 1000.0 << " ms";
+    return line.str();
+  }
+
+  bool parse_options(int argc, char *argv[], Options &options) {
+    for(int i = 1; i + 1 < argc; i += 2) {
+      std::string option = argv[i], value = argv[i + 1];
+      if(option == "--host") options.host = value;
+      else if(option == "--port") options.port = std::atoi(value.c_str());
+      else if(option == "--script") options.script = value;
+      else if(option == "--payload") options.payload = std::strtoul(value.c_str(), nullptr, 10);
+      else if(option == "--threads") options.threads = std::max(1UL, std::strtoul(value.c_str(), nullptr, 10));
+      else if(option == "--keep-alive") options.keep_alive = std::strtoul(value.c_str(), nullptr, 10);
+      else if(option == "--sessions") options.sessions = std::strtoull(value.c_str(), nullptr, 10);
+      else if(option == "--duration") options.duration = std::atof(value.c_str());
+      else if(option == "--report") options.report = std::max(0.1, std::atof(value.c_str()));
+      else return false;
+    }
+    return argc % 2 == 1;
+  }
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if(!parse_options(argc, argv, options)) {
+    std::cerr << "usage: " << argv[0] << " [--host localhost] [--port 9988] [--script file] [--payload bytes] [--threads n]"
+              << " [--keep-alive s] [--sessions n] [--duration s] [--report s]" << std::endl;
+    return 1;
+  }
+
+  Script script;
+  if(!script.load(options)) return 1;
+  Sessions sessions;
+  Stats stats;
+
+  std::mutex payloads_mutex;
+  std::map<unsigned long, std::shared_ptr<const std::string>> payloads;
+
+  httplib::Server svr;
+  svr.new_task_queue = [&options] { return new httplib::ThreadPool(options.threads); };
+  // an idle keep-alive connection holds its thread until the timeout, see above
+  svr.set_keep_alive_max_count(options.keep_alive ? 1000000 : 1);
+  svr.set_keep_alive_timeout(std::max(1U, options.keep_alive));
+
+  svr.Post("/path", [&](const httplib::Request &req, httplib::Response &res) {
+    bool cbor = is_cbor(req.get_header_value("Content-Type"));
+    bool initiation = req.get_header_value("Content-Type").find("application/vnd.oma.dm.initiation") == 0;
+
+    size_t round;
+    Clock::duration turnaround(0), duration(0);
+    bool ended = sessions.next(req.get_header_value("OMADM-DevID"), initiation, script.rounds(), round, turnaround, duration);
+    stats.package(turnaround, ended, duration);
+
+    res.set_content(script.package(round, cbor), cbor ? "application/vnd.oma.dm.request+cbor" : "application/vnd.oma.dm.request+json");
+  });
+
+  svr.Get(R"(/payload/(\d+))", [&](const httplib::Request &req, httplib::Response &res) {
+    unsigned long size = std::strtoul(req.matches[1].str().c_str(), nullptr, 10);
+    std::shared_ptr<const std::string> payload;
+    {
+      std::lock_guard<std::mutex> lock(payloads_mutex);
+      auto &cached = payloads[size];
+      if(!cached) cached = std::make_shared<const std::string>(size, 'x');
+      payload = cached;
+    }
+    ++stats.payloads;
+    stats.payload_bytes += size;
+    res.set_content(*payload, "application/octet-stream");
+  });
+
+  std::atomic<bool> listen_failed(false);
+  std::thread server([&svr, &options, &listen_failed] {
+    if(!svr.listen(options.host.c_str(), options.port)) {
+      std::cerr << "ERROR: could not listen on " << options.host << ":" << options.port << std::endl;
+      listen_failed = true;
+    }
+  });
+
+  std::cout << "Serving " << script.rounds() << " rounds per session on " << options.host << ":" << options.port << std::endl;
+
+  auto started = Clock::now();
+  auto last_report = started;
+  unsigned long long last_sessions = 0;
+  while(!listen_failed) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - started).count();
+    bool done = (options.sessions && stats.sessions >= options.sessions) || (options.duration > 0 && elapsed >= options.duration);
+
+    double interval = std::chrono::duration<double>(now - last_report).count();
+    if(interval >= options.report || done) {
+      std::vector<long long> session_us, turnaround_us;
+      stats.take_interval(session_us, turnaround_us);
+      unsigned long long completed = stats.sessions;
+      std::cout << "t=" << static_cast<long>(elapsed) << "s  sessions/s " << static_cast<long>((completed - last_sessions) / interval)
+                << "  active " << sessions.active() << "  session p50/p99/max " << summary_line(percentiles(session_us))
+                << "  turnaround p50/p99/max " << summary_line(percentiles(turnaround_us)) << std::endl;
+      last_sessions = completed;
+      last_report = now;
+    }
+    if(done) break;
+  }
+
+  svr.stop();
+  server.join();
+  if(listen_failed) return 1;
+
+  double elapsed = std::chrono::duration<double>(Clock::now() - started).count();
+  std::vector<long long> session_us, turnaround_us;
+  stats.take_totals(session_us, turnaround_us);
+  json summary = {
+    {"duration_s", elapsed},
+    {"sessions", stats.sessions.load()},
+    {"sessions_per_s", stats.sessions / elapsed},
+    {"packages", stats.packages.load()},
+    {"payloads", stats.payloads.load()},
+    {"payload_bytes", stats.payload_bytes.load()},
+    {"rounds_per_session", script.rounds()},
+    {"session_latency", percentiles(session_us)},
+    {"turnaround_latency", percentiles(turnaround_us)}
+  };
+  std::cout << summary.dump(2) << std::endl;
+  return 0;
+}
@@ -1,10 +1,74 @@
+#include <chrono>
 #include <iostream>
 #include <httplib.h>
 #include <nlohmann/json.hpp>
 
+using namespace nlohmann;
+
+namespace {
+
+  bool is_cbor(const std::string &content_type) {
+    std::string type = content_type.substr(0, content_type.find(';'));
+    return type.size() >= 5 && type.compare(type.size() - 5, 5, "+cbor") == 0;
+  }
+
+  long long micros_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // decode a package in the encoding given by its content type, and report how both
+  // encodings compare for it, so JSON and CBOR can be benchmarked on real packages
+  json decode_and_compare(const std::string &body, const std::string &content_type) {
+    const int rounds = 1000;
+    json package;
+
+    auto start = std::chrono::steady_clock::now();
+    if(is_cbor(content_type)) {
+      package = json::from_cbor(body, true, false);
+    } else {
+      package = json::parse(body, nullptr, false);
+    }
+    std::cout << "Received " << (is_cbor(content_type) ? "CBOR" : "JSON") << " package, " << body.size() 
+      << " bytes, decoded in " << micros_since(start) << " us" << std::endl;
+    if(package.is_discarded()) {
+      std::cerr << "Could not decode package" << std::endl;
+      return package;
+    }
+
+    std::string as_json = package.dump();
+    std::vector<uint8_t> as_cbor = json::to_cbor(package);
+
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i) as_json = package.dump();
+    long long json_encode = micros_since(start);
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i) package = json::parse(as_json);
+    long long json_decode = micros_since(start);
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i) as_cbor = json::to_cbor(package);
+    long long cbor_encode = micros_since(start);
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i) package = json::from_cbor(as_cbor);
+    long long cbor_decode = micros_since(start);
+
+    std::cout << "  JSON: " << as_json.size() << " bytes, encode " << json_encode * 1000 / rounds 
+      << " ns, decode " << json_decode * 1000 / rounds << " ns" << std::endl;
+    std::cout << "  CBOR: " << as_cbor.size() << " bytes, encode " << cbor_encode * 1000 / rounds
+      << " ns, decode " << cbor_decode * 1000 / rounds << " ns" << std::endl;
+    return package;
+  }
+
+  // encode a package the way the client sent (or asked for) it
+  std::string encode(const json &package, bool cbor) {
+    if(!cbor) return package.dump();
+    std::vector<uint8_t> encoded = json::to_cbor(package);
+    return std::string(encoded.begin(), encoded.end());
+  }
+
+} // namespace
+
 int main() {
   using namespace httplib;
-  using namespace nlohmann;
 
   Server svr;
 
@@ -20,7 +84,9 @@ int main() {
     for(auto header : req.headers) {
       std::cout << header.first << " : " << header.second << std::endl;
     }
-    std::cout << "Request body is:" << std::endl << req.body << std::endl;
+    bool cbor = is_cbor(req.get_header_value("Content-Type"));
+    json package = decode_and_compare(req.body, req.get_header_value("Content-Type"));
+    std::cout << "Request package is:" << std::endl << package << std::endl;
     
     std::string response;
     json p2; json cmd;
@@ -30,28 +96,28 @@ int main() {
 	std::cout << "State is INITIAL" << std::endl;	
 	cmd.push_back(json({"HGET","http://localhost:9988/test_hget","urn:oma:mo:oma-fumo:1.0/apps/DownloadAndUpdate/PkgURL"}));
 	p2["CMD"] = cmd;
-	response = p2.dump();
+	response = encode(p2, cbor);
 	state = TEST_HGET_HGET;
 	break;
       case TEST_HGET_END:
 	std::cout << "State is TEST_HGET" << std::endl; 
 	cmd.push_back(json({"END"}));
 	p2["CMD"] = cmd;
-	response = p2.dump();
+	response = encode(p2, cbor);
 	std::cout << "FINISHED" << std::endl;
 	exit(0);
 	break;
       default:
 	cmd.push_back(json({"END"}));
 	p2["CMD"] = cmd;
-	response = p2.dump();
+	response = encode(p2, cbor);
 	std::cerr << "UNEXPECTED protocol package received during HGET test (was expecting HGET http connection)" << std::endl;
 	exit(1);
 	break;
     }
 
 
-    res.set_content(response, "application/vnd.oma.dm.request+json");
+    res.set_content(response, cbor ? "application/vnd.oma.dm.request+cbor" : "application/vnd.oma.dm.request+json");
 
     std::cout << "Responding to client." << std::endl;
     std::cout << "Response headers are: " << std::endl;
@@ -59,7 +125,7 @@ int main() {
       std::cout << header.first << " : " << header.second << std::endl;
     }
 
-    std::cout << "Response body is:" << std::endl << res.body << std::endl;
+    std::cout << "Response body is " << res.body.size() << " bytes" << std::endl;
   });
 
 
@@ -79,10 +145,13 @@ int main() {
     json jres;
     jres["MOData"]["fumo"]["DownloadAndUpdate"]["PkgURL"] = "COFFEEBABE";
 
-    std::string response = jres.dump();
-    res.set_content(response, "application/dmmo+json");
+    // CBOR if the client prefers it, see Accept header
+    bool cbor = req.get_header_value("Accept").find("application/dmmo+cbor") == 0;
+    std::string response = encode(jres, cbor);
+    res.set_content(response, cbor ? "application/dmmo+cbor" : "application/dmmo+json");
+    state = TEST_HGET_END;
 
-    std::cout << "Response body is:" << std::endl << res.body << std::endl;
+    std::cout << "Response body is:" << std::endl << jres << std::endl;
 
   });
   svr.listen("localhost", 9988);